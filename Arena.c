@@ -0,0 +1,85 @@
+/** \file Arena.c
+ *  \brief Bump allocator for the memory which is only needed while a request is handled.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Arena.h"
+
+/**
+ * \brief A block of memory, followed by the allocations.
+ */
+struct arena_block {
+	/** \brief Previous (older) block */
+	struct arena_block *next;
+	/** \brief Size of the block (excl. this header) */
+	size_t size;
+	/** \brief Bytes handed out */
+	size_t used;
+	/** \brief Keeps the allocations aligned */
+	_Alignas(ARENA_ALIGNMENT) char data[];
+};
+
+static struct arena_block *newBlock(size_t size, struct arena_block *next) {
+	struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+	if (block == NULL) {
+		return NULL;
+	}
+	block->next = next;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+void arenaInit(struct arena *arena, size_t blockSize) {
+	memset(arena, 0, sizeof(*arena));
+	arena->blockSize = blockSize;
+}
+
+void *arenaAlloc(struct arena *arena, size_t size) {
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+
+	struct arena_block *block = arena->blocks;
+	if (block == NULL || block->size - block->used < size) {
+		// at least double the capacity, so a large request only needs a few blocks
+		size_t blockSize = block ? block->size * 2 : arena->blockSize;
+		if (blockSize < size) {
+			blockSize = size;
+		}
+		block = newBlock(blockSize, arena->blocks);
+		if (block == NULL) {
+			return NULL;
+		}
+		arena->blocks = block;
+		arena->blockAllocations++;
+	}
+
+	void *p = block->data + block->used;
+	block->used += size;
+	arena->allocations++;
+	return p;
+}
+
+void arenaReset(struct arena *arena) {
+	struct arena_block *block = arena->blocks;
+	if (block == NULL) {
+		return;
+	}
+
+	// the newest block is the largest one, it is kept for the next request
+	struct arena_block *older = block->next;
+	while (older) {
+		struct arena_block *next = older->next;
+		free(older);
+		older = next;
+	}
+	block->next = NULL;
+	block->used = 0;
+}
+
+void arenaFree(struct arena *arena) {
+	arenaReset(arena);
+	free(arena->blocks);
+	arena->blocks = NULL;
+}
@@ -0,0 +1,55 @@
+/** \file Arena.h
+ *  \brief Bump allocator for the memory which is only needed while a request is handled.
+ *
+ *  Allocating is advancing an offset in the current block, there is no per allocation free.
+ *  arenaReset() releases everything at once: the largest block is kept for the next request,
+ *  the smaller ones are freed. So once the arena has grown to the size of the requests it
+ *  doesn't touch malloc() at all anymore.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/** \brief Alignment of the allocations */
+#define ARENA_ALIGNMENT 16
+
+struct arena_block;
+
+/**
+ * \brief An arena.
+ */
+struct arena {
+	/** \brief Newest (and largest) block, allocations are taken from it */
+	struct arena_block *blocks;
+	/** \brief Size of the first block (every further one is twice as large as its predecessor) */
+	size_t blockSize;
+	/** \brief Number of allocations since the arena was initialized */
+	unsigned long long allocations;
+	/** \brief Number of blocks allocated since the arena was initialized */
+	unsigned long long blockAllocations;
+};
+
+/**
+ * \brief Initializes an empty arena, the first block (blockSize bytes) is allocated when it is needed.
+ */
+void arenaInit(struct arena *arena, size_t blockSize);
+
+/**
+ * \brief Returns size bytes (aligned to ARENA_ALIGNMENT) which stay valid until the next
+ * arenaReset(), or NULL if no memory is available.
+ */
+void *arenaAlloc(struct arena *arena, size_t size);
+
+/**
+ * \brief Releases all allocations at once (keeps the largest block).
+ */
+void arenaReset(struct arena *arena);
+
+/**
+ * \brief Releases all memory of the arena.
+ */
+void arenaFree(struct arena *arena);
+
+#endif
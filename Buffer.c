@@ -0,0 +1,189 @@
+/** \file Buffer.c
+ *  \brief Contiguous growable buffer for building the JSON replies.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Buffer.h"
+
+/** \brief Size of the first block allocated if the buffer started without storage */
+#define BUFFER_MIN_SIZE 256
+
+static char EMPTY[1] = { 0 };
+
+void bufferInit(struct buffer *b, char *storage, size_t size) {
+	memset(b, 0, sizeof(*b));
+	if (storage != NULL && size > 0) {
+		b->data = storage;
+		b->size = size;
+		b->storage = storage;
+		b->storageSize = size;
+		b->data[0] = 0;
+	} else {
+		b->data = EMPTY;
+	}
+}
+
+int bufferReserve(struct buffer *b, size_t len) {
+	if (b->failed) {
+		return -1;
+	}
+	if (b->len + len < b->size) {
+		return 0;
+	}
+
+	size_t size = b->size > BUFFER_MIN_SIZE ? b->size : BUFFER_MIN_SIZE;
+	while (size <= b->len + len) {
+		size *= 2;
+	}
+
+	char *data;
+	if (b->size == 0 || b->data == b->storage) {
+		// the first allocation, the content is moved off the provided storage
+		data = malloc(size);
+		if (data != NULL) {
+			memcpy(data, b->data, b->len + 1);
+		}
+	} else {
+		data = realloc(b->data, size);
+	}
+	if (data == NULL) {
+		b->failed = 1;
+		return -1;
+	}
+
+	b->data = data;
+	b->size = size;
+	return 0;
+}
+
+void bufferAppend(struct buffer *b, const char *data, size_t len) {
+	if (bufferReserve(b, len)) {
+		return;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	b->data[b->len] = 0;
+}
+
+void bufferAppendString(struct buffer *b, const char *s) {
+	bufferAppend(b, s, strlen(s));
+}
+
+void bufferAppendChar(struct buffer *b, char c) {
+	if (bufferReserve(b, 1)) {
+		return;
+	}
+	b->data[b->len++] = c;
+	b->data[b->len] = 0;
+}
+
+void bufferAppendUnsigned(struct buffer *b, unsigned long long value) {
+	char digits[20];
+	size_t n = sizeof(digits);
+
+	do {
+		digits[--n] = (char) ('0' + value % 10);
+		value /= 10;
+	} while (value > 0);
+
+	bufferAppend(b, digits + n, sizeof(digits) - n);
+}
+
+void bufferAppendSigned(struct buffer *b, long long value) {
+	if (value < 0) {
+		bufferAppendChar(b, '-');
+		// negated as unsigned, LLONG_MIN has no positive counterpart
+		bufferAppendUnsigned(b, 0ULL - (unsigned long long) value);
+	} else {
+		bufferAppendUnsigned(b, (unsigned long long) value);
+	}
+}
+
+void bufferAppendJsonString(struct buffer *b, const char *s) {
+	static const char HEX[] = "0123456789abcdef";
+
+	bufferAppendChar(b, '"');
+	while (*s) {
+		// copy the run of characters which don't need to be escaped at once
+		const char *run = s;
+		while (*s && (unsigned char) *s >= 0x20 && *s != '"' && *s != '\\') {
+			s++;
+		}
+		bufferAppend(b, run, (size_t) (s - run));
+		if (*s == 0) {
+			break;
+		}
+
+		char escape[6] = { '\\', 0, 0, 0, 0, 0 };
+		size_t len = 2;
+		switch (*s) {
+		case '"': escape[1] = '"'; break;
+		case '\\': escape[1] = '\\'; break;
+		case '\b': escape[1] = 'b'; break;
+		case '\f': escape[1] = 'f'; break;
+		case '\n': escape[1] = 'n'; break;
+		case '\r': escape[1] = 'r'; break;
+		case '\t': escape[1] = 't'; break;
+		default:
+			escape[1] = 'u';
+			escape[2] = '0';
+			escape[3] = '0';
+			escape[4] = HEX[((unsigned char) *s) >> 4];
+			escape[5] = HEX[((unsigned char) *s) & 0x0F];
+			len = 6;
+			break;
+		}
+		bufferAppend(b, escape, len);
+		s++;
+	}
+	bufferAppendChar(b, '"');
+}
+
+void bufferAppendFormat(struct buffer *b, const char *format, ...) {
+	va_list varargs;
+	va_start(varargs, format);
+	bufferAppendFormatV(b, format, varargs);
+	va_end(varargs);
+}
+
+void bufferAppendFormatV(struct buffer *b, const char *format, va_list varargs) {
+	va_list copy;
+
+	// first try to format into the space which is left, most of the time it fits
+	size_t space = b->failed || b->size == 0 ? 0 : b->size - b->len;
+	va_copy(copy, varargs);
+	int n = vsnprintf(space > 0 ? b->data + b->len : NULL, space, format, copy);
+	va_end(copy);
+
+	if (n < 0) {
+		return;
+	}
+	if ((size_t) n >= space) {
+		if (bufferReserve(b, (size_t) n)) {
+			return;
+		}
+		va_copy(copy, varargs);
+		vsnprintf(b->data + b->len, b->size - b->len, format, copy);
+		va_end(copy);
+	}
+	b->len += (size_t) n;
+}
+
+void bufferReset(struct buffer *b) {
+	b->len = 0;
+	b->failed = 0;
+	if (b->size > 0) {
+		b->data[0] = 0;
+	}
+}
+
+void bufferFree(struct buffer *b) {
+	if (b->size > 0 && b->data != b->storage) {
+		free(b->data);
+	}
+	bufferInit(b, b->storage, b->storageSize);
+}
@@ -0,0 +1,102 @@
+/** \file Buffer.h
+ *  \brief Contiguous growable buffer for building the JSON replies.
+ *
+ *  The bytes are appended to one block of memory which doubles its size when it is full and is
+ *  always zero terminated, so it can be passed on as a string without copying it. The buffer can
+ *  start with storage provided by the caller (e.g. on the stack), memory is only allocated if the
+ *  content outgrows it. Integers and JSON strings are formatted directly into the buffer.
+ *
+ *  If memory can't be allocated the buffer keeps what fits, all further appends are ignored and
+ *  failed is set, so the caller only has to check once at the end.
+ */
+
+#ifndef _BUFFER_H_
+#define _BUFFER_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/**
+ * \brief A contiguous buffer.
+ */
+struct buffer {
+	/** \brief The content (zero terminated) */
+	char *data;
+	/** \brief Length of the content (excl. the terminating zero) */
+	size_t len;
+	/** \brief Size of data */
+	size_t size;
+	/** \brief The storage provided to bufferInit() (not freed) */
+	char *storage;
+	/** \brief Size of storage */
+	size_t storageSize;
+	/** \brief If !=0 an append failed because memory could not be allocated */
+	int failed;
+};
+
+/**
+ * \brief Initializes an empty buffer which uses storage (size bytes, may be NULL) until the
+ * content doesn't fit anymore.
+ */
+void bufferInit(struct buffer *b, char *storage, size_t size);
+
+/**
+ * \brief Makes room for at least len more bytes (and the terminating zero).
+ * Returns 0 on success.
+ */
+int bufferReserve(struct buffer *b, size_t len);
+
+/**
+ * \brief Appends len bytes.
+ */
+void bufferAppend(struct buffer *b, const char *data, size_t len);
+
+/**
+ * \brief Appends a zero terminated string.
+ */
+void bufferAppendString(struct buffer *b, const char *s);
+
+/**
+ * \brief Appends a single character.
+ */
+void bufferAppendChar(struct buffer *b, char c);
+
+/**
+ * \brief Appends the decimal representation of an unsigned integer.
+ */
+void bufferAppendUnsigned(struct buffer *b, unsigned long long value);
+
+/**
+ * \brief Appends the decimal representation of a signed integer.
+ */
+void bufferAppendSigned(struct buffer *b, long long value);
+
+/**
+ * \brief Appends the string as a quoted and escaped JSON string.
+ */
+void bufferAppendJsonString(struct buffer *b, const char *s);
+
+/**
+ * \brief Appends printf() style formatted text.
+ */
+void bufferAppendFormat(struct buffer *b, const char *format, ...)
+		__attribute__ ((format (printf, 2, 3)));
+
+/**
+ * \brief Appends vprintf() style formatted text.
+ */
+void bufferAppendFormatV(struct buffer *b, const char *format, va_list varargs)
+		__attribute__ ((format (printf, 2, 0)));
+
+/**
+ * \brief Empties the buffer, the memory is kept for reuse.
+ */
+void bufferReset(struct buffer *b);
+
+/**
+ * \brief Releases the memory allocated by the buffer, it is empty (and uses the provided
+ * storage again) afterwards.
+ */
+void bufferFree(struct buffer *b);
+
+#endif
@@ -0,0 +1,308 @@
+/** \file EventRing.c
+ *  \brief Shared memory ring of the device events for consumers on the same machine.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "EventRing.h"
+
+/** \brief Size of the header in front of the record area */
+#define HEADER_SIZE 64
+
+/** \brief Value of event_ring_record.len which marks the unused end of the record area */
+#define RECORD_PADDING 0xFFFFFFFFU
+
+/**
+ * \brief The header of the shared memory object, followed by the record area.
+ * \details Positions are counted in bytes since the ring was created, the record at position p
+ * is at offset p & (capacity - 1) of the record area. The producer announces the end of the
+ * record it is about to write in reserved and publishes it in head once it is complete, a
+ * consumer knows that a record it has copied was intact if reserved didn't pass it meanwhile.
+ */
+struct event_ring_shared {
+	/** \brief EVENT_RING_MAGIC */
+	uint32_t magic;
+	/** \brief EVENT_RING_VERSION */
+	uint32_t version;
+	/** \brief Size of the record area (power of two) */
+	uint64_t capacity;
+	/** \brief End of the record which is being written */
+	_Atomic uint64_t reserved;
+	/** \brief End of the last complete record */
+	_Atomic uint64_t head;
+	/** \brief Sequence number of the last complete record */
+	_Atomic uint64_t seq;
+	/** \brief Incremented with every record, consumers wait on it */
+	_Atomic uint32_t futex;
+	/** \brief Number of consumers in eventRingWait(), the producer only wakes them if there are any */
+	_Atomic uint32_t waiters;
+};
+
+_Static_assert(sizeof(struct event_ring_shared) <= HEADER_SIZE, "header too large");
+
+/**
+ * \brief A record in the record area (8 byte aligned, followed by the payload).
+ */
+struct event_ring_record {
+	/** \brief Size of the record incl. the payload and the alignment */
+	uint32_t size;
+	/** \brief Length of the payload (RECORD_PADDING: skip to the start of the record area) */
+	uint32_t len;
+	/** \brief Sequence number */
+	uint64_t seq;
+	/** \brief Wall clock time in ms */
+	int64_t ts;
+	/** \brief Topic name (zero terminated) */
+	char topic[EVENT_RING_TOPIC_SIZE];
+};
+
+static char *recordArea(struct event_ring_shared *shared) {
+	return (char *) shared + HEADER_SIZE;
+}
+
+/**
+ * \brief Maps the shared memory object fd, returns 0 on success.
+ */
+static int mapRing(struct event_ring *ring, int fd, size_t mapSize, int prot) {
+	void *map = mmap(NULL, mapSize, prot, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	ring->shared = map;
+	ring->mapSize = mapSize;
+	return 0;
+}
+
+int eventRingCreate(struct event_ring *ring, const char *name, size_t size) {
+	memset(ring, 0, sizeof(*ring));
+	if (size < 1024 || (size & (size - 1)) != 0) {
+		return -1;
+	}
+
+	size_t mapSize = HEADER_SIZE + size;
+	int fd = shm_open(name, O_RDWR | O_CREAT, 0660);
+	if (fd < 0) {
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && (size_t) st.st_size == mapSize) {
+		if (mapRing(ring, fd, mapSize, PROT_READ | PROT_WRITE)) {
+			return -1;
+		}
+		struct event_ring_shared *shared = ring->shared;
+		if (shared->magic == EVENT_RING_MAGIC && shared->version == EVENT_RING_VERSION && shared->capacity == size) {
+			// drop a record which wasn't completed before the last producer stopped
+			atomic_store(&shared->reserved, atomic_load(&shared->head));
+			return 0;
+		}
+		eventRingClose(ring);
+	} else {
+		close(fd);
+	}
+
+	// consumers may still have the old object mapped, so it isn't resized but replaced
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+	if (fd < 0) {
+		return -1;
+	}
+	if (ftruncate(fd, mapSize) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (mapRing(ring, fd, mapSize, PROT_READ | PROT_WRITE)) {
+		return -1;
+	}
+
+	struct event_ring_shared *shared = ring->shared;
+	shared->version = EVENT_RING_VERSION;
+	shared->capacity = size;
+	atomic_store(&shared->reserved, 0);
+	atomic_store(&shared->head, 0);
+	atomic_store(&shared->seq, 0);
+	atomic_store(&shared->futex, 0);
+	atomic_store(&shared->waiters, 0);
+	atomic_thread_fence(memory_order_release);
+	shared->magic = EVENT_RING_MAGIC;
+
+	return 0;
+}
+
+int eventRingPublish(struct event_ring *ring, const char *topic, const char *payload, size_t len, long long ts) {
+	struct event_ring_shared *shared = ring->shared;
+	uint64_t capacity = shared->capacity;
+	uint64_t size = (sizeof(struct event_ring_record) + len + 7) & ~(uint64_t) 7;
+	if (size > capacity / 4) {
+		return -1;
+	}
+
+	uint64_t head = atomic_load_explicit(&shared->head, memory_order_relaxed);
+	uint64_t offset = head & (capacity - 1);
+	uint64_t padding = capacity - offset < size ? capacity - offset : 0;
+
+	// announce the bytes which are overwritten before touching them
+	atomic_store_explicit(&shared->reserved, head + padding + size, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	char *data = recordArea(shared);
+	struct event_ring_record record;
+	memset(&record, 0, sizeof(record));
+
+	if (padding) {
+		record.size = (uint32_t) padding;
+		record.len = RECORD_PADDING;
+		memcpy(data + offset, &record, sizeof(record.size) + sizeof(record.len));
+		offset = 0;
+	}
+
+	uint64_t seq = atomic_load_explicit(&shared->seq, memory_order_relaxed) + 1;
+	record.size = (uint32_t) size;
+	record.len = (uint32_t) len;
+	record.seq = seq;
+	record.ts = ts;
+	strncpy(record.topic, topic, sizeof(record.topic) - 1);
+	memcpy(data + offset, &record, sizeof(record));
+	memcpy(data + offset + sizeof(record), payload, len);
+
+	atomic_store_explicit(&shared->seq, seq, memory_order_relaxed);
+	atomic_store_explicit(&shared->head, head + padding + size, memory_order_release);
+
+	// a consumer increments waiters before it reads the futex word, so either it is counted
+	// here or it sees the incremented word and doesn't sleep (both are sequentially consistent)
+	atomic_fetch_add(&shared->futex, 1);
+	if (atomic_load(&shared->waiters) > 0) {
+		syscall(SYS_futex, &shared->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+
+	return 0;
+}
+
+int eventRingOpen(struct event_ring *ring, const char *name) {
+	memset(ring, 0, sizeof(*ring));
+
+	// writable for the waiters count in the header
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size <= HEADER_SIZE) {
+		close(fd);
+		return -1;
+	}
+	if (mapRing(ring, fd, st.st_size, PROT_READ | PROT_WRITE)) {
+		return -1;
+	}
+
+	struct event_ring_shared *shared = ring->shared;
+	if (shared->magic != EVENT_RING_MAGIC || shared->version != EVENT_RING_VERSION
+			|| HEADER_SIZE + shared->capacity != ring->mapSize) {
+		eventRingClose(ring);
+		return -1;
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	ring->seq = atomic_load(&shared->seq);
+	ring->position = atomic_load(&shared->head);
+	return 0;
+}
+
+int eventRingNext(struct event_ring *ring, struct event_ring_event *event, char *buffer, size_t size) {
+	struct event_ring_shared *shared = ring->shared;
+	uint64_t capacity = shared->capacity;
+	const char *data = recordArea(shared);
+
+	for (;;) {
+		uint64_t head = atomic_load_explicit(&shared->head, memory_order_acquire);
+		if (ring->position == head) {
+			return 0;
+		}
+		if (head - ring->position > capacity) {
+			// overrun, continue with the next event written
+			ring->position = head;
+			return 0;
+		}
+
+		uint64_t offset = ring->position & (capacity - 1);
+		struct event_ring_record record;
+		memcpy(&record, data + offset, sizeof(record));
+
+		int valid = record.size >= sizeof(record.size) + sizeof(record.len) && record.size <= capacity - offset
+				&& record.size % 8 == 0;
+		size_t copied = 0;
+		if (valid && record.len != RECORD_PADDING) {
+			valid = record.size >= sizeof(record) && record.len <= record.size - sizeof(record);
+			if (valid && size > 0) {
+				copied = record.len < size - 1 ? record.len : size - 1;
+				memcpy(buffer, data + offset + sizeof(record), copied);
+			}
+		}
+
+		// was the record overwritten while it was copied?
+		atomic_thread_fence(memory_order_acquire);
+		uint64_t reserved = atomic_load_explicit(&shared->reserved, memory_order_relaxed);
+		if (reserved - ring->position > capacity || ! valid) {
+			ring->position = atomic_load_explicit(&shared->head, memory_order_acquire);
+			continue;
+		}
+
+		ring->position += record.size;
+		if (record.len == RECORD_PADDING) {
+			continue;
+		}
+
+		if (size > 0) {
+			buffer[copied] = 0;
+		}
+		if (record.seq > ring->seq + 1) {
+			ring->lost += record.seq - ring->seq - 1;
+		}
+		ring->seq = record.seq;
+
+		event->seq = record.seq;
+		event->ts = record.ts;
+		memcpy(event->topic, record.topic, sizeof(event->topic));
+		event->topic[sizeof(event->topic) - 1] = 0;
+		event->len = record.len;
+		return 1;
+	}
+}
+
+int eventRingWait(struct event_ring *ring, int timeoutMs) {
+	struct event_ring_shared *shared = ring->shared;
+
+	// register first (see eventRingPublish()), then read the futex word, a record written
+	// after the check below changes it
+	atomic_fetch_add(&shared->waiters, 1);
+	uint32_t value = atomic_load(&shared->futex);
+	if (atomic_load(&shared->head) == ring->position) {
+		struct timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+		syscall(SYS_futex, &shared->futex, FUTEX_WAIT, value, timeoutMs < 0 ? NULL : &timeout, NULL, 0);
+	}
+	atomic_fetch_sub(&shared->waiters, 1);
+
+	return atomic_load(&shared->head) != ring->position;
+}
+
+void eventRingClose(struct event_ring *ring) {
+	if (ring->shared) {
+		munmap(ring->shared, ring->mapSize);
+	}
+	memset(ring, 0, sizeof(*ring));
+}
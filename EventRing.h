@@ -0,0 +1,117 @@
+/** \file EventRing.h
+ *  \brief Shared memory ring of the device events for consumers on the same machine.
+ *
+ *  payoutd (the only producer) writes every device event into a ring buffer in a POSIX shared
+ *  memory object (/dev/shm), any number of local consumers read it without going through redis.
+ *  The same functions are used by payoutd and by the consumers (libpayoutring.a).
+ *
+ *  Every event is one record with a sequence number, so a consumer can tell how many events it
+ *  has missed. A consumer never blocks the producer: if it falls behind by more than the size of
+ *  the ring the overwritten events are lost and it continues with the oldest one still available.
+ *  The producer wakes waiting consumers through a futex in the shared memory, the consumers
+ *  count themselves in the header while they wait so the producer only wakes them if there
+ *  are any. The object is created with mode 0660, a consumer needs write access.
+ *
+ *  A consumer:
+ *  \code
+ *  struct event_ring ring;
+ *  struct event_ring_event event;
+ *  char payload[4096];
+ *
+ *  if (eventRingOpen(&ring, "/payoutd-events") == 0) {
+ *  	for (;;) {
+ *  		while (eventRingNext(&ring, &event, payload, sizeof(payload)) > 0) {
+ *  			printf("%s #%llu: %s\n", event.topic, event.seq, payload);
+ *  		}
+ *  		eventRingWait(&ring, 1000);
+ *  	}
+ *  }
+ *  \endcode
+ */
+
+#ifndef _EVENT_RING_H_
+#define _EVENT_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** \brief Identifies a shared memory object written by eventRingCreate() */
+#define EVENT_RING_MAGIC 0x676E6972U
+/** \brief Version of the memory layout */
+#define EVENT_RING_VERSION 2
+/** \brief Maximum length of a topic name (incl. the terminating zero) */
+#define EVENT_RING_TOPIC_SIZE 24
+
+/** \brief Default size of the record area in bytes */
+#define EVENT_RING_DEFAULT_SIZE (1024 * 1024)
+
+struct event_ring_shared;
+
+/**
+ * \brief An event read by eventRingNext().
+ */
+struct event_ring_event {
+	/** \brief Sequence number of the event (increasing by 1 from event to event) */
+	unsigned long long seq;
+	/** \brief Wall clock time in ms when the event was written */
+	long long ts;
+	/** \brief The topic the event was published to, e.g. "hopper-event" */
+	char topic[EVENT_RING_TOPIC_SIZE];
+	/** \brief Length of the payload (may be more than was copied) */
+	size_t len;
+};
+
+/**
+ * \brief Handle of a mapped ring (producer or consumer).
+ */
+struct event_ring {
+	/** \brief The mapped shared memory object (NULL if not open) */
+	struct event_ring_shared *shared;
+	/** \brief Size of the mapping */
+	size_t mapSize;
+	/** \brief Consumer: position of the next record to read */
+	unsigned long long position;
+	/** \brief Consumer: sequence number of the last event read */
+	unsigned long long seq;
+	/** \brief Consumer: number of events lost because they were overwritten before they were read */
+	unsigned long long lost;
+};
+
+/**
+ * \brief Creates (or reuses, if the size matches) the shared memory object name (e.g.
+ * "/payoutd-events") with a record area of size bytes (a power of two) and maps it for writing.
+ * Reusing keeps the sequence numbers going, so consumers can stay attached across restarts.
+ * Returns 0 on success.
+ */
+int eventRingCreate(struct event_ring *ring, const char *name, size_t size);
+
+/**
+ * \brief Writes an event (len bytes of payload) and wakes the waiting consumers.
+ * Returns 0 on success, -1 if the event is too large for the ring.
+ */
+int eventRingPublish(struct event_ring *ring, const char *topic, const char *payload, size_t len, long long ts);
+
+/**
+ * \brief Maps the shared memory object name (writable only for the count of the waiting
+ * consumers). Reading starts with the next event written. Returns 0 on success.
+ */
+int eventRingOpen(struct event_ring *ring, const char *name);
+
+/**
+ * \brief Reads the next event. Up to size - 1 bytes of the payload are copied to the buffer and
+ * zero terminated. Returns 1 if an event was read, 0 if there is none.
+ */
+int eventRingNext(struct event_ring *ring, struct event_ring_event *event, char *buffer, size_t size);
+
+/**
+ * \brief Waits up to timeoutMs (forever if < 0) until there is an event to read.
+ * Returns 1 if there is one, 0 otherwise.
+ */
+int eventRingWait(struct event_ring *ring, int timeoutMs);
+
+/**
+ * \brief Unmaps the ring. The shared memory object itself is kept.
+ */
+void eventRingClose(struct event_ring *ring);
+
+#endif
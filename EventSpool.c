@@ -0,0 +1,333 @@
+/** \file EventSpool.c
+ *  \brief Durable on-disk spool of the commands which publish the device events.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "EventSpool.h"
+
+/**
+ * \brief Header of a record in a segment (8 byte aligned, followed by the data).
+ * \details The preallocated rest of a segment is zero, the records end at the first header
+ * which is zero or which doesn't match its data (a record which was not completely written).
+ */
+struct spool_record {
+	/** \brief Length of the data */
+	uint32_t len;
+	/** \brief Checksum of the data and the sequence number */
+	uint32_t checksum;
+	/** \brief Sequence number */
+	uint64_t seq;
+};
+
+static size_t recordSize(size_t len) {
+	return (sizeof(struct spool_record) + len + 7) & ~(size_t) 7;
+}
+
+/**
+ * \brief FNV-1a hash of the data and the sequence number.
+ */
+static uint32_t checksum(const char *data, size_t len, uint64_t seq) {
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 16777619U;
+	}
+	for (int i = 0; i < 8; i++) {
+		hash ^= (unsigned char) (seq >> (8 * i));
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void segmentPath(struct event_spool *spool, unsigned long long firstSeq, char *path, size_t size) {
+	snprintf(path, size, "%s/%016llx.spool", spool->dir, firstSeq);
+}
+
+/**
+ * \brief Finds the end of the records in a loaded segment.
+ */
+static void scanSegment(struct event_spool *spool, struct spool_segment *segment) {
+	size_t offset = 0;
+	unsigned long long seq = segment->firstSeq;
+
+	while (offset + sizeof(struct spool_record) <= spool->segmentSize) {
+		struct spool_record record;
+		memcpy(&record, segment->map + offset, sizeof(record));
+
+		size_t size = recordSize(record.len);
+		if (record.seq != seq || size > spool->segmentSize - offset
+				|| record.checksum != checksum(segment->map + offset + sizeof(record), record.len, record.seq)) {
+			break;
+		}
+		offset += size;
+		seq++;
+	}
+
+	segment->used = offset;
+	segment->synced = offset;
+	segment->lastSeq = seq - 1;
+}
+
+/**
+ * \brief Maps the segment file starting with firstSeq as the newest segment, it is created
+ * (and preallocated) if create is set. Returns 0 on success.
+ */
+static int mapSegment(struct event_spool *spool, unsigned long long firstSeq, int create) {
+	char path[PATH_MAX];
+	segmentPath(spool, firstSeq, path, sizeof(path));
+
+	int fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0600);
+	if (fd < 0) {
+		return -1;
+	}
+
+	struct stat st;
+	if ((create && posix_fallocate(fd, 0, spool->segmentSize) != 0)
+			|| fstat(fd, &st) != 0 || (size_t) st.st_size != spool->segmentSize) {
+		close(fd);
+		if (create) {
+			unlink(path);
+		}
+		return -1;
+	}
+
+	void *map = mmap(NULL, spool->segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	struct spool_segment *segment = &spool->segments[spool->count++];
+	memset(segment, 0, sizeof(*segment));
+	segment->firstSeq = firstSeq;
+	segment->lastSeq = firstSeq - 1;
+	segment->map = map;
+	return 0;
+}
+
+/**
+ * \brief Unmaps and deletes the oldest segment.
+ */
+static void dropOldestSegment(struct event_spool *spool) {
+	char path[PATH_MAX];
+	segmentPath(spool, spool->segments[0].firstSeq, path, sizeof(path));
+
+	munmap(spool->segments[0].map, spool->segmentSize);
+	unlink(path);
+
+	spool->count--;
+	memmove(&spool->segments[0], &spool->segments[1], spool->count * sizeof(struct spool_segment));
+	if (spool->sendSegment > 0) {
+		spool->sendSegment--;
+	}
+}
+
+static int isSegmentFile(const struct dirent *entry) {
+	size_t len = strlen(entry->d_name);
+	return len == 16 + 6 && strcmp(entry->d_name + 16, ".spool") == 0;
+}
+
+int eventSpoolInit(struct event_spool *spool, const char *dir, size_t segmentSize) {
+	memset(spool, 0, sizeof(*spool));
+	spool->ackedFd = -1;
+	spool->segmentSize = segmentSize;
+	spool->dir = strdup(dir);
+	if (spool->dir == NULL) {
+		return -1;
+	}
+
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+		return -1;
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/acked", dir);
+	spool->ackedFd = open(path, O_RDWR | O_CREAT, 0600);
+	if (spool->ackedFd < 0) {
+		return -1;
+	}
+	uint64_t acked = 0;
+	if (pread(spool->ackedFd, &acked, sizeof(acked), 0) == sizeof(acked)) {
+		spool->acked = acked;
+	}
+	spool->lastSeq = spool->acked;
+
+	// the names are zero padded, so they are sorted by their first sequence number
+	struct dirent **names;
+	int n = scandir(dir, &names, isSegmentFile, alphasort);
+	if (n < 0) {
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		unsigned long long firstSeq = strtoull(names[i]->d_name, NULL, 16);
+		// the segments have to continue each other, the ones behind a gap are ignored
+		int continues = spool->count == 0 || firstSeq == spool->segments[spool->count - 1].lastSeq + 1;
+		if (continues && spool->count < SPOOL_MAX_SEGMENTS && mapSegment(spool, firstSeq, 0) == 0) {
+			scanSegment(spool, &spool->segments[spool->count - 1]);
+		}
+		free(names[i]);
+	}
+	free(names);
+
+	if (spool->count > 0 && spool->segments[spool->count - 1].lastSeq > spool->lastSeq) {
+		spool->lastSeq = spool->segments[spool->count - 1].lastSeq;
+	}
+
+	// the fully acknowledged segments (but the newest one, the next records are appended to it)
+	while (spool->count > 1 && spool->segments[0].lastSeq <= spool->acked) {
+		dropOldestSegment(spool);
+	}
+
+	eventSpoolRewind(spool);
+	return 0;
+}
+
+unsigned long long eventSpoolAppend(struct event_spool *spool, const char *data, size_t len) {
+	size_t size = recordSize(len);
+	if (size > spool->segmentSize) {
+		return 0;
+	}
+
+	struct spool_segment *segment = spool->count > 0 ? &spool->segments[spool->count - 1] : NULL;
+	if (segment == NULL || segment->lastSeq != spool->lastSeq || segment->used + size > spool->segmentSize) {
+		if (spool->count == SPOOL_MAX_SEGMENTS) {
+			spool->full++;
+			return 0;
+		}
+		if (mapSegment(spool, spool->lastSeq + 1, 1)) {
+			return 0;
+		}
+		segment = &spool->segments[spool->count - 1];
+	}
+
+	struct spool_record record;
+	record.len = (uint32_t) len;
+	record.seq = spool->lastSeq + 1;
+	record.checksum = checksum(data, len, record.seq);
+
+	memcpy(segment->map + segment->used + sizeof(record), data, len);
+	memcpy(segment->map + segment->used, &record, sizeof(record));
+	segment->used += size;
+	segment->lastSeq = record.seq;
+	spool->lastSeq = record.seq;
+
+	return record.seq;
+}
+
+int eventSpoolSync(struct event_spool *spool) {
+	int rc = 0;
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+	for (unsigned int i = 0; i < spool->count; i++) {
+		struct spool_segment *segment = &spool->segments[i];
+		if (segment->synced < segment->used) {
+			size_t start = segment->synced & ~(page - 1);
+			if (msync(segment->map + start, segment->used - start, MS_SYNC) != 0) {
+				rc = -1;
+			}
+			segment->synced = segment->used;
+		}
+	}
+
+	// not synced, a lost update only means that some records are sent again
+	if (spool->ackedDirty) {
+		uint64_t acked = spool->acked;
+		if (pwrite(spool->ackedFd, &acked, sizeof(acked), 0) != sizeof(acked)) {
+			rc = -1;
+		}
+		spool->ackedDirty = 0;
+	}
+
+	return rc;
+}
+
+int eventSpoolHasNext(struct event_spool *spool) {
+	return spool->sendSegment < spool->count
+			&& (spool->sendOffset < spool->segments[spool->sendSegment].used || spool->sendSegment + 1 < spool->count);
+}
+
+const char *eventSpoolNext(struct event_spool *spool, size_t *len, unsigned long long *seq) {
+	while (spool->sendSegment < spool->count) {
+		struct spool_segment *segment = &spool->segments[spool->sendSegment];
+		if (spool->sendOffset < segment->used) {
+			struct spool_record record;
+			memcpy(&record, segment->map + spool->sendOffset, sizeof(record));
+
+			const char *data = segment->map + spool->sendOffset + sizeof(record);
+			spool->sendOffset += recordSize(record.len);
+			*len = record.len;
+			*seq = record.seq;
+			return data;
+		}
+
+		if (spool->sendSegment + 1 == spool->count) {
+			// the newest segment, more records may be appended to it
+			return NULL;
+		}
+		spool->sendSegment++;
+		spool->sendOffset = 0;
+	}
+	return NULL;
+}
+
+void eventSpoolRewind(struct event_spool *spool) {
+	spool->sendSegment = 0;
+	spool->sendOffset = 0;
+
+	// skip the acknowledged records
+	while (spool->sendSegment + 1 < spool->count && spool->segments[spool->sendSegment].lastSeq <= spool->acked) {
+		spool->sendSegment++;
+	}
+	if (spool->sendSegment < spool->count) {
+		struct spool_segment *segment = &spool->segments[spool->sendSegment];
+		while (spool->sendOffset < segment->used) {
+			struct spool_record record;
+			memcpy(&record, segment->map + spool->sendOffset, sizeof(record));
+			if (record.seq > spool->acked) {
+				break;
+			}
+			spool->sendOffset += recordSize(record.len);
+		}
+	}
+}
+
+void eventSpoolAcknowledge(struct event_spool *spool, unsigned long long seq) {
+	if (seq <= spool->acked) {
+		return;
+	}
+	spool->acked = seq;
+	spool->ackedDirty = 1;
+
+	// the records of the oldest segment have all been acknowledged and it is not written anymore
+	while (spool->count > 1 && spool->sendSegment > 0 && spool->segments[0].lastSeq <= spool->acked) {
+		dropOldestSegment(spool);
+	}
+}
+
+void eventSpoolFree(struct event_spool *spool) {
+	eventSpoolSync(spool);
+	for (unsigned int i = 0; i < spool->count; i++) {
+		munmap(spool->segments[i].map, spool->segmentSize);
+	}
+	if (spool->ackedFd >= 0) {
+		close(spool->ackedFd);
+	}
+	free(spool->dir);
+	memset(spool, 0, sizeof(*spool));
+	spool->ackedFd = -1;
+}
@@ -0,0 +1,116 @@
+/** \file EventSpool.h
+ *  \brief Durable on-disk spool of the commands which publish the device events.
+ *
+ *  Every command is appended to the spool (and written to disk) before it is sent to redis, it
+ *  is dropped once redis has answered it. After a lost connection (or a restart) everything which
+ *  has not been acknowledged is sent again, i.e. the events are delivered at least once.
+ *
+ *  The spool is a directory of segment files ("<seq of the first record>.spool"), each one is
+ *  preallocated and memory mapped. Records are appended to the newest segment, the oldest one is
+ *  deleted as soon as all of its records have been acknowledged. The highest acknowledged
+ *  sequence number is kept in the file "acked". Appends are only written to the mapping,
+ *  eventSpoolSync() writes all of them to disk at once.
+ */
+
+#ifndef _EVENT_SPOOL_H_
+#define _EVENT_SPOOL_H_
+
+#include <stddef.h>
+
+/** \brief Default size of a segment file */
+#define SPOOL_SEGMENT_SIZE (4 * 1024 * 1024)
+/** \brief Maximum number of segment files */
+#define SPOOL_MAX_SEGMENTS 16
+
+/**
+ * \brief A mapped segment file.
+ */
+struct spool_segment {
+	/** \brief Sequence number of the first record (also the name of the file) */
+	unsigned long long firstSeq;
+	/** \brief Sequence number of the last record (firstSeq - 1 if empty) */
+	unsigned long long lastSeq;
+	/** \brief The mapped file */
+	char *map;
+	/** \brief Bytes used by the records */
+	size_t used;
+	/** \brief Bytes which have been written to disk */
+	size_t synced;
+};
+
+/**
+ * \brief The spool.
+ */
+struct event_spool {
+	/** \brief Directory of the segment files */
+	char *dir;
+	/** \brief Size of a segment file */
+	size_t segmentSize;
+	/** \brief The segments, oldest first */
+	struct spool_segment segments[SPOOL_MAX_SEGMENTS];
+	/** \brief Number of segments */
+	unsigned int count;
+	/** \brief Sequence number of the last appended record */
+	unsigned long long lastSeq;
+	/** \brief Highest acknowledged sequence number */
+	unsigned long long acked;
+	/** \brief If !=0 acked has not been written to the "acked" file yet */
+	int ackedDirty;
+	/** \brief The "acked" file */
+	int ackedFd;
+	/** \brief Segment of the next record to send */
+	unsigned int sendSegment;
+	/** \brief Offset of the next record to send in its segment */
+	size_t sendOffset;
+	/** \brief Number of records which could not be appended because the spool was full */
+	unsigned long long full;
+};
+
+/**
+ * \brief Opens (or creates) the spool in the directory and loads the existing segments.
+ * The records which have not been acknowledged are the first ones returned by eventSpoolNext().
+ * Returns 0 on success.
+ */
+int eventSpoolInit(struct event_spool *spool, const char *dir, size_t segmentSize);
+
+/**
+ * \brief Appends a record (len bytes), returns its sequence number or 0 if it could not be
+ * appended (the spool is full or a new segment could not be created).
+ */
+unsigned long long eventSpoolAppend(struct event_spool *spool, const char *data, size_t len);
+
+/**
+ * \brief Writes the appended records and the acknowledged sequence number to disk.
+ * Returns 0 on success.
+ */
+int eventSpoolSync(struct event_spool *spool);
+
+/**
+ * \brief Returns the next record to send (and its length and sequence number) or NULL if all
+ * records have been handed out. The data stays valid until the record is acknowledged.
+ */
+const char *eventSpoolNext(struct event_spool *spool, size_t *len, unsigned long long *seq);
+
+/**
+ * \brief Test if eventSpoolNext() would return a record.
+ */
+int eventSpoolHasNext(struct event_spool *spool);
+
+/**
+ * \brief Starts handing out the records again with the first one not acknowledged yet
+ * (e.g. after a lost connection).
+ */
+void eventSpoolRewind(struct event_spool *spool);
+
+/**
+ * \brief Marks the records up to seq as acknowledged and deletes the segments which are no
+ * longer needed.
+ */
+void eventSpoolAcknowledge(struct event_spool *spool, unsigned long long seq);
+
+/**
+ * \brief Writes everything to disk, unmaps the segments and releases all memory.
+ */
+void eventSpoolFree(struct event_spool *spool);
+
+#endif
@@ -0,0 +1,80 @@
+/** \file Histogram.c
+ *  \brief Fixed bucket latency histogram (HDR style, log-linear buckets).
+ */
+
+#include <string.h>
+
+#include "Histogram.h"
+
+/**
+ * \brief Maps a value to its bucket index.
+ * \details Values below 2 * HISTOGRAM_SUB_BUCKETS get a bucket of their own, above that each
+ * power of two is split into HISTOGRAM_SUB_BUCKETS linear buckets.
+ */
+static unsigned int bucketIndex(unsigned long long value) {
+	if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+		return (unsigned int) value;
+	}
+
+	if (value >> HISTOGRAM_MAX_BITS) {
+		return HISTOGRAM_BUCKETS - 1;
+	}
+
+	unsigned int msb = 63 - __builtin_clzll(value);
+	unsigned int shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+
+	// (value >> shift) is within [HISTOGRAM_SUB_BUCKETS, 2 * HISTOGRAM_SUB_BUCKETS)
+	return shift * HISTOGRAM_SUB_BUCKETS + (unsigned int) (value >> shift);
+}
+
+/**
+ * \brief Returns the largest value which is mapped to the given bucket.
+ */
+static unsigned long long bucketUpperBound(unsigned int index) {
+	if (index < 2 * HISTOGRAM_SUB_BUCKETS) {
+		return index;
+	}
+
+	unsigned int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+	unsigned long long base = index - shift * HISTOGRAM_SUB_BUCKETS;
+
+	return ((base + 1) << shift) - 1;
+}
+
+void histogramRecord(struct histogram *h, unsigned long long value) {
+	h->buckets[bucketIndex(value)]++;
+	h->count++;
+	if (value > h->max) {
+		h->max = value;
+	}
+}
+
+unsigned long long histogramPercentile(const struct histogram *h, double percentile) {
+	if (h->count == 0) {
+		return 0;
+	}
+
+	// rank of the requested value (1 based, rounded up)
+	unsigned long long rank = (unsigned long long) (percentile / 100.0 * h->count);
+	if ((double) rank < percentile / 100.0 * h->count) {
+		rank++;
+	}
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	unsigned long long seen = 0;
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			unsigned long long upper = bucketUpperBound(i);
+			return upper < h->max ? upper : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+void histogramReset(struct histogram *h) {
+	memset(h, 0, sizeof(*h));
+}
@@ -0,0 +1,50 @@
+/** \file Histogram.h
+ *  \brief Fixed bucket latency histogram (HDR style, log-linear buckets).
+ *
+ *  Values are sorted into buckets by their most significant bit and the following
+ *  HISTOGRAM_SUB_BUCKET_BITS bits, which keeps the relative error below 1/16 over the
+ *  whole range. Recording is a bit scan and an increment, no allocation, no locking
+ *  (payoutd is single threaded).
+ */
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+/** \brief Number of bits used for the linear sub buckets of each power of two */
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+/** \brief Number of linear sub buckets of each power of two */
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+/** \brief Values above 2^HISTOGRAM_MAX_BITS - 1 are recorded in the last bucket */
+#define HISTOGRAM_MAX_BITS 27
+/** \brief Total number of buckets */
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * \brief A histogram of unsigned values (payoutd records microseconds).
+ */
+struct histogram {
+	/** \brief Number of recorded values */
+	unsigned long long count;
+	/** \brief Largest recorded value */
+	unsigned long long max;
+	/** \brief Counters for each bucket */
+	unsigned int buckets[HISTOGRAM_BUCKETS];
+};
+
+/**
+ * \brief Records a single value.
+ */
+void histogramRecord(struct histogram *h, unsigned long long value);
+
+/**
+ * \brief Returns the value at the given percentile (0..100), this is the upper
+ * bound of the bucket containing it (but never more than the recorded maximum).
+ */
+unsigned long long histogramPercentile(const struct histogram *h, double percentile);
+
+/**
+ * \brief Clears all recorded values.
+ */
+void histogramReset(struct histogram *h);
+
+#endif
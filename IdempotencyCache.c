@@ -0,0 +1,342 @@
+/** \file IdempotencyCache.c
+ *  \brief Bounded LRU cache of recently received requests keyed by their msgId.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "IdempotencyCache.h"
+
+/**
+ * \brief FNV-1a hash of the key.
+ */
+static unsigned int hashKey(const char *key) {
+	unsigned int hash = 2166136261U;
+	while (*key) {
+		hash ^= (unsigned char) *key++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static struct idempotency_entry **findSlot(struct idempotency_cache *cache, const char *key) {
+	struct idempotency_entry **slot = &cache->buckets[hashKey(key) & cache->bucketMask];
+	while (*slot != NULL && strcmp((*slot)->key, key) != 0) {
+		slot = &(*slot)->nextInBucket;
+	}
+	return slot;
+}
+
+static void unlinkLru(struct idempotency_cache *cache, struct idempotency_entry *entry) {
+	if (entry->newer) {
+		entry->newer->older = entry->older;
+	} else {
+		cache->newest = entry->older;
+	}
+	if (entry->older) {
+		entry->older->newer = entry->newer;
+	} else {
+		cache->oldest = entry->newer;
+	}
+	entry->newer = entry->older = NULL;
+}
+
+static void linkNewest(struct idempotency_cache *cache, struct idempotency_entry *entry) {
+	entry->older = cache->newest;
+	entry->newer = NULL;
+	if (cache->newest) {
+		cache->newest->newer = entry;
+	} else {
+		cache->oldest = entry;
+	}
+	cache->newest = entry;
+}
+
+/**
+ * \brief Removes the entry from its bucket and the LRU list and puts it into the free list.
+ */
+static void removeEntry(struct idempotency_cache *cache, struct idempotency_entry *entry) {
+	struct idempotency_entry **slot = findSlot(cache, entry->key);
+	*slot = entry->nextInBucket;
+	unlinkLru(cache, entry);
+
+	free(entry->response);
+	entry->response = NULL;
+	entry->nextInBucket = cache->free;
+	cache->free = entry;
+}
+
+/**
+ * \brief Inserts a new entry for the key (which must not be in the cache).
+ */
+static struct idempotency_entry *insertEntry(struct idempotency_cache *cache, const char *key) {
+	if (cache->free == NULL) {
+		removeEntry(cache, cache->oldest);
+	}
+
+	struct idempotency_entry *entry = cache->free;
+	cache->free = entry->nextInBucket;
+
+	snprintf(entry->key, sizeof(entry->key), "%s", key);
+	struct idempotency_entry **slot = &cache->buckets[hashKey(entry->key) & cache->bucketMask];
+	entry->nextInBucket = *slot;
+	*slot = entry;
+	linkNewest(cache, entry);
+
+	return entry;
+}
+
+/**
+ * \brief Appends an entry to the journal, without the response if it is not answered yet.
+ * Keys or responses which would break the line format are not journaled.
+ */
+static void journalEntry(FILE *journal, struct idempotency_entry *entry) {
+	if (strpbrk(entry->key, "\t\n") != NULL || (entry->response && strchr(entry->response, '\n') != NULL)) {
+		return;
+	}
+	if (entry->state == IDEMPOTENCY_DONE) {
+		fprintf(journal, "%lld\t%s\t%s\n", entry->expires, entry->key, entry->response);
+	} else {
+		fprintf(journal, "%lld\t%s\n", entry->expires, entry->key);
+	}
+}
+
+/**
+ * \brief Rewrites the journal with the entries in the cache (oldest first), it is replaced
+ * atomically. Returns 0 on success.
+ */
+static int compactJournal(struct idempotency_cache *cache) {
+	char *tmpPath = NULL;
+	if (asprintf(&tmpPath, "%s.tmp", cache->journalPath) < 0) {
+		return -1;
+	}
+
+	FILE *journal = fopen(tmpPath, "w");
+	if (journal == NULL) {
+		free(tmpPath);
+		return -1;
+	}
+
+	unsigned int lines = 0;
+	for (struct idempotency_entry *entry = cache->oldest; entry != NULL; entry = entry->newer) {
+		journalEntry(journal, entry);
+		lines++;
+	}
+
+	if (fflush(journal) != 0 || rename(tmpPath, cache->journalPath) != 0) {
+		fclose(journal);
+		remove(tmpPath);
+		free(tmpPath);
+		return -1;
+	}
+	free(tmpPath);
+
+	if (cache->journal) {
+		fclose(cache->journal);
+	}
+	cache->journal = journal;
+	cache->journalLines = lines;
+	return 0;
+}
+
+/**
+ * \brief Appends an entry to the journal (if enabled).
+ */
+static void journalAppend(struct idempotency_cache *cache, struct idempotency_entry *entry) {
+	if (cache->journal == NULL) {
+		return;
+	}
+	journalEntry(cache->journal, entry);
+	fflush(cache->journal);
+	cache->journalLines++;
+}
+
+/**
+ * \brief Compacts the journal once it has grown to IDEMPOTENCY_JOURNAL_FACTOR times the capacity
+ * lines. If that fails the journal is kept and appended to.
+ */
+static void journalCheckSize(struct idempotency_cache *cache) {
+	if (cache->journal && cache->journalLines >= cache->capacity * IDEMPOTENCY_JOURNAL_FACTOR) {
+		compactJournal(cache);
+	}
+}
+
+/**
+ * \brief Loads the not yet expired entries from the journal: lines "<expires>\t<key>\t<response>"
+ * (answered), "<expires>\t<key>" (in flight, loaded as IDEMPOTENCY_UNKNOWN) and "0\t<key>" (forgotten).
+ */
+static void loadJournal(struct idempotency_cache *cache, const char *journalPath, long long now) {
+	FILE *in = fopen(journalPath, "r");
+	if (in == NULL) {
+		return;
+	}
+
+	char *line = NULL;
+	size_t lineSize = 0;
+	ssize_t len;
+	while ((len = getline(&line, &lineSize, in)) > 0) {
+		if (line[len - 1] == '\n') {
+			line[len - 1] = 0;
+		}
+
+		char *key = strchr(line, '\t');
+		if (key == NULL) {
+			continue;
+		}
+		*key++ = 0;
+		char *response = strchr(key, '\t');
+		if (response != NULL) {
+			*response++ = 0;
+		}
+		if (strlen(key) >= IDEMPOTENCY_KEY_SIZE) {
+			continue;
+		}
+
+		struct idempotency_entry *entry = *findSlot(cache, key);
+		if (entry != NULL) {
+			// a later line for the same key wins
+			removeEntry(cache, entry);
+		}
+
+		long long expires = atoll(line);
+		if (expires <= now) {
+			continue;
+		}
+
+		entry = insertEntry(cache, key);
+		entry->expires = expires;
+		if (response == NULL) {
+			entry->state = IDEMPOTENCY_UNKNOWN;
+			continue;
+		}
+		entry->state = IDEMPOTENCY_DONE;
+		entry->response = strdup(response);
+		if (entry->response == NULL) {
+			removeEntry(cache, entry);
+		}
+	}
+
+	free(line);
+	fclose(in);
+}
+
+int idempotencyInit(struct idempotency_cache *cache, unsigned int capacity, long long ttl,
+		const char *journalPath, long long now) {
+	memset(cache, 0, sizeof(*cache));
+	if (capacity == 0) {
+		return -1;
+	}
+
+	unsigned int buckets = 1;
+	while (buckets < capacity * 2) {
+		buckets <<= 1;
+	}
+
+	cache->capacity = capacity;
+	cache->ttl = ttl;
+	cache->bucketMask = buckets - 1;
+	cache->pool = calloc(capacity, sizeof(struct idempotency_entry));
+	cache->buckets = calloc(buckets, sizeof(struct idempotency_entry *));
+	if (cache->pool == NULL || cache->buckets == NULL) {
+		idempotencyFree(cache);
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < capacity; i++) {
+		cache->pool[i].nextInBucket = cache->free;
+		cache->free = &cache->pool[i];
+	}
+
+	if (journalPath == NULL) {
+		return 0;
+	}
+
+	cache->journalPath = strdup(journalPath);
+	if (cache->journalPath == NULL) {
+		return -1;
+	}
+
+	loadJournal(cache, journalPath, now);
+
+	// rewrite it with the loaded entries and keep appending
+	return compactJournal(cache);
+}
+
+struct idempotency_entry *idempotencyLookup(struct idempotency_cache *cache, const char *key, long long now) {
+	struct idempotency_entry *entry = *findSlot(cache, key);
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	if (entry->expires <= now) {
+		removeEntry(cache, entry);
+		return NULL;
+	}
+
+	unlinkLru(cache, entry);
+	linkNewest(cache, entry);
+	return entry;
+}
+
+void idempotencyBegin(struct idempotency_cache *cache, const char *key, long long now) {
+	struct idempotency_entry *entry = insertEntry(cache, key);
+	entry->state = IDEMPOTENCY_IN_FLIGHT;
+	entry->expires = now + cache->ttl;
+
+	journalAppend(cache, entry);
+	journalCheckSize(cache);
+}
+
+void idempotencyComplete(struct idempotency_cache *cache, const char *key, const char *response, size_t len,
+		long long now) {
+	struct idempotency_entry *entry = *findSlot(cache, key);
+	if (entry == NULL) {
+		// already evicted
+		return;
+	}
+
+	free(entry->response);
+	entry->response = strndup(response, len);
+	if (entry->response == NULL) {
+		removeEntry(cache, entry);
+		return;
+	}
+	entry->state = IDEMPOTENCY_DONE;
+	entry->expires = now + cache->ttl;
+
+	journalAppend(cache, entry);
+	journalCheckSize(cache);
+}
+
+void idempotencyForget(struct idempotency_cache *cache, const char *key) {
+	struct idempotency_entry *entry = *findSlot(cache, key);
+	if (entry == NULL) {
+		return;
+	}
+
+	if (entry->state == IDEMPOTENCY_IN_FLIGHT) {
+		// a later line for the same key wins, an expired one removes it
+		entry->expires = 0;
+		journalAppend(cache, entry);
+	}
+	removeEntry(cache, entry);
+	journalCheckSize(cache);
+}
+
+void idempotencyFree(struct idempotency_cache *cache) {
+	if (cache->pool) {
+		for (unsigned int i = 0; i < cache->capacity; i++) {
+			free(cache->pool[i].response);
+		}
+	}
+	free(cache->pool);
+	free(cache->buckets);
+	if (cache->journal) {
+		fclose(cache->journal);
+	}
+	free(cache->journalPath);
+	memset(cache, 0, sizeof(*cache));
+}
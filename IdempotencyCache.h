@@ -0,0 +1,124 @@
+/** \file IdempotencyCache.h
+ *  \brief Bounded LRU cache of recently received requests keyed by their msgId.
+ *
+ *  Used to recognize requests which are republished by a client (e.g. after a timeout).
+ *  Lookups go through a hash table with chaining, the entries are kept in a doubly linked
+ *  list in LRU order, so lookup, insert and eviction are O(1). All memory except the cached
+ *  responses is allocated once by idempotencyInit().
+ *
+ *  Requests can optionally be appended to a journal file when they are received, completed or
+ *  forgotten. It is read back (and compacted) on startup, so duplicates are also recognized
+ *  across restarts. It is compacted again once it has grown to IDEMPOTENCY_JOURNAL_FACTOR
+ *  times the capacity lines. A request which was still in flight at the restart is loaded as
+ *  IDEMPOTENCY_UNKNOWN, it may or may not have been executed.
+ */
+
+#ifndef _IDEMPOTENCY_CACHE_H_
+#define _IDEMPOTENCY_CACHE_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+/** \brief Maximum length of a key (incl. the terminating zero) */
+#define IDEMPOTENCY_KEY_SIZE 80
+
+/** \brief The journal is compacted once it has this many times the capacity lines */
+#define IDEMPOTENCY_JOURNAL_FACTOR 2
+
+/** \brief State of a cached request */
+enum idempotency_state {
+	/** \brief Received, but not answered yet */
+	IDEMPOTENCY_IN_FLIGHT,
+	/** \brief Answered, the response is cached */
+	IDEMPOTENCY_DONE,
+	/** \brief In flight when the journal was written, it is unknown whether it has been executed */
+	IDEMPOTENCY_UNKNOWN
+};
+
+/**
+ * \brief A cached request.
+ */
+struct idempotency_entry {
+	/** \brief The key (device and msgId of the request) */
+	char key[IDEMPOTENCY_KEY_SIZE];
+	/** \brief State of the request */
+	enum idempotency_state state;
+	/** \brief The response (only IDEMPOTENCY_DONE) */
+	char *response;
+	/** \brief Wall clock time in ms after which the entry is dropped */
+	long long expires;
+	/** \brief Next entry in the same hash bucket (or in the free list) */
+	struct idempotency_entry *nextInBucket;
+	/** \brief More recently used entry */
+	struct idempotency_entry *newer;
+	/** \brief Less recently used entry */
+	struct idempotency_entry *older;
+};
+
+/**
+ * \brief The cache.
+ */
+struct idempotency_cache {
+	/** \brief Maximum number of entries */
+	unsigned int capacity;
+	/** \brief Time to live of the entries in ms */
+	long long ttl;
+	/** \brief Storage for all entries */
+	struct idempotency_entry *pool;
+	/** \brief Unused entries */
+	struct idempotency_entry *free;
+	/** \brief Hash buckets (bucketMask + 1 of them) */
+	struct idempotency_entry **buckets;
+	/** \brief Number of buckets - 1 (power of two) */
+	unsigned int bucketMask;
+	/** \brief Most recently used entry */
+	struct idempotency_entry *newest;
+	/** \brief Least recently used entry (evicted first) */
+	struct idempotency_entry *oldest;
+	/** \brief Journal of the requests (NULL if disabled) */
+	FILE *journal;
+	/** \brief Path of the journal */
+	char *journalPath;
+	/** \brief Number of lines in the journal */
+	unsigned int journalLines;
+};
+
+/**
+ * \brief Allocates the cache. If journalPath is not NULL the not yet expired entries are
+ * loaded from the journal, which is then rewritten (compacted) and kept open for appending.
+ * Returns 0 on success.
+ */
+int idempotencyInit(struct idempotency_cache *cache, unsigned int capacity, long long ttl,
+		const char *journalPath, long long now);
+
+/**
+ * \brief Returns the entry for the key or NULL if there is none (or it has expired).
+ * A found entry becomes the most recently used one.
+ */
+struct idempotency_entry *idempotencyLookup(struct idempotency_cache *cache, const char *key, long long now);
+
+/**
+ * \brief Adds an in-flight entry for the key (which must not be in the cache), evicting the least
+ * recently used entry if the cache is full, and appends it to the journal.
+ */
+void idempotencyBegin(struct idempotency_cache *cache, const char *key, long long now);
+
+/**
+ * \brief Stores the response (len bytes, not necessarily zero terminated) of the request
+ * and appends it to the journal.
+ */
+void idempotencyComplete(struct idempotency_cache *cache, const char *key, const char *response, size_t len,
+		long long now);
+
+/**
+ * \brief Removes the entry for the key (e.g. the request has not been executed after all),
+ * the removal is appended to the journal.
+ */
+void idempotencyForget(struct idempotency_cache *cache, const char *key);
+
+/**
+ * \brief Releases all memory and closes the journal.
+ */
+void idempotencyFree(struct idempotency_cache *cache);
+
+#endif
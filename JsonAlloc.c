@@ -0,0 +1,52 @@
+/** \file JsonAlloc.c
+ *  \brief Allocation functions for jansson which take the memory from an arena.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "JsonAlloc.h"
+
+struct arena *jsonArena = NULL;
+unsigned long long jsonAllocations = 0;
+unsigned long long jsonHeapAllocations = 0;
+
+/**
+ * \brief Header in front of every jansson allocation, tells jsonFree() where it came from.
+ */
+union json_alloc_header {
+	/** \brief 1 if the memory was taken from an arena (it is released with the arena) */
+	int fromArena;
+	/** \brief Keeps the allocation aligned */
+	max_align_t align;
+};
+
+void *jsonAlloc(size_t size) {
+	union json_alloc_header *header = NULL;
+
+	jsonAllocations++;
+	if (jsonArena) {
+		header = arenaAlloc(jsonArena, sizeof(*header) + size);
+	}
+	if (header) {
+		header->fromArena = 1;
+	} else {
+		jsonHeapAllocations++;
+		header = malloc(sizeof(*header) + size);
+		if (header == NULL) {
+			return NULL;
+		}
+		header->fromArena = 0;
+	}
+	return header + 1;
+}
+
+void jsonFree(void *p) {
+	if (p == NULL) {
+		return;
+	}
+	union json_alloc_header *header = (union json_alloc_header *) p - 1;
+	if (! header->fromArena) {
+		free(header);
+	}
+}
@@ -0,0 +1,33 @@
+/** \file JsonAlloc.h
+ *  \brief Allocation functions for jansson which take the memory from an arena.
+ *
+ *  Installed with json_set_alloc_funcs(jsonAlloc, jsonFree). While jsonArena is set the DOM of a
+ *  parsed message is allocated from that arena and released with it (arenaReset()), json_decref()
+ *  doesn't free anything then. Without an arena the heap is used.
+ */
+
+#ifndef _JSON_ALLOC_H_
+#define _JSON_ALLOC_H_
+
+#include <stddef.h>
+
+#include "Arena.h"
+
+/** \brief Arena the jansson allocations are taken from (NULL: the heap), set while a request is handled */
+extern struct arena *jsonArena;
+/** \brief Number of jansson allocations */
+extern unsigned long long jsonAllocations;
+/** \brief Number of jansson allocations which were taken from the heap */
+extern unsigned long long jsonHeapAllocations;
+
+/**
+ * \brief Allocation function of jansson, takes the memory from the jsonArena if one is set.
+ */
+void *jsonAlloc(size_t size);
+
+/**
+ * \brief Free function of jansson, memory from an arena is released with the arena.
+ */
+void jsonFree(void *p);
+
+#endif
@@ -0,0 +1,77 @@
+/** \file MsgId.c
+ *  \brief Cheap generator for the msgIds of published messages.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "MsgId.h"
+
+/** \brief Mask of the 30 bit counter */
+#define COUNTER_MASK 0x3FFFFFFFU
+/** \brief Mask of the 44 random bits */
+#define RANDOM_MASK 0xFFFFFFFFFFFULL
+
+static const char HEX[] = "0123456789abcdef";
+
+void msgIdInit(struct msgid_generator *g) {
+	unsigned long long seed[2] = { 0, 0 };
+
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read(fd, seed, sizeof(seed)) != sizeof(seed)) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		seed[0] = ((unsigned long long) ts.tv_sec << 32) ^ ts.tv_nsec ^ ((unsigned long long) getpid() << 16);
+		seed[1] = seed[0] * 0x9E3779B97F4A7C15ULL;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	g->random = seed[0] & RANDOM_MASK;
+	g->counter = (unsigned int) seed[1] & COUNTER_MASK; // random start, the ids of different runs don't line up
+	g->lastMillis = 0;
+}
+
+/**
+ * \brief Writes the lower count bytes of value as hex digits.
+ */
+static char *putHex(char *out, unsigned long long value, int bytes) {
+	for (int i = bytes - 1; i >= 0; i--) {
+		unsigned char b = (unsigned char) (value >> (i * 8));
+		*out++ = HEX[b >> 4];
+		*out++ = HEX[b & 0x0F];
+	}
+	return out;
+}
+
+void msgIdGenerate(struct msgid_generator *g, char *msgId) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	unsigned long long millis = (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	if (millis < g->lastMillis) {
+		millis = g->lastMillis;
+	}
+	g->lastMillis = millis;
+
+	unsigned int counter = g->counter = (g->counter + 1) & COUNTER_MASK;
+
+	// 12 bit rand_a: upper bits of the counter, 62 bit rand_b: lower 18 bits of the counter and the random bits
+	unsigned int randA = (counter >> 18) & 0x0FFF;
+	unsigned long long randB = ((unsigned long long) (counter & 0x3FFFF) << 44) | g->random;
+
+	char *out = msgId;
+	out = putHex(out, millis >> 16, 4);
+	*out++ = '-';
+	out = putHex(out, millis & 0xFFFF, 2);
+	*out++ = '-';
+	out = putHex(out, 0x7000 | randA, 2);
+	*out++ = '-';
+	out = putHex(out, 0x8000 | (randB >> 48), 2);
+	*out++ = '-';
+	out = putHex(out, randB & 0xFFFFFFFFFFFFULL, 6);
+	*out = 0;
+}
@@ -0,0 +1,38 @@
+/** \file MsgId.h
+ *  \brief Cheap generator for the msgIds of published messages.
+ *
+ *  The ids are formatted like UUIDv7 (RFC 9562): 48 bit unix timestamp in ms, version 7,
+ *  variant 10, then a 30 bit counter (incremented for every id) and 44 random bits chosen
+ *  once at startup. Generating an id is a clock_gettime() and some table lookups, no
+ *  system calls beyond that, no locking and no allocation.
+ */
+
+#ifndef _MSGID_H_
+#define _MSGID_H_
+
+/** \brief Size of a formatted msgId (incl. the terminating zero) */
+#define MSGID_SIZE 37
+
+/**
+ * \brief State of the generator.
+ */
+struct msgid_generator {
+	/** \brief The random bits chosen by msgIdInit() */
+	unsigned long long random;
+	/** \brief Incremented for every id */
+	unsigned int counter;
+	/** \brief Timestamp of the last id, the timestamps never go backwards */
+	unsigned long long lastMillis;
+};
+
+/**
+ * \brief Seeds the generator from /dev/urandom (falls back to time and pid if unavailable).
+ */
+void msgIdInit(struct msgid_generator *g);
+
+/**
+ * \brief Writes the next id (lower case, 36 characters plus terminating zero) to msgId.
+ */
+void msgIdGenerate(struct msgid_generator *g, char *msgId);
+
+#endif
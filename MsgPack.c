@@ -0,0 +1,700 @@
+/** \file MsgPack.c
+ *  \brief Transcoding between JSON and MessagePack.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MsgPack.h"
+
+/** \brief Maximum nesting of objects and arrays */
+#define MAX_DEPTH 32
+
+/**
+ * \brief The output buffer of a transcoding.
+ */
+struct output {
+	char **buffer;
+	size_t *size;
+	size_t used;
+};
+
+/**
+ * \brief Makes room for n more bytes. Returns 0 on success.
+ */
+static int reserve(struct output *out, size_t n) {
+	if (*out->buffer != NULL && out->used + n <= *out->size) {
+		return 0;
+	}
+
+	size_t size = *out->size ? *out->size : 256;
+	while (out->used + n > size) {
+		size *= 2;
+	}
+	char *buffer = realloc(*out->buffer, size);
+	if (buffer == NULL) {
+		return -1;
+	}
+	*out->buffer = buffer;
+	*out->size = size;
+	return 0;
+}
+
+static int put(struct output *out, const void *data, size_t n) {
+	if (reserve(out, n)) {
+		return -1;
+	}
+	memcpy(*out->buffer + out->used, data, n);
+	out->used += n;
+	return 0;
+}
+
+static int putByte(struct output *out, unsigned char c) {
+	return put(out, &c, 1);
+}
+
+/**
+ * \brief Writes the type byte followed by the value in big endian (bytes long).
+ */
+static int putTyped(struct output *out, unsigned char type, unsigned long long value, int bytes) {
+	unsigned char data[9];
+	data[0] = type;
+	for (int i = 0; i < bytes; i++) {
+		data[bytes - i] = (unsigned char) (value >> (8 * i));
+	}
+	return put(out, data, bytes + 1);
+}
+
+// JSON -> MessagePack
+
+/**
+ * \brief The JSON text which is transcoded.
+ */
+struct input {
+	const char *p;
+	const char *end;
+};
+
+static void skipWhitespace(struct input *in) {
+	while (in->p < in->end && (*in->p == ' ' || *in->p == '\t' || *in->p == '\n' || *in->p == '\r')) {
+		in->p++;
+	}
+}
+
+/**
+ * \brief Replaces the 5 bytes reserved at offset for the header of a string, array or map by the
+ * shortest header for count (moving the content behind it).
+ * \details small is the type byte of the fix variant and its maximum count + 1, the 8 bit variant is
+ * only available for strings (type8 != 0).
+ */
+static void finishHeader(struct output *out, size_t offset, unsigned long long count,
+		unsigned char small, unsigned long long smallLimit, unsigned char type8, unsigned char type16, unsigned char type32) {
+	unsigned char header[5];
+	int len;
+
+	if (count < smallLimit) {
+		header[0] = small | (unsigned char) count;
+		len = 1;
+	} else if (type8 && count < 256) {
+		header[0] = type8;
+		header[1] = (unsigned char) count;
+		len = 2;
+	} else if (count < 65536) {
+		header[0] = type16;
+		header[1] = (unsigned char) (count >> 8);
+		header[2] = (unsigned char) count;
+		len = 3;
+	} else {
+		header[0] = type32;
+		header[1] = (unsigned char) (count >> 24);
+		header[2] = (unsigned char) (count >> 16);
+		header[3] = (unsigned char) (count >> 8);
+		header[4] = (unsigned char) count;
+		len = 5;
+	}
+
+	char *start = *out->buffer + offset;
+	memmove(start + len, start + 5, out->used - offset - 5);
+	memcpy(start, header, len);
+	out->used -= 5 - len;
+}
+
+static int hexValue(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+/**
+ * \brief Reads the 4 hex digits of a \\u escape.
+ */
+static long readHex4(struct input *in) {
+	if (in->end - in->p < 4) {
+		return -1;
+	}
+	long value = 0;
+	for (int i = 0; i < 4; i++) {
+		int digit = hexValue(in->p[i]);
+		if (digit < 0) {
+			return -1;
+		}
+		value = value * 16 + digit;
+	}
+	in->p += 4;
+	return value;
+}
+
+static int putUtf8(struct output *out, unsigned long cp) {
+	unsigned char data[4];
+	int len;
+	if (cp < 0x80) {
+		data[0] = (unsigned char) cp;
+		len = 1;
+	} else if (cp < 0x800) {
+		data[0] = 0xC0 | (cp >> 6);
+		data[1] = 0x80 | (cp & 0x3F);
+		len = 2;
+	} else if (cp < 0x10000) {
+		data[0] = 0xE0 | (cp >> 12);
+		data[1] = 0x80 | ((cp >> 6) & 0x3F);
+		data[2] = 0x80 | (cp & 0x3F);
+		len = 3;
+	} else {
+		data[0] = 0xF0 | (cp >> 18);
+		data[1] = 0x80 | ((cp >> 12) & 0x3F);
+		data[2] = 0x80 | ((cp >> 6) & 0x3F);
+		data[3] = 0x80 | (cp & 0x3F);
+		len = 4;
+	}
+	return put(out, data, len);
+}
+
+/**
+ * \brief Transcodes a string (in->p is at the opening quote).
+ */
+static int encodeString(struct input *in, struct output *out) {
+	size_t offset = out->used;
+	if (reserve(out, 5)) {
+		return -1;
+	}
+	out->used += 5;
+
+	in->p++;
+	for (;;) {
+		if (in->p == in->end) {
+			return -1;
+		}
+
+		// copy the run of plain characters at once
+		const char *run = in->p;
+		while (in->p < in->end && *in->p != '"' && *in->p != '\\' && (unsigned char) *in->p >= 0x20) {
+			in->p++;
+		}
+		if (put(out, run, in->p - run)) {
+			return -1;
+		}
+		if (in->p == in->end || (unsigned char) *in->p < 0x20) {
+			return -1;
+		}
+		if (*in->p == '"') {
+			in->p++;
+			break;
+		}
+
+		// escape sequence
+		in->p++;
+		if (in->p == in->end) {
+			return -1;
+		}
+		char c = *in->p++;
+		int rc;
+		switch (c) {
+		case '"':
+		case '\\':
+		case '/':
+			rc = putByte(out, c);
+			break;
+		case 'b':
+			rc = putByte(out, '\b');
+			break;
+		case 'f':
+			rc = putByte(out, '\f');
+			break;
+		case 'n':
+			rc = putByte(out, '\n');
+			break;
+		case 'r':
+			rc = putByte(out, '\r');
+			break;
+		case 't':
+			rc = putByte(out, '\t');
+			break;
+		case 'u': {
+			long cp = readHex4(in);
+			if (cp < 0) {
+				return -1;
+			}
+			if (cp >= 0xD800 && cp <= 0xDBFF) {
+				// surrogate pair
+				if (in->end - in->p < 2 || in->p[0] != '\\' || in->p[1] != 'u') {
+					return -1;
+				}
+				in->p += 2;
+				long low = readHex4(in);
+				if (low < 0xDC00 || low > 0xDFFF) {
+					return -1;
+				}
+				cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+			}
+			rc = putUtf8(out, cp);
+			break;
+		}
+		default:
+			return -1;
+		}
+		if (rc) {
+			return -1;
+		}
+	}
+
+	finishHeader(out, offset, out->used - offset - 5, 0xA0, 32, 0xD9, 0xDA, 0xDB);
+	return 0;
+}
+
+static int encodeInteger(struct output *out, const char *text) {
+	errno = 0;
+	if (text[0] == '-') {
+		long long v = strtoll(text, NULL, 10);
+		if (errno == ERANGE) {
+			return 1;
+		}
+		if (v >= -32) {
+			return putByte(out, (unsigned char) (v & 0xFF));
+		}
+		if (v >= -128) {
+			return putTyped(out, 0xD0, (unsigned long long) v, 1);
+		}
+		if (v >= -32768) {
+			return putTyped(out, 0xD1, (unsigned long long) v, 2);
+		}
+		if (v >= -2147483648LL) {
+			return putTyped(out, 0xD2, (unsigned long long) v, 4);
+		}
+		return putTyped(out, 0xD3, (unsigned long long) v, 8);
+	}
+
+	unsigned long long v = strtoull(text, NULL, 10);
+	if (errno == ERANGE) {
+		return 1;
+	}
+	if (v < 128) {
+		return putByte(out, (unsigned char) v);
+	}
+	if (v < 256) {
+		return putTyped(out, 0xCC, v, 1);
+	}
+	if (v < 65536) {
+		return putTyped(out, 0xCD, v, 2);
+	}
+	if (v < 4294967296ULL) {
+		return putTyped(out, 0xCE, v, 4);
+	}
+	return putTyped(out, 0xCF, v, 8);
+}
+
+static int encodeReal(struct output *out, const char *text) {
+	double d = strtod(text, NULL);
+	unsigned long long bits;
+	memcpy(&bits, &d, sizeof(bits));
+	return putTyped(out, 0xCB, bits, 8);
+}
+
+static int encodeNumber(struct input *in, struct output *out) {
+	const char *start = in->p;
+	int real = 0;
+
+	if (in->p < in->end && *in->p == '-') {
+		in->p++;
+	}
+	while (in->p < in->end) {
+		char c = *in->p;
+		if (c == '.' || c == 'e' || c == 'E' || c == '+' || (c == '-' && in->p > start)) {
+			real = 1;
+		} else if (c < '0' || c > '9') {
+			break;
+		}
+		in->p++;
+	}
+
+	char text[64];
+	size_t len = in->p - start;
+	if (len == 0 || len >= sizeof(text)) {
+		return -1;
+	}
+	memcpy(text, start, len);
+	text[len] = 0;
+
+	if (! real) {
+		int rc = encodeInteger(out, text);
+		if (rc <= 0) {
+			return rc;
+		}
+		// out of range, fall through
+	}
+	return encodeReal(out, text);
+}
+
+static int encodeValue(struct input *in, struct output *out, int depth);
+
+/**
+ * \brief Transcodes an object (isMap) or an array (in->p is at the opening bracket).
+ */
+static int encodeContainer(struct input *in, struct output *out, int depth, int isMap) {
+	if (depth >= MAX_DEPTH) {
+		return -1;
+	}
+
+	size_t offset = out->used;
+	if (reserve(out, 5)) {
+		return -1;
+	}
+	out->used += 5;
+
+	char close = isMap ? '}' : ']';
+	unsigned long long count = 0;
+
+	in->p++;
+	skipWhitespace(in);
+	if (in->p < in->end && *in->p == close) {
+		in->p++;
+	} else {
+		for (;;) {
+			if (isMap) {
+				skipWhitespace(in);
+				if (in->p == in->end || *in->p != '"' || encodeString(in, out)) {
+					return -1;
+				}
+				skipWhitespace(in);
+				if (in->p == in->end || *in->p != ':') {
+					return -1;
+				}
+				in->p++;
+			}
+			if (encodeValue(in, out, depth + 1)) {
+				return -1;
+			}
+			count++;
+
+			skipWhitespace(in);
+			if (in->p == in->end) {
+				return -1;
+			}
+			if (*in->p == close) {
+				in->p++;
+				break;
+			}
+			if (*in->p != ',') {
+				return -1;
+			}
+			in->p++;
+		}
+	}
+
+	if (isMap) {
+		finishHeader(out, offset, count, 0x80, 16, 0, 0xDE, 0xDF);
+	} else {
+		finishHeader(out, offset, count, 0x90, 16, 0, 0xDC, 0xDD);
+	}
+	return 0;
+}
+
+static int encodeLiteral(struct input *in, struct output *out, const char *literal, unsigned char value) {
+	size_t len = strlen(literal);
+	if ((size_t) (in->end - in->p) < len || memcmp(in->p, literal, len) != 0) {
+		return -1;
+	}
+	in->p += len;
+	return putByte(out, value);
+}
+
+static int encodeValue(struct input *in, struct output *out, int depth) {
+	skipWhitespace(in);
+	if (in->p == in->end) {
+		return -1;
+	}
+
+	switch (*in->p) {
+	case '{':
+		return encodeContainer(in, out, depth, 1);
+	case '[':
+		return encodeContainer(in, out, depth, 0);
+	case '"':
+		return encodeString(in, out);
+	case 't':
+		return encodeLiteral(in, out, "true", 0xC3);
+	case 'f':
+		return encodeLiteral(in, out, "false", 0xC2);
+	case 'n':
+		return encodeLiteral(in, out, "null", 0xC0);
+	default:
+		if (*in->p == '-' || (*in->p >= '0' && *in->p <= '9')) {
+			return encodeNumber(in, out);
+		}
+		return -1;
+	}
+}
+
+int msgpackIsMap(const char *data, size_t len) {
+	if (len == 0) {
+		return 0;
+	}
+	unsigned char c = *data;
+	return (c & 0xF0) == 0x80 || c == 0xDE || c == 0xDF;
+}
+
+int msgpackFromJson(const char *json, size_t len, char **buffer, size_t *size) {
+	struct input in = { json, json + len };
+	struct output out = { buffer, size, 0 };
+
+	if (encodeValue(&in, &out, 0)) {
+		return -1;
+	}
+	skipWhitespace(&in);
+	if (in.p != in.end) {
+		return -1;
+	}
+	return (int) out.used;
+}
+
+// MessagePack -> JSON
+
+/**
+ * \brief Reads a big endian value of n bytes. Returns 0 on success.
+ */
+static int readBig(struct input *in, int n, unsigned long long *value) {
+	if (in->end - in->p < n) {
+		return -1;
+	}
+	unsigned long long v = 0;
+	for (int i = 0; i < n; i++) {
+		v = (v << 8) | (unsigned char) in->p[i];
+	}
+	in->p += n;
+	*value = v;
+	return 0;
+}
+
+static int putFormatted(struct output *out, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+static int putFormatted(struct output *out, const char *format, ...) {
+	char text[48];
+	va_list varargs;
+	va_start(varargs, format);
+	int len = vsnprintf(text, sizeof(text), format, varargs);
+	va_end(varargs);
+	if (len < 0 || (size_t) len >= sizeof(text)) {
+		return -1;
+	}
+	return put(out, text, len);
+}
+
+/**
+ * \brief Writes n bytes of a string as JSON string (quoted and escaped).
+ */
+static int decodeString(struct input *in, struct output *out, unsigned long long n) {
+	if ((unsigned long long) (in->end - in->p) < n) {
+		return -1;
+	}
+
+	const char *p = in->p;
+	const char *end = in->p + n;
+	in->p = end;
+
+	if (putByte(out, '"')) {
+		return -1;
+	}
+	while (p < end) {
+		const char *run = p;
+		while (p < end && *p != '"' && *p != '\\' && (unsigned char) *p >= 0x20) {
+			p++;
+		}
+		if (put(out, run, p - run)) {
+			return -1;
+		}
+		if (p == end) {
+			break;
+		}
+
+		unsigned char c = *p++;
+		int rc;
+		if (c == '"' || c == '\\') {
+			char escaped[2] = { '\\', c };
+			rc = put(out, escaped, 2);
+		} else {
+			rc = putFormatted(out, "\\u%04x", c);
+		}
+		if (rc) {
+			return -1;
+		}
+	}
+	return putByte(out, '"');
+}
+
+/**
+ * \brief Reads the length of a string (the type byte has been read). Returns -1 if it is no string.
+ */
+static int stringLength(struct input *in, unsigned char type, unsigned long long *n) {
+	if ((type & 0xE0) == 0xA0) {
+		*n = type & 0x1F;
+		return 0;
+	}
+	switch (type) {
+	case 0xD9:
+		return readBig(in, 1, n);
+	case 0xDA:
+		return readBig(in, 2, n);
+	case 0xDB:
+		return readBig(in, 4, n);
+	default:
+		return -1;
+	}
+}
+
+static int decodeValue(struct input *in, struct output *out, int depth);
+
+static int decodeContainer(struct input *in, struct output *out, int depth, unsigned long long count, int isMap) {
+	if (depth >= MAX_DEPTH) {
+		return -1;
+	}
+	if (putByte(out, isMap ? '{' : '[')) {
+		return -1;
+	}
+
+	for (unsigned long long i = 0; i < count; i++) {
+		if (i > 0 && putByte(out, ',')) {
+			return -1;
+		}
+		if (isMap) {
+			// only string keys can be represented in JSON
+			unsigned long long n;
+			if (in->p == in->end) {
+				return -1;
+			}
+			unsigned char type = *in->p++;
+			if (stringLength(in, type, &n) || decodeString(in, out, n) || putByte(out, ':')) {
+				return -1;
+			}
+		}
+		if (decodeValue(in, out, depth + 1)) {
+			return -1;
+		}
+	}
+
+	return putByte(out, isMap ? '}' : ']');
+}
+
+static int decodeReal(struct output *out, double d) {
+	if (isnan(d) || isinf(d)) {
+		return put(out, "null", 4);
+	}
+	return putFormatted(out, "%.17g", d);
+}
+
+static int decodeValue(struct input *in, struct output *out, int depth) {
+	if (in->p == in->end) {
+		return -1;
+	}
+
+	unsigned char type = *in->p++;
+	unsigned long long v;
+
+	if (type < 0x80) {
+		return putFormatted(out, "%u", type);
+	}
+	if (type >= 0xE0) {
+		return putFormatted(out, "%d", (signed char) type);
+	}
+	if ((type & 0xF0) == 0x80) {
+		return decodeContainer(in, out, depth, type & 0x0F, 1);
+	}
+	if ((type & 0xF0) == 0x90) {
+		return decodeContainer(in, out, depth, type & 0x0F, 0);
+	}
+	if (stringLength(in, type, &v) == 0) {
+		return decodeString(in, out, v);
+	}
+
+	switch (type) {
+	case 0xC0:
+		return put(out, "null", 4);
+	case 0xC2:
+		return put(out, "false", 5);
+	case 0xC3:
+		return put(out, "true", 4);
+	case 0xCA: {
+		if (readBig(in, 4, &v)) {
+			return -1;
+		}
+		unsigned int bits = (unsigned int) v;
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		return decodeReal(out, f);
+	}
+	case 0xCB: {
+		if (readBig(in, 8, &v)) {
+			return -1;
+		}
+		double d;
+		memcpy(&d, &v, sizeof(d));
+		return decodeReal(out, d);
+	}
+	case 0xCC:
+	case 0xCD:
+	case 0xCE:
+	case 0xCF:
+		if (readBig(in, 1 << (type - 0xCC), &v)) {
+			return -1;
+		}
+		return putFormatted(out, "%llu", v);
+	case 0xD0:
+		return readBig(in, 1, &v) ? -1 : putFormatted(out, "%d", (signed char) v);
+	case 0xD1:
+		return readBig(in, 2, &v) ? -1 : putFormatted(out, "%d", (short) v);
+	case 0xD2:
+		return readBig(in, 4, &v) ? -1 : putFormatted(out, "%d", (int) v);
+	case 0xD3:
+		return readBig(in, 8, &v) ? -1 : putFormatted(out, "%lld", (long long) v);
+	case 0xDC:
+		return readBig(in, 2, &v) ? -1 : decodeContainer(in, out, depth, v, 0);
+	case 0xDD:
+		return readBig(in, 4, &v) ? -1 : decodeContainer(in, out, depth, v, 0);
+	case 0xDE:
+		return readBig(in, 2, &v) ? -1 : decodeContainer(in, out, depth, v, 1);
+	case 0xDF:
+		return readBig(in, 4, &v) ? -1 : decodeContainer(in, out, depth, v, 1);
+	default:
+		// bin, ext and the unused type
+		return -1;
+	}
+}
+
+int msgpackToJson(const char *data, size_t len, char **buffer, size_t *size) {
+	struct input in = { data, data + len };
+	struct output out = { buffer, size, 0 };
+
+	if (decodeValue(&in, &out, 0) || in.p != in.end || putByte(&out, 0)) {
+		return -1;
+	}
+	return (int) out.used - 1;
+}
@@ -0,0 +1,36 @@
+/** \file MsgPack.h
+ *  \brief Transcoding between JSON and MessagePack.
+ *
+ *  payoutd formats all of its messages as JSON. For topics which use MessagePack the formatted
+ *  message is transcoded by msgpackFromJson() in a single pass, so both encodings always carry
+ *  the same fields. Requests in MessagePack are transcoded back by msgpackToJson() and then
+ *  parsed like any other request.
+ *
+ *  Supported are objects/maps (with string keys), arrays, strings, integers, reals, true, false
+ *  and null. The output is written to a growable buffer (*buffer, *size), which may be reused
+ *  across calls.
+ */
+
+#ifndef _MSGPACK_H_
+#define _MSGPACK_H_
+
+#include <stddef.h>
+
+/**
+ * \brief Test if the data starts like a MessagePack map (fixmap, map 16 or map 32), i.e. not like JSON.
+ */
+int msgpackIsMap(const char *data, size_t len);
+
+/**
+ * \brief Transcodes the JSON text (len bytes) to MessagePack.
+ * Returns the length of the result or -1 if the JSON is invalid.
+ */
+int msgpackFromJson(const char *json, size_t len, char **buffer, size_t *size);
+
+/**
+ * \brief Transcodes the MessagePack data (len bytes) to JSON text (zero terminated).
+ * Returns the length of the result or -1 if the data is invalid or contains unsupported types.
+ */
+int msgpackToJson(const char *data, size_t len, char **buffer, size_t *size);
+
+#endif
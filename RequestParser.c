@@ -0,0 +1,277 @@
+/** \file RequestParser.c
+ *  \brief Single pass parser for the request messages of payoutd.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "RequestParser.h"
+
+/**
+ * \brief Describes where a known property is stored in struct request.
+ */
+struct request_field_def {
+	/** \brief Name of the property */
+	const char *name;
+	/** \brief Length of the name */
+	size_t nameLen;
+	/** \brief REQUEST_* bit of the property */
+	unsigned int field;
+	/** \brief Offset of the value in struct request */
+	size_t offset;
+	/** \brief Size of the buffer for string properties, 0 for integer properties */
+	size_t size;
+};
+
+#define STRING_FIELD(n, f, m) { n, sizeof(n) - 1, f, offsetof(struct request, m), sizeof(((struct request *) 0)->m) }
+#define INTEGER_FIELD(n, f, m) { n, sizeof(n) - 1, f, offsetof(struct request, m), 0 }
+
+static const struct request_field_def FIELDS[] = {
+	STRING_FIELD("msgId", REQUEST_MSGID, msgId),
+	STRING_FIELD("cmd", REQUEST_CMD, cmd),
+	INTEGER_FIELD("amount", REQUEST_AMOUNT, amount),
+	INTEGER_FIELD("level", REQUEST_LEVEL, level),
+	STRING_FIELD("channels", REQUEST_CHANNELS, channels),
+	INTEGER_FIELD("r", REQUEST_R, r),
+	INTEGER_FIELD("g", REQUEST_G, g),
+	INTEGER_FIELD("b", REQUEST_B, b),
+	INTEGER_FIELD("type", REQUEST_TYPE, type),
+	INTEGER_FIELD("deadline", REQUEST_DEADLINE, deadline),
+	INTEGER_FIELD("ttl", REQUEST_TTL, ttl),
+	STRING_FIELD("source", REQUEST_SOURCE, source),
+};
+
+#define FIELD_COUNT (sizeof(FIELDS) / sizeof(FIELDS[0]))
+
+static const struct request_field_def *findField(const char *name, size_t len) {
+	for (unsigned int i = 0; i < FIELD_COUNT; i++) {
+		if (FIELDS[i].nameLen == len && memcmp(FIELDS[i].name, name, len) == 0) {
+			return &FIELDS[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * \brief Stores a string value, it is only valid if it fits into the buffer.
+ */
+static void storeString(struct request *request, const struct request_field_def *def,
+		const char *value, size_t len) {
+	request->present |= def->field;
+	if (def->size == 0 || len >= def->size) {
+		return;
+	}
+
+	char *target = (char *) request + def->offset;
+	memcpy(target, value, len);
+	target[len] = 0;
+	request->valid |= def->field;
+}
+
+/**
+ * \brief Stores an integer value.
+ */
+static void storeInteger(struct request *request, const struct request_field_def *def, long long value) {
+	request->present |= def->field;
+	if (def->size != 0) {
+		return;
+	}
+
+	*(long long *) ((char *) request + def->offset) = value;
+	request->valid |= def->field;
+}
+
+static const char *skipWhitespace(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+		p++;
+	}
+	return p;
+}
+
+/**
+ * \brief Scans a string starting after the opening quote. Returns a pointer to the closing
+ * quote or NULL if the string has to be parsed by jansson (escapes, control characters).
+ */
+static const char *scanString(const char *p, const char *end) {
+	while (p < end) {
+		unsigned char c = *p;
+		if (c == '"') {
+			return p;
+		}
+		if (c == '\\' || c < 0x20) {
+			return NULL;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+/**
+ * \brief Scans an integer. Returns a pointer behind it or NULL if the number has to be
+ * parsed by jansson (reals, leading zeros, too many digits).
+ */
+static const char *scanInteger(const char *p, const char *end, long long *value) {
+	int negative = 0;
+	if (p < end && *p == '-') {
+		negative = 1;
+		p++;
+	}
+
+	const char *digits = p;
+	long long v = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		v = v * 10 + (*p - '0');
+		p++;
+	}
+
+	size_t count = p - digits;
+	if (count == 0 || count > 18 || (count > 1 && *digits == '0')) {
+		return NULL;
+	}
+	if (p < end && (*p == '.' || *p == 'e' || *p == 'E')) {
+		return NULL;
+	}
+
+	*value = negative ? -v : v;
+	return p;
+}
+
+static const char *scanLiteral(const char *p, const char *end, const char *literal) {
+	size_t len = strlen(literal);
+	if ((size_t) (end - p) < len || memcmp(p, literal, len) != 0) {
+		return NULL;
+	}
+	return p + len;
+}
+
+int requestParse(const char *message, size_t len, struct request *request) {
+	const char *p = message;
+	const char *end = message + len;
+
+	// the properties which are not present must not keep the values of a former request
+	memset(request, 0, sizeof(*request));
+
+	p = skipWhitespace(p, end);
+	if (p == end || *p != '{') {
+		return -1;
+	}
+	p = skipWhitespace(p + 1, end);
+
+	if (p < end && *p == '}') {
+		p++;
+	} else {
+		for (;;) {
+			// key
+			if (p == end || *p != '"') {
+				return -1;
+			}
+			const char *key = p + 1;
+			const char *keyEnd = scanString(key, end);
+			if (keyEnd == NULL) {
+				return -1;
+			}
+			const struct request_field_def *def = findField(key, keyEnd - key);
+			if (def && (request->present & def->field)) {
+				// duplicate key
+				return -1;
+			}
+
+			p = skipWhitespace(keyEnd + 1, end);
+			if (p == end || *p != ':') {
+				return -1;
+			}
+			p = skipWhitespace(p + 1, end);
+			if (p == end) {
+				return -1;
+			}
+
+			// value, unknown properties are skipped (as long as they are scalars)
+			if (*p == '"') {
+				const char *value = p + 1;
+				const char *valueEnd = scanString(value, end);
+				if (valueEnd == NULL) {
+					return -1;
+				}
+				if (def) {
+					storeString(request, def, value, valueEnd - value);
+				}
+				p = valueEnd + 1;
+			} else if (*p == '-' || (*p >= '0' && *p <= '9')) {
+				long long value;
+				p = scanInteger(p, end, &value);
+				if (p == NULL) {
+					return -1;
+				}
+				if (def) {
+					storeInteger(request, def, value);
+				}
+			} else {
+				const char *next = scanLiteral(p, end, "true");
+				if (next == NULL) {
+					next = scanLiteral(p, end, "false");
+				}
+				if (next == NULL) {
+					next = scanLiteral(p, end, "null");
+				}
+				if (next == NULL) {
+					// objects, arrays or invalid json
+					return -1;
+				}
+				if (def) {
+					// present, but of the wrong type
+					request->present |= def->field;
+				}
+				p = next;
+			}
+
+			p = skipWhitespace(p, end);
+			if (p == end) {
+				return -1;
+			}
+			if (*p == '}') {
+				p++;
+				break;
+			}
+			if (*p != ',') {
+				return -1;
+			}
+			p = skipWhitespace(p + 1, end);
+		}
+	}
+
+	// nothing but whitespace may follow
+	p = skipWhitespace(p, end);
+	return p == end ? 0 : -1;
+}
+
+void requestFromJson(json_t *jMessage, struct request *request) {
+	memset(request, 0, sizeof(*request));
+
+	for (unsigned int i = 0; i < FIELD_COUNT; i++) {
+		const struct request_field_def *def = &FIELDS[i];
+
+		json_t *jValue = json_object_get(jMessage, def->name);
+		if (jValue == NULL) {
+			continue;
+		}
+
+		if (json_is_string(jValue)) {
+			const char *value = json_string_value(jValue);
+			storeString(request, def, value, strlen(value));
+		} else if (json_is_integer(jValue)) {
+			storeInteger(request, def, json_integer_value(jValue));
+		} else {
+			// present, but of the wrong type
+			request->present |= def->field;
+		}
+	}
+}
+
+const char *requestFieldName(unsigned int field) {
+	for (unsigned int i = 0; i < FIELD_COUNT; i++) {
+		if (FIELDS[i].field == field) {
+			return FIELDS[i].name;
+		}
+	}
+	return "unknown";
+}
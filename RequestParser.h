@@ -0,0 +1,82 @@
+/** \file RequestParser.h
+ *  \brief Single pass parser for the request messages of payoutd.
+ *
+ *  The request schema is small and fixed (msgId, cmd, amount, level, channels, r, g, b,
+ *  type, deadline, ttl, source), so requestParse() extracts those properties in one pass
+ *  straight into a struct request without building a DOM and without allocating memory. Anything
+ *  unusual (nested values, escaped strings, reals, duplicate keys, invalid JSON, ...) is
+ *  left to jansson: requestParse() fails and the caller uses json_loads() and
+ *  requestFromJson() instead, which fill the same struct.
+ */
+
+#ifndef _REQUEST_PARSER_H_
+#define _REQUEST_PARSER_H_
+
+#include <stddef.h>
+
+#include <jansson.h>
+
+/** \brief Size of the buffer for the 'msgId' property (incl. the terminating zero) */
+#define REQUEST_MSGID_SIZE 64
+/** \brief Size of the buffer for the 'cmd' property (incl. the terminating zero) */
+#define REQUEST_CMD_SIZE 48
+/** \brief Size of the buffer for the 'channels' property (incl. the terminating zero) */
+#define REQUEST_CHANNELS_SIZE 48
+/** \brief Size of the buffer for the 'source' property (incl. the terminating zero) */
+#define REQUEST_SOURCE_SIZE 16
+
+/** \brief Bits for struct request.present / struct request.valid */
+enum request_field {
+	REQUEST_MSGID = 1 << 0,
+	REQUEST_CMD = 1 << 1,
+	REQUEST_AMOUNT = 1 << 2,
+	REQUEST_LEVEL = 1 << 3,
+	REQUEST_CHANNELS = 1 << 4,
+	REQUEST_R = 1 << 5,
+	REQUEST_G = 1 << 6,
+	REQUEST_B = 1 << 7,
+	REQUEST_TYPE = 1 << 8,
+	REQUEST_DEADLINE = 1 << 9,
+	REQUEST_TTL = 1 << 10,
+	REQUEST_SOURCE = 1 << 11,
+};
+
+/**
+ * \brief The known properties of a request message.
+ */
+struct request {
+	/** \brief Properties contained in the message (REQUEST_* bits) */
+	unsigned int present;
+	/** \brief Properties contained in the message with the expected type and size (REQUEST_* bits) */
+	unsigned int valid;
+	char msgId[REQUEST_MSGID_SIZE];
+	char cmd[REQUEST_CMD_SIZE];
+	char channels[REQUEST_CHANNELS_SIZE];
+	char source[REQUEST_SOURCE_SIZE];
+	long long amount;
+	long long level;
+	long long r;
+	long long g;
+	long long b;
+	long long type;
+	long long deadline;
+	long long ttl;
+};
+
+/**
+ * \brief Parses the message (len bytes, not necessarily zero terminated) into the request.
+ * Returns 0 on success, -1 if the message has to be parsed by jansson.
+ */
+int requestParse(const char *message, size_t len, struct request *request);
+
+/**
+ * \brief Extracts the known properties of an already parsed message into the request.
+ */
+void requestFromJson(json_t *jMessage, struct request *request);
+
+/**
+ * \brief Returns the name of the property (a single REQUEST_* bit).
+ */
+const char *requestFieldName(unsigned int field);
+
+#endif
@@ -0,0 +1,77 @@
+/** \file Resp.c
+ *  \brief RESP encoding of the PUBLISH commands handed to redisAsyncFormattedCommand().
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Resp.h"
+
+int respGrowBuffer(char **buffer, size_t *size, size_t needed) {
+	if (*buffer != NULL && needed <= *size) {
+		return 0;
+	}
+
+	size_t grownSize = *size ? *size : 1024;
+	while (needed > grownSize) {
+		grownSize *= 2;
+	}
+
+	char *grown = realloc(*buffer, grownSize);
+	if (grown == NULL) {
+		return -1;
+	}
+	*buffer = grown;
+	*size = grownSize;
+	return 0;
+}
+
+int respPublishHeader(char **header, const char *prefix, const char *name) {
+	return asprintf(header, "*3\r\n$7\r\nPUBLISH\r\n$%zu\r\n%s%s\r\n", strlen(prefix) + strlen(name), prefix, name);
+}
+
+int respFormatPayload(char **buffer, size_t *size, size_t offset, const char *format, va_list varargs) {
+	if (respGrowBuffer(buffer, size, offset + 3)) {
+		return -1;
+	}
+
+	va_list copy;
+	va_copy(copy, varargs);
+	int len = vsnprintf(*buffer + offset, *size - offset, format, copy);
+	va_end(copy);
+
+	if (len < 0) {
+		return -1;
+	}
+
+	// payload + trailing "\r\n" + terminating zero of vsnprintf
+	if (offset + len + 3 > *size) {
+		if (respGrowBuffer(buffer, size, offset + len + 3)) {
+			return -1;
+		}
+
+		va_copy(copy, varargs);
+		vsnprintf(*buffer + offset, *size - offset, format, copy);
+		va_end(copy);
+	}
+
+	return len;
+}
+
+size_t respFramePublish(char *payload, int len, const char *header, size_t headerLen) {
+	payload[len] = '\r';
+	payload[len + 1] = '\n';
+
+	// "$<len>\r\n" of the payload directly in front of it, the header in front of that
+	char bulk[32];
+	int bulkLen = snprintf(bulk, sizeof(bulk), "$%d\r\n", len);
+
+	memcpy(payload - bulkLen - headerLen, header, headerLen);
+	memcpy(payload - bulkLen, bulk, bulkLen);
+
+	return headerLen + bulkLen;
+}
@@ -0,0 +1,54 @@
+/** \file Resp.h
+ *  \brief RESP encoding of the PUBLISH commands handed to redisAsyncFormattedCommand().
+ *
+ *  The beginning of a PUBLISH command only depends on the topic, it is encoded once by
+ *  respPublishHeader(). A message is formatted by respFormatPayload() behind some reserved space
+ *  of a reused buffer, respFramePublish() then puts the header and the length of the payload
+ *  directly in front of it. So the payload is formatted in place and never copied, once the buffer
+ *  is big enough no memory is allocated.
+ *
+ *  \code
+ *  size_t reserve = headerLen + RESP_HEADER_RESERVE;
+ *  int len = respFormatPayload(&buffer, &size, reserve, format, varargs);
+ *  size_t start = reserve - respFramePublish(buffer + reserve, len, header, headerLen);
+ *  // the command: buffer + start up to buffer + reserve + len + 2
+ *  \endcode
+ */
+
+#ifndef _RESP_H_
+#define _RESP_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/** \brief Space reserved in front of the payload for the length of the payload (and the header) */
+#define RESP_HEADER_RESERVE 128
+
+/**
+ * \brief Grows the buffer (doubling its size, starting with 1024 bytes) until it holds needed bytes.
+ * Returns 0 on success, -1 if no memory is available (the buffer is left as it is).
+ */
+int respGrowBuffer(char **buffer, size_t *size, size_t needed);
+
+/**
+ * \brief Encodes "PUBLISH <prefix><name>" without the payload into *header (allocated).
+ * Returns the length of the header or -1.
+ */
+int respPublishHeader(char **header, const char *prefix, const char *name);
+
+/**
+ * \brief Formats the payload described by format and varargs into the buffer at offset, growing
+ * the buffer if necessary. There is room for the trailing "\r\n" behind it.
+ * Returns the length of the payload or -1.
+ */
+int respFormatPayload(char **buffer, size_t *size, size_t offset, const char *format, va_list varargs)
+		__attribute__ ((format (printf, 4, 0)));
+
+/**
+ * \brief Appends "\r\n" to the payload (len bytes) and puts the header and the length of the
+ * payload directly in front of it. There have to be headerLen + RESP_HEADER_RESERVE bytes in
+ * front of the payload. Returns the number of bytes put in front of it.
+ */
+size_t respFramePublish(char *payload, int len, const char *header, size_t headerLen);
+
+#endif
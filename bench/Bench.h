@@ -0,0 +1,86 @@
+/** \file Bench.h
+ *  \brief Helpers for the micro benchmarks: timing and counting the allocations.
+ *
+ *  Must be included by exactly one file of a benchmark program. It replaces malloc(), calloc(),
+ *  realloc() and free() by versions which count the calls before handing them to the glibc
+ *  allocator (glibc allows that, its own allocations e.g. in vasprintf() are counted as well).
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+/** \brief Number of malloc(), calloc() and realloc() calls so far */
+static unsigned long long benchAllocations = 0;
+
+void *malloc(size_t size) {
+	benchAllocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	benchAllocations++;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+	benchAllocations++;
+	return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+	__libc_free(p);
+}
+
+/**
+ * \brief A running measurement.
+ */
+struct bench {
+	/** \brief Printed in front of the result */
+	const char *name;
+	/** \brief Number of operations measured */
+	unsigned long iterations;
+	/** \brief Monotonic time at benchBegin() in ns */
+	long long start;
+	/** \brief benchAllocations at benchBegin() */
+	unsigned long long allocations;
+};
+
+/**
+ * \brief Returns the monotonic time in ns.
+ */
+static inline long long benchNanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * \brief Starts measuring iterations operations.
+ */
+static inline void benchBegin(struct bench *b, const char *name, unsigned long iterations) {
+	b->name = name;
+	b->iterations = iterations;
+	b->allocations = benchAllocations;
+	b->start = benchNanos();
+}
+
+/**
+ * \brief Prints the time and the number of allocations per operation.
+ */
+static inline void benchEnd(struct bench *b) {
+	long long nanos = benchNanos() - b->start;
+	printf("%-48s %10.1f ns/op %8.2f allocs/op\n", b->name,
+			(double) nanos / b->iterations,
+			(double) (benchAllocations - b->allocations) / b->iterations);
+}
+
+#endif
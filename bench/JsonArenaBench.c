@@ -0,0 +1,74 @@
+/** \file JsonArenaBench.c
+ *  \brief Compares json_loads() of typical requests with the default allocator of jansson and
+ *  with jsonAlloc() taking the memory from an arena (as payoutd does while a request is handled).
+ *  \details One iteration is what a request costs in payoutd: json_loads(), json_decref() and,
+ *  with the arena, arenaReset() when the command is released.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "Bench.h"
+#include "../Arena.h"
+#include "../JsonAlloc.h"
+
+/** \brief Number of times each message is parsed */
+#define ITERATIONS 1000000UL
+
+/** \brief Size of the first block of the arena (as REQUEST_ARENA_SIZE in payoutd.c) */
+#define ARENA_SIZE 4096
+
+static const char *MESSAGES[] = {
+	"{\"msgId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d6e\",\"cmd\":\"do-payout\",\"amount\":500}",
+	"{\"msgId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d6f\",\"cmd\":\"get-all-levels\"}",
+	"{\"msgId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d70\",\"cmd\":\"set-denomination-level\",\"amount\":100,\"level\":5}",
+	"{\"msgId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d71\",\"cmd\":\"inhibit-channels\",\"channels\":\"1,2,3\"}",
+	"{\"msgId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d72\",\"cmd\":\"batch\",\"steps\":[{\"cmd\":\"set-denomination-level\","
+			"\"amount\":100,\"level\":5},{\"cmd\":\"set-denomination-level\",\"amount\":200,\"level\":5}]}",
+};
+
+#define MESSAGE_COUNT (sizeof(MESSAGES) / sizeof(MESSAGES[0]))
+
+int main(int argc, char *argv[]) {
+	volatile size_t sink = 0;
+
+	struct arena arena;
+	arenaInit(&arena, ARENA_SIZE);
+
+	for (unsigned int m = 0; m < MESSAGE_COUNT; m++) {
+		const char *message = MESSAGES[m];
+
+		printf("%s\n", message);
+
+		struct bench b;
+		json_set_alloc_funcs(malloc, free);
+		benchBegin(&b, "  json_loads() (malloc)", ITERATIONS);
+		for (unsigned long i = 0; i < ITERATIONS; i++) {
+			json_t *jMessage = json_loads(message, 0, NULL);
+			sink += json_object_size(jMessage);
+			json_decref(jMessage);
+		}
+		benchEnd(&b);
+
+		json_set_alloc_funcs(jsonAlloc, jsonFree);
+		jsonArena = &arena;
+		benchBegin(&b, "  json_loads() (jsonAlloc() + arena)", ITERATIONS);
+		for (unsigned long i = 0; i < ITERATIONS; i++) {
+			json_t *jMessage = json_loads(message, 0, NULL);
+			sink += json_object_size(jMessage);
+			json_decref(jMessage);
+			arenaReset(&arena);
+		}
+		benchEnd(&b);
+		jsonArena = NULL;
+	}
+
+	json_set_alloc_funcs(malloc, free);
+	arenaFree(&arena);
+
+	return 0;
+}
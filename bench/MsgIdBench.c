@@ -0,0 +1,40 @@
+/** \file MsgIdBench.c
+ *  \brief Compares msgIdGenerate() with uuid_generate_time_safe() + uuid_unparse_lower() (-u).
+ */
+
+#define _GNU_SOURCE
+
+#include <uuid/uuid.h>
+
+#include "Bench.h"
+#include "../MsgId.h"
+
+/** \brief Number of msgIds generated by each variant */
+#define ITERATIONS 1000000UL
+
+int main(int argc, char *argv[]) {
+	volatile char sink = 0;
+	char msgId[MSGID_SIZE];
+	struct bench b;
+
+	struct msgid_generator generator;
+	msgIdInit(&generator);
+
+	benchBegin(&b, "msgIdGenerate()", ITERATIONS);
+	for (unsigned long i = 0; i < ITERATIONS; i++) {
+		msgIdGenerate(&generator, msgId);
+		sink += msgId[35];
+	}
+	benchEnd(&b);
+
+	benchBegin(&b, "uuid_generate_time_safe() + uuid_unparse_lower()", ITERATIONS);
+	for (unsigned long i = 0; i < ITERATIONS; i++) {
+		uuid_t uuid;
+		uuid_generate_time_safe(uuid);
+		uuid_unparse_lower(uuid, msgId);
+		sink += msgId[35];
+	}
+	benchEnd(&b);
+
+	return 0;
+}
@@ -0,0 +1,123 @@
+/** \file MsgPackBench.c
+ *  \brief Payload sizes of the documented events as JSON and as MessagePack and the cost of
+ *  msgpackFromJson() / msgpackToJson().
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Bench.h"
+#include "../MsgPack.h"
+
+/** \brief Number of times all messages are encoded / decoded */
+#define ITERATIONS 100000UL
+
+/** \brief The events of docs/overview.md (with typical values) and some responses */
+static const char *MESSAGES[] = {
+	"{\"event\":\"calibration fail\",\"error\":\"sensor coil 1\"}",
+	"{\"event\":\"cashbox paid\",\"amount\":1500,\"cc\":\"EUR\"}",
+	"{\"event\":\"cashbox removed\"}",
+	"{\"event\":\"cashbox replaced\"}",
+	"{\"event\":\"cleared from front\"}",
+	"{\"event\":\"cleared into cashbox\"}",
+	"{\"event\":\"coin credit\",\"amount\":200,\"cc\":\"EUR\"}",
+	"{\"event\":\"credit\",\"amount\":1000,\"channel\":2}",
+	"{\"event\":\"credit\",\"channel\":2,\"cc\":\"EUR\"}",
+	"{\"event\":\"disabled\"}",
+	"{\"event\":\"dispensed\",\"amount\":500}",
+	"{\"event\":\"dispensing\",\"amount\":0}",
+	"{\"event\":\"empty\"}",
+	"{\"event\":\"emptying\"}",
+	"{\"event\":\"floated\",\"amount\":12000,\"cc\":\"EUR\"}",
+	"{\"event\":\"floating\",\"amount\":3000,\"cc\":\"EUR\"}",
+	"{\"event\":\"fraud attempt\",\"dispensed\":100}",
+	"{\"event\":\"incomplete float\",\"dispensed\":300,\"requested\":500,\"cc\":\"EUR\"}",
+	"{\"event\":\"incomplete payout\",\"dispensed\":300,\"requested\":500,\"cc\":\"EUR\"}",
+	"{\"event\":\"jammed\"}",
+	"{\"event\":\"read\",\"amount\":1000,\"channel\":2}",
+	"{\"event\":\"read\",\"channel\":0}",
+	"{\"event\":\"reading\"}",
+	"{\"event\":\"recalibrating\"}",
+	"{\"event\":\"rejected\"}",
+	"{\"event\":\"rejecting\"}",
+	"{\"event\":\"safe jam\"}",
+	"{\"event\":\"smart emptied\",\"amount\":4500,\"cc\":\"EUR\"}",
+	"{\"event\":\"smart emptying\",\"amount\":1200,\"cc\":\"EUR\"}",
+	"{\"event\":\"stacked\"}",
+	"{\"event\":\"stacker full\"}",
+	"{\"event\":\"stacking\"}",
+	"{\"event\":\"stored\"}",
+	"{\"event\":\"unsafe jam\"}",
+	"{\"msgId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d6e\",\"correlId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d6f\",\"result\":\"ok\"}",
+	"{\"correlId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d6f\",\"levels\":["
+		"{\"value\":5,\"level\":40,\"cc\":\"EUR\"},{\"value\":10,\"level\":35,\"cc\":\"EUR\"},"
+		"{\"value\":20,\"level\":30,\"cc\":\"EUR\"},{\"value\":50,\"level\":25,\"cc\":\"EUR\"},"
+		"{\"value\":100,\"level\":20,\"cc\":\"EUR\"},{\"value\":200,\"level\":15,\"cc\":\"EUR\"}],\"source\":\"cache\"}",
+};
+
+#define MESSAGE_COUNT (sizeof(MESSAGES) / sizeof(MESSAGES[0]))
+
+int main(int argc, char *argv[]) {
+	char *packed[MESSAGE_COUNT];
+	int packedLen[MESSAGE_COUNT];
+
+	char *buffer = NULL;
+	size_t size = 0;
+
+	size_t jsonTotal = 0;
+	size_t packedTotal = 0;
+
+	printf("%6s %11s  %s\n", "JSON", "MessagePack", "message");
+	for (unsigned int i = 0; i < MESSAGE_COUNT; i++) {
+		size_t len = strlen(MESSAGES[i]);
+		packedLen[i] = msgpackFromJson(MESSAGES[i], len, &buffer, &size);
+		if (packedLen[i] < 0) {
+			fprintf(stderr, "unable to encode %s\n", MESSAGES[i]);
+			return 1;
+		}
+		packed[i] = malloc(packedLen[i]);
+		if (packed[i] == NULL) {
+			return 1;
+		}
+		memcpy(packed[i], buffer, packedLen[i]);
+
+		// the way back has to result in the same text
+		if (msgpackToJson(packed[i], packedLen[i], &buffer, &size) != (int) len || strcmp(buffer, MESSAGES[i]) != 0) {
+			fprintf(stderr, "unable to decode %s\n", MESSAGES[i]);
+			return 1;
+		}
+
+		printf("%6zu %11d  %.60s%s\n", len, packedLen[i], MESSAGES[i], len > 60 ? "..." : "");
+		jsonTotal += len;
+		packedTotal += packedLen[i];
+	}
+	printf("%6zu %11zu  total (%.0f%%)\n\n", jsonTotal, packedTotal, 100.0 * packedTotal / jsonTotal);
+
+	volatile int sink = 0;
+	struct bench b;
+
+	benchBegin(&b, "msgpackFromJson() per message", ITERATIONS * MESSAGE_COUNT);
+	for (unsigned long n = 0; n < ITERATIONS; n++) {
+		for (unsigned int i = 0; i < MESSAGE_COUNT; i++) {
+			sink += msgpackFromJson(MESSAGES[i], strlen(MESSAGES[i]), &buffer, &size);
+		}
+	}
+	benchEnd(&b);
+
+	benchBegin(&b, "msgpackToJson() per message", ITERATIONS * MESSAGE_COUNT);
+	for (unsigned long n = 0; n < ITERATIONS; n++) {
+		for (unsigned int i = 0; i < MESSAGE_COUNT; i++) {
+			sink += msgpackToJson(packed[i], packedLen[i], &buffer, &size);
+		}
+	}
+	benchEnd(&b);
+
+	for (unsigned int i = 0; i < MESSAGE_COUNT; i++) {
+		free(packed[i]);
+	}
+	free(buffer);
+
+	return 0;
+}
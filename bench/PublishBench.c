@@ -0,0 +1,123 @@
+/** \file PublishBench.c
+ *  \brief Compares formatting a PUBLISH command the way hiredis does it for redisAsyncCommand()
+ *  (vasprintf() of the message, then redisFormatCommand()) with formatting it into one reused
+ *  buffer with Resp.c like formatPublish() in payoutd.c does for redisAsyncFormattedCommand().
+ *  \details Only the formatting is measured: what hiredis does with the command afterwards
+ *  (appending it to the output buffer, queueing the callback) is the same for both.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hiredis/hiredis.h>
+
+#include "Bench.h"
+#include "../Resp.h"
+
+/** \brief Number of messages published by each variant */
+#define ITERATIONS 1000000UL
+
+static const char *TOPIC = "hopper-event";
+
+/** \brief RESP encoded "PUBLISH <topic>", prepared once (like topicInit()) */
+static char *resp;
+/** \brief Length of resp */
+static size_t respLen;
+
+/** \brief Reused buffer */
+static char *buffer = NULL;
+/** \brief Size of the buffer */
+static size_t bufferSize = 0;
+
+/** \brief Prevents the compiler from dropping the formatting */
+static volatile size_t sink = 0;
+
+/**
+ * \brief Before: the message is formatted by vasprintf() and the command by redisFormatCommand().
+ */
+static void publishFormat(const char *format, ...) {
+	va_list varargs;
+	char *message;
+
+	va_start(varargs, format);
+	int len = vasprintf(&message, format, varargs);
+	va_end(varargs);
+	if (len < 0) {
+		return;
+	}
+
+	char *command;
+	int commandLen = redisFormatCommand(&command, "PUBLISH %s %s", TOPIC, message);
+	if (commandLen > 0) {
+		sink += commandLen;
+		redisFreeCommand(command);
+	}
+	free(message);
+}
+
+/**
+ * \brief After: the payload is formatted behind the reserved space, the RESP header in front of it.
+ */
+static void publishPreformatted(const char *format, ...) {
+	va_list varargs;
+	size_t reserve = respLen + RESP_HEADER_RESERVE;
+
+	va_start(varargs, format);
+	int len = respFormatPayload(&buffer, &bufferSize, reserve, format, varargs);
+	va_end(varargs);
+	if (len < 0) {
+		return;
+	}
+
+	size_t start = reserve - respFramePublish(buffer + reserve, len, resp, respLen);
+
+	sink += reserve + len + 2 - start;
+}
+
+int main(int argc, char *argv[]) {
+	int headerLen = respPublishHeader(&resp, "", TOPIC);
+	if (headerLen < 0) {
+		return 1;
+	}
+	respLen = headerLen;
+
+	struct bench b;
+
+	printf("event {\"event\":\"credit\",\"amount\":1000,\"channel\":2}\n");
+
+	benchBegin(&b, "  vasprintf() + redisFormatCommand()", ITERATIONS);
+	for (unsigned long i = 0; i < ITERATIONS; i++) {
+		publishFormat("{\"event\":\"%s\",\"amount\":%d,\"channel\":%d}", "credit", 1000, 2);
+	}
+	benchEnd(&b);
+
+	benchBegin(&b, "  reused buffer", ITERATIONS);
+	for (unsigned long i = 0; i < ITERATIONS; i++) {
+		publishPreformatted("{\"event\":\"%s\",\"amount\":%d,\"channel\":%d}", "credit", 1000, 2);
+	}
+	benchEnd(&b);
+
+	printf("response {\"msgId\":\"...\",\"correlId\":\"...\",\"result\":\"ok\"}\n");
+
+	benchBegin(&b, "  vasprintf() + redisFormatCommand()", ITERATIONS);
+	for (unsigned long i = 0; i < ITERATIONS; i++) {
+		publishFormat("{\"msgId\":\"%s\",\"correlId\":\"%s\",\"result\":\"%s\"}",
+				"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d6e", "0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d6f", "ok");
+	}
+	benchEnd(&b);
+
+	benchBegin(&b, "  reused buffer", ITERATIONS);
+	for (unsigned long i = 0; i < ITERATIONS; i++) {
+		publishPreformatted("{\"msgId\":\"%s\",\"correlId\":\"%s\",\"result\":\"%s\"}",
+				"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d6e", "0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d6f", "ok");
+	}
+	benchEnd(&b);
+
+	free(buffer);
+	free(resp);
+
+	return 0;
+}
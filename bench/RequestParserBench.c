@@ -0,0 +1,71 @@
+/** \file RequestParserBench.c
+ *  \brief Compares requestParse() with json_loads() + requestFromJson() on typical requests.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Bench.h"
+#include "../RequestParser.h"
+
+/** \brief Number of times each message is parsed */
+#define ITERATIONS 1000000UL
+
+static const char *MESSAGES[] = {
+	"{\"msgId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d6e\",\"cmd\":\"do-payout\",\"amount\":500}",
+	"{\"msgId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d6f\",\"cmd\":\"get-all-levels\"}",
+	"{\"msgId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d70\",\"cmd\":\"set-denomination-level\",\"amount\":100,\"level\":5}",
+	"{\"msgId\":\"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d71\",\"cmd\":\"inhibit-channels\",\"channels\":\"1,2,3\"}",
+	"{ \"msgId\" : \"0190a5f1-7c2e-7b3a-8d4f-1e2a3b4c5d72\", \"cmd\" : \"configure-bezel\", \"r\" : 255, \"g\" : 0, \"b\" : 0, \"type\" : 1 }",
+};
+
+#define MESSAGE_COUNT (sizeof(MESSAGES) / sizeof(MESSAGES[0]))
+
+int main(int argc, char *argv[]) {
+	volatile unsigned int sink = 0;
+
+	for (unsigned int m = 0; m < MESSAGE_COUNT; m++) {
+		const char *message = MESSAGES[m];
+		size_t len = strlen(message);
+
+		// both have to come to the same result
+		struct request fast;
+		struct request slow;
+		json_t *jMessage = json_loads(message, 0, NULL);
+		if (requestParse(message, len, &fast) != 0 || jMessage == NULL) {
+			fprintf(stderr, "unable to parse %s\n", message);
+			return 1;
+		}
+		requestFromJson(jMessage, &slow);
+		json_decref(jMessage);
+		if (memcmp(&fast, &slow, sizeof(fast)) != 0) {
+			fprintf(stderr, "requestParse() and requestFromJson() differ for %s\n", message);
+			return 1;
+		}
+
+		printf("%s\n", message);
+
+		struct bench b;
+		benchBegin(&b, "  requestParse()", ITERATIONS);
+		for (unsigned long i = 0; i < ITERATIONS; i++) {
+			struct request request;
+			requestParse(message, len, &request);
+			sink += request.valid;
+		}
+		benchEnd(&b);
+
+		benchBegin(&b, "  json_loads() + requestFromJson()", ITERATIONS);
+		for (unsigned long i = 0; i < ITERATIONS; i++) {
+			struct request request;
+			jMessage = json_loads(message, 0, NULL);
+			requestFromJson(jMessage, &request);
+			json_decref(jMessage);
+			sink += request.valid;
+		}
+		benchEnd(&b);
+	}
+
+	return 0;
+}
@@ -106,6 +106,7 @@ int SSPSendCommand(const SSP_PORT port, SSP_COMMAND * cmd)
 	unsigned char retry;
 	unsigned int slaveCount;
 	/* complie the SSP packet and check for errors  */
+	cmd->RetryCount = 0;
 	if (!CompileSSPCommand(cmd, &ssp)) {
 		cmd->ResponseStatus = SSP_PACKET_ERROR;
 		return 0;
@@ -114,6 +115,8 @@ int SSPSendCommand(const SSP_PORT port, SSP_COMMAND * cmd)
 	retry = cmd->RetryLevel;
 	/* transmit the packet    */
 	do {
+		if (retry != cmd->RetryLevel)
+			cmd->RetryCount++;	/* METALAB: count retransmissions for the statistics */
 		ssp.NewResponse = 0;	/* set flag to wait for a new reply from slave   */
 		if (WriteData(ssp.txData, ssp.txBufferLength, port) == 0) {
 			//if(WritePort(&ssp) != TRUE){
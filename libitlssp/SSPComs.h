@@ -50,6 +50,7 @@ extern "C" {
 		unsigned char ResponseDataLength;
 		unsigned char ResponseData[255];
 		unsigned char IgnoreError;
+		unsigned char RetryCount;	/* METALAB: number of retransmissions needed by the last command */
 	} SSP_COMMAND;
 
 
@@ -1,14 +1,19 @@
+#define _GNU_SOURCE
 
 #include <termios.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "../libitlssp/port_linux.h"
 
 
 static int open_port = 0;
 
+static ssp_command_observer command_observer = NULL;
+static void *command_observer_privdata = NULL;
+
 /* Some helper funtions for detecting keyboard input */
 void changemode(int dir)
 {
@@ -60,10 +65,33 @@ void close_ssp_port()
 	CloseSSPPort(open_port);
 }
 
+void set_ssp_command_observer(ssp_command_observer observer, void *privdata)
+{
+	command_observer = observer;
+	command_observer_privdata = privdata;
+}
+
 int send_ssp_command(SSP_COMMAND * sspC)
 {
+	struct timespec start, end;
+	unsigned char command;
+	int result;
+
+	if (command_observer == NULL)
+		return SSPSendCommand(open_port, sspC);
+
+	// the command data is encrypted in place, so remember the command byte beforehand
+	command = sspC->CommandData[0];
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	result = SSPSendCommand(open_port, sspC);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	command_observer(sspC, command, result,
+			 (unsigned long long) (end.tv_sec - start.tv_sec) * 1000000000ULL
+			 + end.tv_nsec - start.tv_nsec, command_observer_privdata);
 
-	return SSPSendCommand(open_port, sspC);
+	return result;
 }
 
 int negotiate_ssp_encryption(SSP_COMMAND * sspC, SSP_FULL_KEY * hostKey)
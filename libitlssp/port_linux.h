@@ -17,6 +17,13 @@ int kbhit(void);
 int open_ssp_port(const char *port);
 void close_ssp_port();
 int send_ssp_command(SSP_COMMAND * sspC);
+
+// METALAB: optional observer which is notified after every ssp command (used for statistics).
+// command is the command byte as it was before encryption, result is the return value of
+// send_ssp_command() and elapsedNs the round-trip time including all retries.
+typedef void (*ssp_command_observer)(const SSP_COMMAND * sspC, unsigned char command, int result,
+				     unsigned long long elapsedNs, void *privdata);
+void set_ssp_command_observer(ssp_command_observer observer, void *privdata);
 int negotiate_ssp_encryption(SSP_COMMAND * sspC, SSP_FULL_KEY * hostKey);
 
 #endif
@@ -4,17 +4,50 @@
  *  In a nutshell:
  *  - we are single threaded
  *  - libevent is used to trigger 2 periodic events ("poll event" and "check quit") which poll the hardware and check if we should quit
- *  - main() function supports arguments -h (redis hostname), -p (redis port), -d (serial device name) and -?
+ *  - main() function supports arguments -h (redis hostname), -p (redis port), -s (redis unix socket), -d (serial device name), -u (libuuid msgIds), -b (event batch topics),
+ *    -i (idempotency cache capacity), -t (idempotency ttl in seconds), -j (idempotency journal file),
+ *    -m (publish, stream or both: output of the device events), -l (maximum length of the event streams),
+ *    -x (read requests from the request streams, requires -j), -o (oldest or newest: drop policy of the outbound queue),
+ *    -f (topic published as MessagePack, may be repeated), -r (shared memory event ring), -w (event spool directory),
+ *    -n (namespace prefixed to all topics and streams), -g (interval of the metrics snapshot in seconds) and -?
  *  - libevent calls cbOnPollEvent() for the "poll" event
  *  - libevent calls cbOnCheckQuitEvent() for the "check quit" event
  *  - redis is used in conjunction with libevent
+ *  - with -n <ns> all topic and stream names are prefixed with "<ns>:", the names are formatted once by namespaceInit() and topicInit()
+ *  - lost redis connections are reestablished (m_redis_link), meanwhile the messages are buffered (m_outbound_queue)
  *  - if a message is detected in 'validator-request' or 'hopper-request' the cbOnRequestMessage() is called
- *  - the cbOnRequestMessage() checks if the command is known and if its known dispatches the call to a handle<Cmd> function
+ *  - with -x requests are also read from the 'validator-requests' and 'hopper-requests' streams (cbOnStreamRead()),
+ *    they are acknowledged (XACK) once they have been answered
+ *  - processRequest() parses the message with requestParse() (falling back to jansson for unusual messages),
+ *    looks up the command in the COMMAND_REGISTRY, validates the message and queues the command
+ *  - cbOnDispatchEvent() executes the queued commands one by one (control commands first, then operations, then queries)
+ *  - identical read-only requests join a queued one (requestQueueJoin()), one execution answers all of them
+ *  - dispatchCommand() counts the command and dispatches the call to the handle<Cmd> function of its COMMAND_REGISTRY entry
+ *  - adding a command means writing the handler function and adding one (sorted) entry to the COMMAND_REGISTRY
+ *  - the 'batch' command executes several commands back to back via dispatchCommand(), their replies are captured (see replyToCommand())
+ *  - commands with an optional 'deadline' (ms since the epoch) or 'ttl' (ms) property are answered with an 'expired' error instead once it has passed
+ *  - operations are remembered by their msgId (m_metacash.idempotency), a republished operation is answered from there instead of being executed again
  *  - a command handler interprets the provided JSON message, issues commands to the money hardware and publishes a JSON response
  *  - the naming convention used most of the time is like: the JSON command is 'configure-bezel' so the handler function is called handleConfigureBezel()
  *  - handleConfigureBezel() itself calls mc_ssp_configure_bezel() which sends the SSP command to the hardware
- *  - each device has its own poll event handling function (responsible for publishing the events to the devices event topic)
- *  - those poll handler functions are hopperEventHandler() and validatorEventHandler()
+ *  - each device has a poll event handling function (responsible for publishing the events to the devices event topic)
+ *  - both devices use pollEventHandler(), publishPollEvent() formats the events as described by POLL_EVENT_DEFS
+ *  - the handlers decode the events straight from the poll response with pollIteratorNext() (see POLL_EVENT_LAYOUT)
+ *  - every SSP command is timed and accounted per device by cbOnSspCommand() (see 'get-stats')
+ *  - versions, serial number and setup data of a device are cached (m_device_info), see deviceInfoEnsure()
+ *  - the denomination levels are cached (m_levels), updated by levelsApplyEvent() and compared with the hardware by cbOnReconcileEvent()
+ *  - all messages are published by publishFormatted(), which writes the payload and the RESP framing into one reused buffer
+ *  - lists in the replies (levels, channels, stats, batch steps) are built in a struct buffer (Buffer.h) which starts out on the stack
+ *  - every command in the request queue has an arena (Arena.h), jansson allocates from it while the request is parsed
+ *    and executed (jsonAlloc()), it is reset at once when the command is released
+ *  - with -b the events of one poll cycle are collected by eventBatchBegin() and published as one array by eventBatchEnd()
+ *  - with -f <topic> the messages of a topic are transcoded from JSON to MessagePack by formatPublish(),
+ *    requests in MessagePack are recognized by their first byte and transcoded to JSON by processRequest()
+ *  - with -r /<name> the device events are also written to a ring in shared memory for local consumers (EventRing.h)
+ *  - with -w <dir> the event commands are written to a durable spool before they are sent and sent again until redis
+ *    has answered them (spoolSend(), EventSpool.h)
+ *  - with -m stream|both the device events are also appended to the 'hopper-events' and 'validator-events' streams (see sendFormatted())
+ *  - with -g <seconds> a metrics snapshot is published to 'payout-metrics' and written to the 'payout-metrics' hash (publishMetrics())
  *  - on startup/exiting of the daemon started/exiting messages are published to the 'payout-event' topic
  */
 
@@ -24,6 +57,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +68,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 
 // lowlevel library provided by the cash hardware vendor
 // innovative technologies (http://innovative-technology.com).
@@ -49,12 +86,32 @@
 
 #include <syslog.h>
 
-// libuuid is used to generate msgIds for the responses
+// libuuid can be used to generate msgIds for the responses (-u)
 #include <uuid/uuid.h>
 
-// https://sites.google.com/site/rickcreamer/Home/cc/c-implementation-of-stringbuffer-functionality
-#include "StringBuffer.h"
-#include "StringBuffer.c"
+// contiguous buffer for building the replies
+#include "Buffer.h"
+// bump allocator for the jansson DOM of a request
+#include "Arena.h"
+#include "JsonAlloc.h"
+
+// fixed bucket histograms for the ssp round-trip times
+#include "Histogram.h"
+// single pass parser for the request messages
+#include "RequestParser.h"
+// cheap UUIDv7 style msgIds
+#include "MsgId.h"
+// LRU cache of the recent requests (duplicate detection)
+#include "IdempotencyCache.h"
+
+#include "MsgPack.h"
+
+#include "EventRing.h"
+
+#include "EventSpool.h"
+
+// RESP encoding of the PUBLISH commands
+#include "Resp.h"
 
 /** \brief redis context used for publishing messages */
 redisAsyncContext *redisPublishCtx = NULL;
@@ -62,14 +119,413 @@ redisAsyncContext *redisPublishCtx = NULL;
 /** \brief redis context used for subscribing to topics */
 redisAsyncContext *redisSubscribeCtx = NULL;
 
+/** \brief redis context used for reading the request streams (XREADGROUP blocks the connection) */
+redisAsyncContext *redisStreamCtx = NULL;
+
+struct m_metacash;
+
+/** \brief Delay in ms before the first attempt to reestablish a lost redis connection */
+#define REDIS_RECONNECT_MIN_MS 100
+/** \brief Maximum delay in ms between two attempts to reestablish a lost redis connection */
+#define REDIS_RECONNECT_MAX_MS 30000
+
+/**
+ * \brief Structure which describes one of our connections to redis.
+ * \details A lost connection is reestablished by cbOnReconnectEvent(), the delay between the
+ * attempts doubles (up to REDIS_RECONNECT_MAX_MS) and is randomized by half of it (jitter).
+ */
+struct m_redis_link {
+	/** \brief Name of the connection (for logging) */
+	const char *name;
+	/** \brief The context of the connection (NULL while disconnected) */
+	redisAsyncContext **ctx;
+	/** \brief Connect callback of the context */
+	redisConnectCallback *onConnect;
+	/** \brief Disconnect callback of the context */
+	redisDisconnectCallback *onDisconnect;
+	/** \brief If !=0 the connection is established */
+	int connected;
+	/** \brief Number of failed attempts since the connection was lost */
+	unsigned int attempts;
+	/** \brief Number of attempts to reestablish the connection */
+	unsigned long long reconnects;
+	/** \brief event struct for the next attempt */
+	struct event evReconnect;
+	/** \brief The metacash struct (provides the redis host and the event base) */
+	struct m_metacash *metacash;
+};
+
+/** \brief The connection used for publishing */
+struct m_redis_link publishLink;
+/** \brief The connection used for subscribing */
+struct m_redis_link subscribeLink;
+/** \brief The connection used for reading the request streams */
+struct m_redis_link streamLink;
+
+/** \brief Maximum number of bytes buffered while the publish connection is down */
+#define OUTBOUND_QUEUE_SIZE (1024 * 1024)
+
+/**
+ * \brief What to drop if the outbound queue is full.
+ */
+enum m_drop_policy {
+	/** \brief Drop the oldest buffered commands */
+	DROP_OLDEST = 0,
+	/** \brief Drop the command which doesn't fit anymore */
+	DROP_NEWEST
+};
+
+/**
+ * \brief Structure which buffers the commands for the publish connection while it is down.
+ * \details The commands are stored back to back, each preceded by its length, and are handed
+ * to hiredis in one go by outboundQueueFlush() once the connection is established again.
+ */
+struct m_outbound_queue {
+	/** \brief The buffered commands (OUTBOUND_QUEUE_SIZE bytes, allocated on demand) */
+	char *buffer;
+	/** \brief Used bytes of the buffer */
+	size_t used;
+	/** \brief What to drop if the buffer is full (override with -o) */
+	enum m_drop_policy policy;
+	/** \brief Number of buffered commands */
+	unsigned long long buffered;
+	/** \brief Number of dropped commands */
+	unsigned long long dropped;
+};
+
+/** \brief Commands for the publish connection while it is down */
+static struct m_outbound_queue outbound;
+
+/** \brief Maximum number of spooled commands handed to hiredis per loop iteration */
+#define SPOOL_REPLAY_BATCH 64
+
+/** \brief Durable spool of the event commands (see spoolSend(), enable with -w) */
+static struct event_spool eventSpool;
+/** \brief event struct for handing the rest of the spooled commands to hiredis */
+static struct event evSpoolReplay;
+
+/** \brief Consumer group (and consumer name) used for reading the request streams */
+#define STREAM_GROUP "payoutd"
+/** \brief Maximum number of entries read from the request streams per XREADGROUP / XAUTOCLAIM */
+#define STREAM_READ_COUNT 16
+/** \brief Size of the buffer for the id of a stream entry (incl. the terminating zero) */
+#define STREAM_ID_SIZE 48
+/** \brief Room needed in the request queue before entries are read (STREAM_READ_COUNT of each request stream) */
+#define STREAM_READ_ROOM (2 * STREAM_READ_COUNT)
+/** \brief The request stream of the smart-hopper */
+#define HOPPER_REQUEST_STREAM "hopper-requests"
+/** \brief The request stream of the smart-payout */
+#define VALIDATOR_REQUEST_STREAM "validator-requests"
+
+/**
+ * \brief Structure which describes where reading the request streams continues (see streamRead()).
+ */
+struct m_stream_reader {
+	/** \brief Request stream whose pending entries are claimed (0 hopper, 1 validator, 2 once both are done) */
+	unsigned int claiming;
+	/** \brief Start id of the next XAUTOCLAIM of that stream */
+	char cursor[STREAM_ID_SIZE];
+	/** \brief If !=0 reading waits until the request queue has room again (see streamResume()) */
+	int waiting;
+};
+
+/** \brief State of reading the request streams */
+static struct m_stream_reader streamReader = { 0, "0-0", 0 };
+
+/** \brief Prefix of all topic and stream names ("<namespace>:" or "", see namespaceInit()) */
+static char *namespacePrefix = "";
+
+/**
+ * \brief Names of the topics and streams we read from, including the namespace.
+ * \details Formatted once by namespaceInit(), like the names of the topics we publish to
+ * (see topicInit()).
+ */
+struct m_request_names {
+	/** \brief The "metacash" topic */
+	char *metacashTopic;
+	/** \brief The "hopper-request" topic */
+	char *hopperTopic;
+	/** \brief The "validator-request" topic */
+	char *validatorTopic;
+	/** \brief The HOPPER_REQUEST_STREAM */
+	char *hopperStream;
+	/** \brief The VALIDATOR_REQUEST_STREAM */
+	char *validatorStream;
+};
+
+/** \brief Names of the topics and streams we read from */
+static struct m_request_names requestNames = { "metacash", "hopper-request", "validator-request",
+		HOPPER_REQUEST_STREAM, VALIDATOR_REQUEST_STREAM };
+
+/**
+ * \brief Structure which describes a topic we publish to.
+ * \details The RESP encoded beginning of the PUBLISH command is prepared once by topicInit(),
+ * publishing only adds the payload (see publishFormatted()). Topics with a streamName can
+ * additionally (or instead) be appended to a redis stream, see topicInitStream().
+ */
+struct m_topic {
+	/** \brief Name of the topic */
+	const char *name;
+	/** \brief RESP encoded "PUBLISH <name>" (without the payload) */
+	char *resp;
+	/** \brief Length of resp */
+	size_t respLen;
+	/** \brief Name of the redis stream for the messages of the topic (NULL if there is none) */
+	const char *streamName;
+	/** \brief If !=0 the messages are PUBLISHed (only streams otherwise) */
+	int publish;
+	/** \brief RESP encoded "XADD <streamName> MAXLEN ~ <n> *" (NULL if the stream is not used) */
+	char *stream;
+	/** \brief Length of stream */
+	size_t streamLen;
+	/** \brief Sequence number of the last message appended to the stream */
+	unsigned long long seq;
+	/** \brief If !=0 the messages are encoded as MessagePack instead of JSON (enable with -f) */
+	int msgpack;
+	/** \brief Shared memory ring the messages are also written to (NULL if none, enable with -r) */
+	struct event_ring *ring;
+	/** \brief If !=0 the commands go through the eventSpool (enable with -w) */
+	int spooled;
+};
+
+/** \brief The "payout-event" topic */
+struct m_topic payoutEventTopic = { "payout-event", NULL, 0, NULL, 1, NULL, 0, 0, 0, NULL, 0 };
+/** \brief The "hopper-event" topic */
+struct m_topic hopperEventTopic = { "hopper-event", NULL, 0, "hopper-events", 1, NULL, 0, 0, 0, NULL, 0 };
+/** \brief The "hopper-response" topic */
+struct m_topic hopperResponseTopic = { "hopper-response", NULL, 0, NULL, 1, NULL, 0, 0, 0, NULL, 0 };
+/** \brief The "validator-event" topic */
+struct m_topic validatorEventTopic = { "validator-event", NULL, 0, "validator-events", 1, NULL, 0, 0, 0, NULL, 0 };
+/** \brief The "validator-response" topic */
+struct m_topic validatorResponseTopic = { "validator-response", NULL, 0, NULL, 1, NULL, 0, 0, 0, NULL, 0 };
+/** \brief The "hopper-event-batch" topic (events of one poll cycle as JSON array, enable with -b) */
+struct m_topic hopperEventBatchTopic = { "hopper-event-batch", NULL, 0, NULL, 1, NULL, 0, 0, 0, NULL, 0 };
+/** \brief The "validator-event-batch" topic (events of one poll cycle as JSON array, enable with -b) */
+struct m_topic validatorEventBatchTopic = { "validator-event-batch", NULL, 0, NULL, 1, NULL, 0, 0, 0, NULL, 0 };
+/** \brief The "payout-metrics" topic (periodic metrics snapshot, enable with -g) */
+struct m_topic payoutMetricsTopic = { "payout-metrics", NULL, 0, NULL, 1, NULL, 0, 0, 0, NULL, 0 };
+
+/** \brief All topics we publish to (see findTopic()) */
+struct m_topic *topics[] = { &payoutEventTopic, &hopperEventTopic, &hopperResponseTopic, &validatorEventTopic,
+		&validatorResponseTopic, &hopperEventBatchTopic, &validatorEventBatchTopic, &payoutMetricsTopic, NULL };
+
+/**
+ * \brief Where the device events go to.
+ */
+enum m_output_mode {
+	/** \brief PUBLISH to the event topics */
+	OUTPUT_PUBLISH = 0,
+	/** \brief XADD to the event streams */
+	OUTPUT_STREAM,
+	/** \brief Both */
+	OUTPUT_BOTH
+};
+
+/** \brief Default (approximate) maximum length of the event streams, override with -l */
+#define STREAM_DEFAULT_MAXLEN 10000
+
+/** \brief Reused buffer for the RESP encoded XADD commands */
+static char *streamBuffer = NULL;
+/** \brief Size of the streamBuffer */
+static size_t streamBufferSize = 0;
+
+/** \brief Reused buffer for the RESP encoded PUBLISH commands */
+static char *publishBuffer = NULL;
+/** \brief Size of the publishBuffer */
+static size_t publishBufferSize = 0;
+
+/** \brief Reused buffer for the MessagePack encoding of a message */
+static char *msgpackBuffer = NULL;
+/** \brief Size of the msgpackBuffer */
+static size_t msgpackBufferSize = 0;
+
+/** \brief Reused buffer for the JSON text of a message published as MessagePack (see formatPublish()) */
+static char *jsonBuffer = NULL;
+/** \brief Size of the jsonBuffer */
+static size_t jsonBufferSize = 0;
+
+/** \brief Reused buffer for JSON text transcoded from MessagePack requests */
+static char *transcodeBuffer = NULL;
+/** \brief Size of the transcodeBuffer */
+static size_t transcodeBufferSize = 0;
+
+/**
+ * \brief Structure which collects the payloads of the messages published during one poll cycle
+ * for the batch topic (see eventBatchBegin()).
+ */
+struct m_event_batch {
+	/** \brief Topic whose messages are collected (NULL if none) */
+	struct m_topic *topic;
+	/** \brief Topic to which the collected payloads are published as one JSON array (NULL if disabled) */
+	struct m_topic *batchTopic;
+	/** \brief The collected JSON payloads, separated by commas */
+	struct buffer payloads;
+};
+
+/** \brief The messages of the current poll cycle */
+static struct m_event_batch eventBatch;
+
+/** \brief JSON text of the last formatted message (not zero terminated, see formatPublish()) */
+static const char *formattedJson = NULL;
+/** \brief Length of the formattedJson */
+static size_t formattedJsonLen = 0;
+
+/** \brief JSON text of the last published message (not zero terminated) */
+static const char *publishedPayload = NULL;
+/** \brief Length of the publishedPayload */
+static size_t publishedPayloadLen = 0;
+
+/** \brief Default number of requests remembered by the idempotency cache, override with -i */
+#define IDEMPOTENCY_DEFAULT_CAPACITY 1024
+/** \brief Default time in seconds a request is remembered by the idempotency cache, override with -t */
+#define IDEMPOTENCY_DEFAULT_TTL 600
+
+/** \brief Maximum length of a device name (m_device.name), the idempotency keys are "<device name>:<msgId>" */
+#define DEVICE_NAME_MAX 8
+
+_Static_assert(DEVICE_NAME_MAX + 1 + REQUEST_MSGID_SIZE <= IDEMPOTENCY_KEY_SIZE,
+		"IDEMPOTENCY_KEY_SIZE is too small for '<device name>:<msgId>'");
+
 struct m_metacash;
 
+/** \brief Maximum number of distinct SSP commands for which latencies are tracked per device */
+#define SSP_STATS_COMMANDS 32
+
+/** \brief Gap in ms between the response of the device and the next command of a batch */
+#define SSP_FRAME_GAP_MS 10
+
+/** \brief Maximum number of steps in a batch */
+#define BATCH_MAX_STEPS 16
+
+/** \brief Size of the stack storage of the reply buffers (the levels of MAX_DENOMINATIONS fit) */
+#define REPLY_BUFFER_SIZE 2048
+
+/** \brief Value of m_command_def.needsHardware for commands which can be answered from a cache (see m_command_def.isCachedFn) */
+#define NEEDS_HARDWARE_UNLESS_CACHED 2
+
+/** \brief Maximum number of entries in the COMMAND_REGISTRY */
+#define COMMAND_REGISTRY_MAX 40
+
+/** \brief Bit for the smart-hopper in m_device.type and m_command_def.devices */
+#define DEVICE_HOPPER 0x01
+/** \brief Bit for the smart-payout (validator) in m_device.type and m_command_def.devices */
+#define DEVICE_VALIDATOR 0x02
+/** \brief Both devices */
+#define DEVICE_ANY (DEVICE_HOPPER | DEVICE_VALIDATOR)
+
+/**
+ * \brief Structure which caches the static information of a device.
+ * \details Filled when the device is initialized (unit type, channel table and protocol version
+ * are kept in m_device.sspSetupReq), invalidated when the device reports SSP_POLL_RESET (which
+ * includes the reset after a firmware download) and lazily refreshed by deviceInfoEnsure().
+ */
+struct m_device_info {
+	/** \brief If !=0 the cached information (and m_device.sspSetupReq) is current */
+	int valid;
+	/** \brief Full firmware version */
+	char firmwareVersion[17];
+	/** \brief Dataset version */
+	char datasetVersion[9];
+	/** \brief Serial number */
+	unsigned long serialNumber;
+};
+
+/** \brief Maximum number of denominations in the m_levels */
+#define MAX_DENOMINATIONS 20
+
+/** \brief Interval in seconds of the comparison of the m_levels with the hardware */
+#define LEVELS_RECONCILE_INTERVAL 300
+
+/**
+ * \brief Structure which contains the level of a single denomination.
+ */
+struct m_level {
+	/** \brief Value of the denomination in cents */
+	unsigned int value;
+	/** \brief Number of coins/notes available for payouts */
+	int level;
+	/** \brief Country code */
+	char cc[4];
+};
+
+/**
+ * \brief Structure which caches the denomination levels of a device.
+ * \details Seeded by a GET ALL LEVELS at startup and kept current by levelsApplyEvent() from the
+ * poll events. Events which don't tell which denominations were involved (e.g. dispensed) mark the
+ * cache as invalid, cbOnReconcileEvent() periodically compares the cache with the hardware.
+ */
+struct m_levels {
+	/** \brief If !=0 the levels are current */
+	int valid;
+	/** \brief Number of denominations */
+	unsigned int count;
+	/** \brief The denominations */
+	struct m_level entries[MAX_DENOMINATIONS];
+	/** \brief Value (in cents) of the note which was last read/credited, expected to be stored or stacked next */
+	unsigned int pendingNoteValue;
+	/** \brief Number of denominations for which the reconcile found a different level */
+	unsigned long long drifts;
+};
+
+/**
+ * \brief Structure which contains the SSP statistics of a device.
+ * \details Updated by cbOnSspCommand() after every SSP command sent to the device.
+ */
+struct m_ssp_stats {
+	/** \brief Maps an SSP command byte to its slot in latency (slot + 1, 0 if not seen yet) */
+	unsigned char slotOfCommand[256];
+	/** \brief Maps a slot in latency back to the SSP command byte */
+	unsigned char commandOfSlot[SSP_STATS_COMMANDS];
+	/** \brief Number of slots in use */
+	unsigned int usedSlots;
+	/** \brief Round-trip times in microseconds (including retries) per SSP command */
+	struct histogram latency[SSP_STATS_COMMANDS];
+	/** \brief Round-trip times in microseconds of all SSP commands since the last metrics snapshot */
+	struct histogram rtt;
+	/** \brief Number of commands which did not fit into the latency slots */
+	unsigned long long untracked;
+	/** \brief Number of commands which timed out */
+	unsigned long long timeouts;
+	/** \brief Number of retransmissions */
+	unsigned long long retries;
+	/** \brief Number of responses which were discarded (checksum or packet counter mismatch) */
+	unsigned long long packetErrors;
+	/** \brief Number of commands which could not be written to the serial port */
+	unsigned long long portErrors;
+	/** \brief Number of SSP_RESPONSE_* codes (0xF0 - 0xFF) received, indexed by the low nibble */
+	unsigned long long responses[16];
+	/** \brief Number of response codes outside of the SSP_RESPONSE_* range */
+	unsigned long long otherResponses;
+};
+
+/**
+ * \brief Decodes the events of a poll response one at a time, straight from the response data
+ * of the SSP command (see pollIteratorNext()).
+ * \details The response data is only valid until the next SSP command is sent to the device.
+ */
+struct m_poll_iterator {
+	/** \brief The response data (the first byte is the response code) */
+	const unsigned char *data;
+	/** \brief Length of the response data */
+	unsigned int len;
+	/** \brief Offset of the next byte to decode */
+	unsigned int pos;
+	/** \brief Code of the current multi country event */
+	unsigned char event;
+	/** \brief Countries of the current multi country event which have not been decoded yet */
+	unsigned int countries;
+	/** \brief Set if the response ended in the middle of an event (the rest has been dropped) */
+	int truncated;
+};
+
 /**
  * \brief Structure which describes an actual physical ITL device
  */
 struct m_device {
 	/** \brief Hardware Id (type of the device) */
 	int id;
+	/** \brief Either DEVICE_HOPPER or DEVICE_VALIDATOR */
+	unsigned char type;
 	/** \brief Human readable name of the device */
 	char *name;
 	/** \brief Preshared secret key */
@@ -80,8 +536,144 @@ struct m_device {
 	SSP_COMMAND sspC;
 	/** \brief SSP6_REQUEST_DATA structure to use initializing this device */
 	SSP6_SETUP_REQUEST_DATA sspSetupReq;
+	/** \brief Cached device information (see deviceInfoEnsure()) */
+	struct m_device_info info;
+	/** \brief Cached denomination levels (see levelsApplyEvent()) */
+	struct m_levels levels;
+	/** \brief Statistics of the SSP commands sent to this device */
+	struct m_ssp_stats stats;
+	/** \brief Number of requests which were dropped because their deadline had passed */
+	unsigned long long requestsExpired;
+	/** \brief Number of requests which were rejected because the request queue was full */
+	unsigned long long requestsRejected;
+	/** \brief Number of requests which were recognized as duplicates by the idempotency cache */
+	unsigned long long requestsDuplicated;
+	/** \brief Number of requests which joined an identical queued request (see requestQueueJoin()) */
+	unsigned long long requestsCoalesced;
+	/** \brief Number of dispatched commands, indexed like the COMMAND_REGISTRY */
+	unsigned long long dispatched[COMMAND_REGISTRY_MAX];
+	/** \brief Number of reported poll events, indexed by the SSP event code */
+	unsigned long long events[256];
 	/** \brief Callback function which is used to inspect and publish events reported by this device */
-	void (*eventHandlerFn) (struct m_device *device, struct m_metacash *metacash, SSP_POLL_DATA6 *poll);
+	void (*eventHandlerFn) (struct m_device *device, struct m_metacash *metacash, struct m_poll_iterator *events);
+};
+
+/**
+ * \brief Structure which describes an actual command which we
+ * received in one of our request topics.
+ */
+struct m_command {
+	/** \brief The complete received message parsed as JSON (NULL if it was handled by requestParse()) */
+	json_t *jsonMessage;
+	/** \brief The command from the message */
+	char *command;
+	/** \brief The correlId to use in the response (this is the msgId from the message which contained the command) */
+	char *correlId;
+	/** \brief The msgId for the response */
+	char msgId[MSGID_SIZE];
+	/** \brief The topic to which the response should be published */
+	struct m_topic *responseTopic;
+	/** \brief The device to which the command should be issued */
+	struct m_device *device;
+	/** \brief The metacash struct (provides access to the request queue) */
+	struct m_metacash *metacash;
+	/** \brief The entry of the command in the COMMAND_REGISTRY */
+	const struct m_command_def *def;
+	/** \brief The known properties of the message (correlId and command point into it) */
+	struct request request;
+	/** \brief If set the reply is stored here instead of being published (used by handleBatch()) */
+	char **capture;
+	/** \brief Set by the handler if its reply reports an error (used by handleBatch()) */
+	int failed;
+	/** \brief Wall clock time in ms after which the command must not be executed anymore (0 = no deadline) */
+	long long deadline;
+	/** \brief Key of the command in the idempotency cache (empty if the command is not tracked) */
+	char idempotencyKey[IDEMPOTENCY_KEY_SIZE];
+	/** \brief Identical requests which are answered by this command (chained via next, see requestQueueJoin()) */
+	struct m_command *joined;
+	/** \brief Id of the entry in the request stream (empty if the request was received via SUBSCRIBE) */
+	char streamId[STREAM_ID_SIZE];
+	/** \brief Memory of the request (jansson), reset when the command is released (NULL: the heap is used) */
+	struct arena *arena;
+	/** \brief Next command in the queue (or in the free list) */
+	struct m_command *next;
+};
+
+/**
+ * \brief Ids at the start of a reply, see replyToCommand().
+ */
+enum m_reply_ids {
+	/** \brief Only the correlId */
+	REPLY_CORRELID = 0,
+	/** \brief The msgId of the reply and the correlId */
+	REPLY_MSGID_CORRELID
+};
+
+/**
+ * \brief Priority classes of the commands, queued commands of a lower class are executed first.
+ */
+enum m_priority {
+	/** \brief Commands which don't need the hardware (quit, test, ...) */
+	PRIORITY_CONTROL = 0,
+	/** \brief Commands which change the state of the hardware or move money */
+	PRIORITY_OPERATION,
+	/** \brief Commands which only read from the hardware */
+	PRIORITY_QUERY,
+	/** \brief Number of priority classes */
+	PRIORITY_CLASSES
+};
+
+/**
+ * \brief Structure which describes a command supported by payoutd, see COMMAND_REGISTRY.
+ */
+struct m_command_def {
+	/** \brief The JSON command ('cmd' property) */
+	const char *name;
+	/** \brief The handler function which executes the command */
+	void (*handlerFn) (struct m_command *cmd);
+	/** \brief The mandatory properties as REQUEST_* bits (validated before the command is queued) */
+	unsigned int properties;
+	/** \brief If !=0 the command needs the actual hardware (NEEDS_HARDWARE_UNLESS_CACHED: only if isCachedFn fails) */
+	int needsHardware;
+	/** \brief The devices for which the command is valid (DEVICE_* bits) */
+	unsigned char devices;
+	/** \brief The priority class of the command */
+	enum m_priority priority;
+	/** \brief Additional argument for the handler (e.g. do or test for payouts) */
+	int option;
+	/** \brief For NEEDS_HARDWARE_UNLESS_CACHED: test if the command can be answered from a cache */
+	int (*isCachedFn) (struct m_command *cmd);
+	/** \brief If !=0 the command only reads, identical queued requests are executed once (see requestQueueJoin()) */
+	int coalescible;
+	/** \brief The optional properties as REQUEST_* bits (validated if present) */
+	unsigned int optional;
+};
+
+/** \brief Maximum number of received commands waiting for execution */
+#define REQUEST_QUEUE_SIZE 64
+
+/** \brief Size of the first block of the arena of a command, enough for the DOM of an ordinary request */
+#define REQUEST_ARENA_SIZE 4096
+
+/**
+ * \brief Structure which holds the received commands until the dispatcher executes them.
+ * \details Fixed pool of commands, a FIFO per priority class of the queued ones and a free list of the unused ones.
+ */
+struct m_request_queue {
+	/** \brief Storage for all commands */
+	struct m_command pool[REQUEST_QUEUE_SIZE];
+	/** \brief The arena of each command in the pool (it stays with its command) */
+	struct arena arenas[REQUEST_QUEUE_SIZE];
+	/** \brief Unused commands */
+	struct m_command *free;
+	/** \brief Oldest queued command per priority class (executed next) */
+	struct m_command *head[PRIORITY_CLASSES];
+	/** \brief Newest queued command per priority class */
+	struct m_command *tail[PRIORITY_CLASSES];
+	/** \brief Number of queued commands */
+	unsigned int length;
+	/** \brief Number of unused commands (in the free list) */
+	unsigned int available;
 };
 
 /**
@@ -99,11 +691,43 @@ struct m_metacash {
 	int acceptCoins;
 	/** \brief Should the syslog messages also be written to stderr (default no, enable with -e) */
 	int logSyslogStderr;
+	/** \brief Should libuuid be used to generate the msgIds (default no, enable with -u) */
+	int useLibuuid;
+	/** \brief Should the events of a poll cycle also be published to the '*-event-batch' topics (default no, enable with -b) */
+	int publishEventBatch;
+	/** \brief Where the device events go to (default OUTPUT_PUBLISH, override with -m publish|stream|both) */
+	enum m_output_mode outputMode;
+	/** \brief Approximate maximum length of the event streams (override with -l) */
+	unsigned long streamMaxlen;
+	/** \brief Should the requests also be read from the request streams (default no, enable with -x) */
+	int streamIntake;
+	/** \brief What to drop if too much is published while redis is unreachable (default DROP_OLDEST, override with -o oldest|newest) */
+	enum m_drop_policy dropPolicy;
+	/** \brief Generator for the msgIds of the responses (unless useLibuuid is set) */
+	struct msgid_generator msgIds;
+	/** \brief Number of requests remembered by the idempotency cache (override with -i) */
+	unsigned int idempotencyCapacity;
+	/** \brief Time in seconds a request is remembered by the idempotency cache (override with -t) */
+	unsigned int idempotencyTtl;
+	/** \brief Journal file of the idempotency cache (default none, enable with -j) */
+	char *idempotencyJournal;
+	/** \brief The recently received operations keyed by device and msgId */
+	struct idempotency_cache idempotency;
+	/** \brief Name of the shared memory object for local consumers of the device events (default none, enable with -r) */
+	char *eventRingName;
+	/** \brief The shared memory ring of the device events */
+	struct event_ring eventRing;
+	/** \brief Directory of the durable spool of the events (default none, enable with -w) */
+	char *spoolDir;
+	/** \brief Prefix of all topic and stream names, separated by ':' (default none, enable with -n) */
+	char *topicNamespace;
 
 	/** \brief The port of the redis server to which we connect */
 	int redisPort;
 	/** \brief The hostname of the redis server to which we connect */
 	char *redisHost;
+	/** \brief The unix socket of the redis server to which we connect (default none, overrides host and port, enable with -s) */
+	char *redisSocket;
 
 	/** \brief base struct for libevent */
 	struct event_base *eventBase;
@@ -111,6 +735,23 @@ struct m_metacash {
 	struct event evPoll;
 	/** \brief event struct for the periodic check for quitting */
 	struct event evCheckQuit;
+	/** \brief event struct for executing the next queued command */
+	struct event evDispatch;
+	/** \brief event struct for the periodic comparison of the cached levels with the hardware */
+	struct event evReconcile;
+	/** \brief event struct for the periodic metrics snapshot */
+	struct event evMetrics;
+	/** \brief Interval of the metrics snapshot in seconds (default 0: disabled, enable with -g) */
+	unsigned int metricsInterval;
+	/** \brief Duration in microseconds of the poll cycles since the last metrics snapshot */
+	struct histogram pollCycle;
+	/** \brief Duration in microseconds of the intake of the requests (parsing, validation, queueing) since the last metrics snapshot */
+	struct histogram requestIntake;
+	/** \brief Duration in microseconds of the execution of the commands (dispatchCommand()) since the last metrics snapshot */
+	struct histogram requestHandling;
+
+	/** \brief Received commands waiting for execution */
+	struct m_request_queue queue;
 
 	/** \brief struct for the smart-hopper device */
 	struct m_device hopper;
@@ -118,31 +759,25 @@ struct m_metacash {
 	struct m_device validator;
 };
 
-/**
- * \brief Structure which describes an actual command which we
- * received in one of our request topics.
- */
-struct m_command {
-	/** \brief The complete received message parsed as JSON */
-	json_t *jsonMessage;
-	/** \brief The command from the message */
-	char *command;
-	/** \brief The correlId to use in the response (this is the msgId from the message which contained the command) */
-	char *correlId;
-	/** \brief The msgId for the response */
-	char *msgId;
-	/** \brief The topic to which the response should be published */
-	char *responseTopic;
-	/** \brief The device to which the command should be issued */
-	struct m_device *device;
-};
-
 // mcSsp* : ssp helper functions
 int mcSspOpenSerialDevice(struct m_metacash *metacash);
 void mcSspCloseSerialDevice(struct m_metacash *metacash);
 void mcSspSetupCommand(SSP_COMMAND *sspC, int deviceId);
 void mcSspInitializeDevice(SSP_COMMAND *sspC, unsigned long long key, struct m_device *device);
 void mcSspPollDevice(struct m_device *device, struct m_metacash *metacash);
+SSP_RESPONSE_ENUM deviceInfoLoad(struct m_device *device);
+SSP_RESPONSE_ENUM deviceInfoEnsure(struct m_device *device);
+void deviceInfoInvalidate(struct m_device *device);
+SSP_RESPONSE_ENUM levelsRefresh(struct m_device *device);
+void levelsToJson(struct m_levels *levels, struct buffer *json);
+void levelsSet(struct m_levels *levels, unsigned int value, const char *cc, int level);
+void levelsApplyEvent(struct m_device *device, SSP_POLL_EVENT6 *event);
+void pollIteratorInit(struct m_poll_iterator *it, const SSP_COMMAND *sspC);
+int pollIteratorNext(struct m_poll_iterator *it, SSP_POLL_EVENT6 *event);
+int isLevelsCached(struct m_command *cmd);
+void cbOnReconcileEvent(int fd, short event, void *privdata);
+void cbOnMetricsEvent(int fd, short event, void *privdata);
+long long currentTimeMillis();
 
 // mc_ssp_* : ssp magic values and functions (each of these relate directly to a command specified in the ssp protocol)
 
@@ -169,21 +804,23 @@ void mcSspPollDevice(struct m_device *device, struct m_metacash *metacash);
 /** \brief Magic Constant for the "DISPLAY ON" command ID as specified in SSP */
 #define SSP_CMD_DISPLAY_ON 0x3
 
+SSP_RESPONSE_ENUM mc_ssp_poll(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_empty(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_smart_empty(SSP_COMMAND *sspC);
-SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char **json);
+SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, struct buffer *json);
 SSP_RESPONSE_ENUM mc_ssp_configure_bezel(SSP_COMMAND *sspC, unsigned char r, unsigned char g,
 		unsigned char b, unsigned char volatileOption, unsigned char bezelTypeOption);
 SSP_RESPONSE_ENUM mc_ssp_display_on(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_display_off(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_last_reject_note(SSP_COMMAND *sspC, unsigned char *reason);
 SSP_RESPONSE_ENUM mc_ssp_set_refill_mode(SSP_COMMAND *sspC);
-SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json);
+SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, struct m_levels *levels);
 SSP_RESPONSE_ENUM mc_ssp_set_denomination_level(SSP_COMMAND *sspC, int amount, int level, const char *cc);
 SSP_RESPONSE_ENUM mc_ssp_float(SSP_COMMAND *sspC, const int value, const char *cc, const char option);
 SSP_RESPONSE_ENUM mc_ssp_channel_security_data(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_get_firmware_version(SSP_COMMAND *sspC, char *firmwareVersion);
 SSP_RESPONSE_ENUM mc_ssp_get_dataset_version(SSP_COMMAND *sspC, char *datasetVersion);
+SSP_RESPONSE_ENUM mc_ssp_get_serial_number(SSP_COMMAND *sspC, unsigned long *serialNumber);
 
 /** \brief Magic Constant for the "route to cashbox" option as specified in SSP */
 const char SSP_OPTION_ROUTE_CASHBOX = 0x01;
@@ -206,8 +843,23 @@ static const unsigned long long DEFAULT_KEY = 0x123456701234567LL;
 // metacash
 int parseCmdLine(int argc, char *argv[], struct m_metacash *metacash);
 void setup(struct m_metacash *metacash);
-void hopperEventHandler(struct m_device *device, struct m_metacash *metacash, SSP_POLL_DATA6 *poll);
-void validatorEventHandler(struct m_device *device, struct m_metacash *metacash, SSP_POLL_DATA6 *poll);
+void pollEventHandler(struct m_device *device, struct m_metacash *metacash, struct m_poll_iterator *events);
+void publishPollEvent(struct m_device *device, SSP_POLL_EVENT6 *event);
+void appendDispatchCounters(struct buffer *b, struct m_device *device);
+const struct m_command_def *findCommand(const char *name);
+char *findPropertyError(const struct m_command_def *def, struct request *request);
+void dispatchCommand(struct m_metacash *m, struct m_command *cmd);
+void handleBatch(struct m_command *cmd);
+int isExpired(struct m_command *cmd);
+int replyWith(struct m_topic *topic, char *format, ...);
+void cbOnStreamRead(redisAsyncContext *c, void *r, void *privdata);
+void cbOnStreamClaim(redisAsyncContext *c, void *r, void *privdata);
+void streamResume();
+void cbOnReconnectEvent(int fd, short event, void *privdata);
+void redisSend(const char *command, size_t len);
+void spoolPump();
+void streamAcknowledge(struct m_device *device, const char *streamId);
+void discardQueuedCommands(struct m_metacash *m);
 
 static const char *CURRENCY = "EUR";
 
@@ -223,6 +875,16 @@ void signalHandler(int signal) {
 	receivedSignal = signal;
 }
 
+/**
+ * \brief Waits for the minimum gap between a response and the next command (used within a batch).
+ */
+void hardwareFrameGap() {
+	struct timespec ts;
+	ts.tv_sec = 0;
+	ts.tv_nsec = SSP_FRAME_GAP_MS * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
 /**
  * \brief Waits for 300ms each time called.
  * \details Details only to get graph.
@@ -239,8 +901,12 @@ void hardwareWaitTime() {
  * \brief Connect to redis and return a new redisAsyncContext.
  */
 redisAsyncContext* connectRedis(struct m_metacash *metacash) {
-	redisAsyncContext *conn = redisAsyncConnect(metacash->redisHost,
-			metacash->redisPort);
+	redisAsyncContext *conn;
+	if (metacash->redisSocket) {
+		conn = redisAsyncConnectUnix(metacash->redisSocket);
+	} else {
+		conn = redisAsyncConnect(metacash->redisHost, metacash->redisPort);
+	}
 
 	if (conn == NULL || conn->err) {
 		if (conn) {
@@ -257,6 +923,111 @@ redisAsyncContext* connectRedis(struct m_metacash *metacash) {
 	return conn;
 }
 
+/**
+ * \brief Prepares a redis connection (the connection itself is made by redisLinkConnect()).
+ */
+void redisLinkInit(struct m_redis_link *link, const char *name, redisAsyncContext **ctx,
+		redisConnectCallback *onConnect, redisDisconnectCallback *onDisconnect, struct m_metacash *metacash) {
+	link->name = name;
+	link->ctx = ctx;
+	link->onConnect = onConnect;
+	link->onDisconnect = onDisconnect;
+	link->connected = 0;
+	link->attempts = 0;
+	link->reconnects = 0;
+	link->metacash = metacash;
+
+	evtimer_set(&link->evReconnect, cbOnReconnectEvent, link); // provide the link in privdata
+	event_base_set(metacash->eventBase, &link->evReconnect);
+}
+
+/**
+ * \brief Creates the context of the connection and attaches it to libevent. Returns 0 on success.
+ */
+int redisLinkConnect(struct m_redis_link *link) {
+	redisAsyncContext *conn = connectRedis(link->metacash);
+	if (conn == NULL || conn->err) {
+		if (conn) {
+			redisAsyncFree(conn);
+		}
+		*link->ctx = NULL;
+		return 1;
+	}
+
+	*link->ctx = conn;
+	redisLibeventAttach(conn, link->metacash->eventBase);
+	redisAsyncSetConnectCallback(conn, link->onConnect);
+	redisAsyncSetDisconnectCallback(conn, link->onDisconnect);
+	return 0;
+}
+
+/**
+ * \brief Schedules the next attempt to reestablish the connection (exponential backoff with jitter).
+ */
+void redisLinkScheduleReconnect(struct m_redis_link *link) {
+	unsigned long backoff = REDIS_RECONNECT_MIN_MS;
+	for (unsigned int i = 0; i < link->attempts && backoff < REDIS_RECONNECT_MAX_MS; i++) {
+		backoff *= 2;
+	}
+	if (backoff > REDIS_RECONNECT_MAX_MS) {
+		backoff = REDIS_RECONNECT_MAX_MS;
+	}
+	link->attempts++;
+
+	// somewhere between half and all of the backoff, so that the connections don't retry in lockstep
+	unsigned long delay = backoff / 2 + random() % (backoff / 2 + 1);
+
+	syslog(LOG_NOTICE, "reconnecting the %s connection to redis in %lums\n", link->name, delay);
+
+	struct timeval tv;
+	tv.tv_sec = delay / 1000;
+	tv.tv_usec = (delay % 1000) * 1000;
+	evtimer_add(&link->evReconnect, &tv);
+}
+
+/**
+ * \brief Bookkeeping for the connect callbacks, returns 0 if the connection has been established.
+ * \details hiredis frees the context of a failed connection after the callback, the next
+ * attempt is scheduled.
+ */
+int redisLinkConnected(struct m_redis_link *link, int status) {
+	if (status != REDIS_OK) {
+		*link->ctx = NULL;
+		link->connected = 0;
+		redisLinkScheduleReconnect(link);
+		return 1;
+	}
+
+	link->connected = 1;
+	link->attempts = 0;
+	return 0;
+}
+
+/**
+ * \brief Bookkeeping for the disconnect callbacks.
+ * \details hiredis frees the context after the callback. Unless we have disconnected on purpose
+ * (status REDIS_OK, e.g. when exiting) the connection is reestablished.
+ */
+void redisLinkDisconnected(struct m_redis_link *link, int status) {
+	*link->ctx = NULL;
+	link->connected = 0;
+	if (status != REDIS_OK) {
+		redisLinkScheduleReconnect(link);
+	}
+}
+
+/**
+ * \brief Callback function for the libEvent timer triggered "Reconnect" event of a redis connection.
+ */
+void cbOnReconnectEvent(int fd, short event, void *privdata) {
+	struct m_redis_link *link = privdata;
+
+	link->reconnects++;
+	if (redisLinkConnect(link)) {
+		redisLinkScheduleReconnect(link);
+	}
+}
+
 /**
  * \brief Callback function for libEvent timer triggered "Poll" event.
  * \details Details only to get graph.
@@ -269,8 +1040,66 @@ void cbOnPollEvent(int fd, short event, void *privdata) {
 		return;
 	}
 
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	mcSspPollDevice(&metacash->hopper, metacash);
 	mcSspPollDevice(&metacash->validator, metacash);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	histogramRecord(&metacash->pollCycle,
+			(end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+/**
+ * \brief Callback function triggered by libitlssp after every SSP command, records
+ * the round-trip time and the outcome in the statistics of the device.
+ * \details Kept cheap as it runs for every SSP frame (no allocation, no locking - we are single threaded).
+ */
+void cbOnSspCommand(const SSP_COMMAND *sspC, unsigned char command, int result,
+		unsigned long long elapsedNs, void *privdata) {
+	struct m_metacash *metacash = privdata;
+	struct m_ssp_stats *stats;
+
+	if (sspC == &metacash->hopper.sspC) {
+		stats = &metacash->hopper.stats;
+	} else if (sspC == &metacash->validator.sspC) {
+		stats = &metacash->validator.stats;
+	} else {
+		return;
+	}
+
+	unsigned int slot = stats->slotOfCommand[command];
+	if (slot == 0 && stats->usedSlots < SSP_STATS_COMMANDS) {
+		stats->commandOfSlot[stats->usedSlots] = command;
+		slot = ++stats->usedSlots;
+		stats->slotOfCommand[command] = slot;
+	}
+
+	if (slot != 0) {
+		histogramRecord(&stats->latency[slot - 1], elapsedNs / 1000);
+	} else {
+		stats->untracked++;
+	}
+	histogramRecord(&stats->rtt, elapsedNs / 1000);
+
+	stats->retries += sspC->RetryCount;
+
+	if (result) {
+		unsigned char code = sspC->ResponseData[0];
+		if ((code & 0xF0) == 0xF0) {
+			stats->responses[code & 0x0F]++;
+		} else {
+			stats->otherResponses++;
+		}
+	} else if (sspC->ResponseStatus == SSP_CMD_TIMEOUT) {
+		stats->timeouts++;
+	} else if (sspC->ResponseStatus == SSP_PACKET_ERROR) {
+		stats->packetErrors++;
+	} else {
+		stats->portErrors++;
+	}
 }
 
 /**
@@ -281,7 +1110,12 @@ void cbOnCheckQuitEvent(int fd, short event, void *privdata) {
 		syslog(LOG_NOTICE, "received signal or quit cmd. going to exit event loop.");
 
 		struct m_metacash *metacash = privdata;
-		event_base_loopexit(metacash->eventBase, NULL);
+		metacash->quit = 1;
+		discardQueuedCommands(metacash);
+
+		// give redis the chance to send out the replies before the loop exits
+		struct timeval flush = { 0, 200000 };
+		event_base_loopexit(metacash->eventBase, &flush);
 		receivedSignal = 0;
 	}
 }
@@ -294,88 +1128,490 @@ void cbOnMetacashMessage(redisAsyncContext *c, void *r, void *privdata) {
 }
 
 /**
- * \brief Test if cmd.command equals command
+ * \brief Prefixes all topic and stream names with "<ns>:" (if ns is not NULL), must be called
+ * before the topics are initialized.
  */
-int isCommand(struct m_command *cmd, const char *command) {
-	return ! strcmp(cmd->command, command);
+void namespaceInit(const char *ns) {
+	if (ns == NULL) {
+		return;
+	}
+
+	asprintf(&namespacePrefix, "%s:", ns);
+	asprintf(&requestNames.metacashTopic, "%smetacash", namespacePrefix);
+	asprintf(&requestNames.hopperTopic, "%shopper-request", namespacePrefix);
+	asprintf(&requestNames.validatorTopic, "%svalidator-request", namespacePrefix);
+	asprintf(&requestNames.hopperStream, "%s%s", namespacePrefix, HOPPER_REQUEST_STREAM);
+	asprintf(&requestNames.validatorStream, "%s%s", namespacePrefix, VALIDATOR_REQUEST_STREAM);
 }
 
 /**
- * \brief Helper function to publish a message to the "payout-event" topic.
+ * \brief Prepares the RESP encoded beginning of the PUBLISH command for the topic (the name
+ * is prefixed with the namespace).
  */
-int publishPayoutEvent(char *format, ...) {
-	va_list varags;
-	va_start(varags, format);
-
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
-
-	va_end(varags);
-
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", "payout-event", reply);
-
-	free(reply);
-
-	return 0;
+void topicInit(struct m_topic *topic) {
+	topic->respLen = respPublishHeader(&topic->resp, namespacePrefix, topic->name);
 }
 
 /**
- * \brief Helper function to publish a message to the "hopper-event" topic.
+ * \brief Returns the topic with the name or NULL if we don't publish to it.
  */
-int publishHopperEvent(char *format, ...) {
-	va_list varags;
-	va_start(varags, format);
+struct m_topic *findTopic(const char *name) {
+	for (struct m_topic **topic = topics; *topic != NULL; topic++) {
+		if (strcmp((*topic)->name, name) == 0) {
+			return *topic;
+		}
+	}
+	return NULL;
+}
 
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
+/**
+ * \brief Buffers a command while the publish connection is down, applying the drop policy if
+ * the buffer is full.
+ */
+void outboundQueuePush(const char *command, size_t len) {
+	size_t needed = sizeof(size_t) + len;
+	if (needed > OUTBOUND_QUEUE_SIZE) {
+		outbound.dropped++;
+		return;
+	}
 
-	va_end(varags);
+	if (outbound.buffer == NULL) {
+		outbound.buffer = malloc(OUTBOUND_QUEUE_SIZE);
+		if (outbound.buffer == NULL) {
+			outbound.dropped++;
+			return;
+		}
+	}
 
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", "hopper-event", reply);
+	if (outbound.used + needed > OUTBOUND_QUEUE_SIZE) {
+		if (outbound.policy == DROP_NEWEST) {
+			outbound.dropped++;
+			return;
+		}
 
-	free(reply);
+		// skip the oldest commands until the new one fits
+		size_t offset = 0;
+		while (outbound.used - offset + needed > OUTBOUND_QUEUE_SIZE) {
+			size_t oldLen;
+			memcpy(&oldLen, outbound.buffer + offset, sizeof(size_t));
+			offset += sizeof(size_t) + oldLen;
+			outbound.dropped++;
+		}
+		memmove(outbound.buffer, outbound.buffer + offset, outbound.used - offset);
+		outbound.used -= offset;
+	}
 
-	return 0;
+	memcpy(outbound.buffer + outbound.used, &len, sizeof(size_t));
+	memcpy(outbound.buffer + outbound.used + sizeof(size_t), command, len);
+	outbound.used += needed;
+	outbound.buffered++;
 }
 
 /**
- * \brief Helper function to publish a message to the "validator-event" topic.
+ * \brief Hands the buffered commands to hiredis back to back (they go out with one write).
  */
-int publishValidatorEvent(char *format, ...) {
-	va_list varags;
-	va_start(varags, format);
-
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
+void outboundQueueFlush() {
+	size_t offset = 0;
+	unsigned int count = 0;
+	while (offset < outbound.used) {
+		size_t len;
+		memcpy(&len, outbound.buffer + offset, sizeof(size_t));
+		redisAsyncFormattedCommand(redisPublishCtx, NULL, NULL, outbound.buffer + offset + sizeof(size_t), len);
+		offset += sizeof(size_t) + len;
+		count++;
+	}
+	outbound.used = 0;
 
-	va_end(varags);
+	if (count > 0) {
+		syslog(LOG_NOTICE, "flushed %u buffered commands (%llu dropped so far)\n", count, outbound.dropped);
+	}
+}
+
+/**
+ * \brief Sends a formatted command via the publish connection, it is buffered while the
+ * connection is down (see outboundQueuePush()).
+ */
+void redisSend(const char *command, size_t len) {
+	if (publishLink.connected) {
+		redisAsyncFormattedCommand(redisPublishCtx, NULL, NULL, command, len);
+	} else {
+		outboundQueuePush(command, len);
+	}
+}
+
+/**
+ * \brief Callback function for the spooled commands, once redis has answered a command it
+ * doesn't have to be sent again.
+ */
+void cbOnSpoolAck(redisAsyncContext *c, void *r, void *privdata) {
+	if (r == NULL) {
+		// the connection is gone, the command is sent again after reconnecting
+		return;
+	}
+	eventSpoolAcknowledge(&eventSpool, (unsigned long long) (uintptr_t) privdata);
+}
+
+/**
+ * \brief Writes the spooled commands to disk and hands the ones which haven't been sent yet to
+ * hiredis, at most SPOOL_REPLAY_BATCH of them per loop iteration (see evSpoolReplay).
+ * \details Appending the events of a poll cycle first and calling this once afterwards writes
+ * them to disk together.
+ */
+void spoolPump() {
+	if (eventSpoolSync(&eventSpool)) {
+		syslog(LOG_ERR, "spoolPump: could not write the spool to disk\n");
+	}
+
+	if (! publishLink.connected) {
+		return;
+	}
+
+	const char *command;
+	size_t len;
+	unsigned long long seq;
+	unsigned int count = 0;
+	while (count < SPOOL_REPLAY_BATCH && (command = eventSpoolNext(&eventSpool, &len, &seq)) != NULL) {
+		redisAsyncFormattedCommand(redisPublishCtx, cbOnSpoolAck, (void *) (uintptr_t) seq, command, len);
+		count++;
+	}
+
+	if (eventSpoolHasNext(&eventSpool)) {
+		struct timeval immediately = { 0, 0 };
+		evtimer_add(&evSpoolReplay, &immediately);
+	}
+}
+
+/**
+ * \brief Callback function for handing the next batch of spooled commands to hiredis.
+ */
+void cbOnSpoolReplayEvent(int fd, short event, void *privdata) {
+	spoolPump();
+}
+
+/**
+ * \brief Sends a formatted command of a spooled topic: it is appended to the eventSpool and sent
+ * from there (unless a poll cycle is being collected, see eventBatchEnd()).
+ */
+void spoolSend(const char *command, size_t len) {
+	if (eventSpoolAppend(&eventSpool, command, len) == 0) {
+		syslog(LOG_WARNING, "spoolSend: spool full, sending the command without it\n");
+		redisSend(command, len);
+		return;
+	}
+
+	if (eventBatch.topic == NULL) {
+		spoolPump();
+	}
+}
+
+/**
+ * \brief Prepares the RESP encoded beginning of the XADD command for the stream of the topic.
+ * \details Only done for topics with a streamName if the output mode uses streams, if it
+ * doesn't PUBLISH the messages anymore are only appended to the stream.
+ */
+void topicInitStream(struct m_topic *topic, enum m_output_mode mode, unsigned long maxlen) {
+	topic->publish = topic->streamName == NULL || mode != OUTPUT_STREAM;
+	if (topic->streamName == NULL || mode == OUTPUT_PUBLISH) {
+		return;
+	}
+
+	char count[24];
+	int countLen = snprintf(count, sizeof(count), "%lu", maxlen);
+
+	// XADD <namespace:stream> MAXLEN ~ <maxlen> * seq <seq> ts <ts> data <payload>
+	topic->streamLen = asprintf(&topic->stream, "*12\r\n$4\r\nXADD\r\n$%zu\r\n%s%s\r\n"
+			"$6\r\nMAXLEN\r\n$1\r\n~\r\n$%d\r\n%s\r\n$1\r\n*\r\n",
+			strlen(namespacePrefix) + strlen(topic->streamName), namespacePrefix, topic->streamName, countLen, count);
+}
+
+/**
+ * \brief Hands the formatted PUBLISH command of a message to hiredis and, if the topic has a
+ * stream, the XADD command with the same payload (plus sequence number and timestamp).
+ * The payload is also written to the shared memory ring of the topic (if any). The commands of
+ * a spooled topic go through the eventSpool (see spoolSend()).
+ */
+void sendFormatted(struct m_topic *topic, const char *command, size_t commandLen, const char *payload, int len) {
+	void (*send)(const char *, size_t) = topic->spooled ? spoolSend : redisSend;
+
+	if (topic->publish) {
+		send(command, commandLen);
+	}
+
+	if (topic->ring) {
+		eventRingPublish(topic->ring, topic->name, payload, len, currentTimeMillis());
+	}
+
+	if (topic->stream == NULL) {
+		return;
+	}
+
+	char seq[24];
+	char ts[24];
+	int seqLen = snprintf(seq, sizeof(seq), "%llu", ++topic->seq);
+	int tsLen = snprintf(ts, sizeof(ts), "%lld", currentTimeMillis());
+
+	char fields[128];
+	int fieldsLen = snprintf(fields, sizeof(fields), "$3\r\nseq\r\n$%d\r\n%s\r\n$2\r\nts\r\n$%d\r\n%s\r\n$4\r\ndata\r\n$%d\r\n",
+			seqLen, seq, tsLen, ts, len);
+
+	size_t needed = topic->streamLen + fieldsLen + len + 2;
+	if (respGrowBuffer(&streamBuffer, &streamBufferSize, needed)) {
+		syslog(LOG_ERR, "sendFormatted: out of memory, message not appended to the stream of topic '%s'\n", topic->name);
+		return;
+	}
+
+	char *p = streamBuffer;
+	memcpy(p, topic->stream, topic->streamLen);
+	p += topic->streamLen;
+	memcpy(p, fields, fieldsLen);
+	p += fieldsLen;
+	memcpy(p, payload, len + 2); // including the trailing "\r\n"
 
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", "validator-event", reply);
+	send(streamBuffer, needed);
+}
+
+/**
+ * \brief Replaces the JSON payload (len bytes at offset) in the buffer by its MessagePack encoding,
+ * growing the buffer if necessary. The JSON text is kept in the jsonBuffer.
+ * Returns the length of the encoded payload (or -1).
+ */
+int packPayload(char **buffer, size_t *size, size_t offset, int len) {
+	int packedLen = msgpackFromJson(*buffer + offset, len, &msgpackBuffer, &msgpackBufferSize);
+	if (packedLen < 0) {
+		return -1;
+	}
+
+	if (respGrowBuffer(&jsonBuffer, &jsonBufferSize, len)) {
+		return -1;
+	}
+	memcpy(jsonBuffer, *buffer + offset, len);
+
+	// encoded payload + trailing "\r\n"
+	if (respGrowBuffer(buffer, size, offset + packedLen + 2)) {
+		return -1;
+	}
+	memcpy(*buffer + offset, msgpackBuffer, packedLen);
+
+	return packedLen;
+}
+
+/**
+ * \brief Formats the PUBLISH command for the message described by format and varags into the
+ * buffer at offset, growing the buffer if necessary.
+ * \details The payload is formatted behind some reserved space, then the RESP header (prepared
+ * by topicInit() plus the length of the payload) is put directly in front of it (see Resp.h).
+ * Returns the length of the payload (or -1), the command starts at *start, the payload at
+ * offset + topic->respLen + RESP_HEADER_RESERVE and it ends 2 bytes behind the payload.
+ * Messages to topics using MessagePack are transcoded from the formatted JSON, which stays
+ * available as formattedJson until the next call.
+ */
+int formatPublish(struct m_topic *topic, char **buffer, size_t *size, size_t offset, size_t *start,
+		const char *format, va_list varags) {
+	size_t reserve = offset + topic->respLen + RESP_HEADER_RESERVE;
+
+	int len = respFormatPayload(buffer, size, reserve, format, varags);
+	if (len < 0) {
+		return -1;
+	}
 
-	free(reply);
+	formattedJson = *buffer + reserve;
+	formattedJsonLen = len;
+
+	if (topic->msgpack) {
+		len = packPayload(buffer, size, reserve, len);
+		if (len < 0) {
+			return -1;
+		}
+		formattedJson = jsonBuffer;
+	}
+
+	*start = reserve - respFramePublish(*buffer + reserve, len, topic->resp, topic->respLen);
+
+	return len;
+}
+
+/**
+ * \brief Publishes the message described by format and varags to the topic.
+ * \details The command is formatted into the reused publishBuffer by formatPublish() and handed
+ * to redisAsyncFormattedCommand(). Once the buffer is big enough this doesn't allocate any memory.
+ * The JSON payload of a message to the topic of the current poll cycle is also collected for the
+ * batch topic (see eventBatchBegin()).
+ * \callergraph
+ */
+int publishFormatted(struct m_topic *topic, const char *format, va_list varags) {
+	size_t start;
+	int len = formatPublish(topic, &publishBuffer, &publishBufferSize, 0, &start, format, varags);
+	if (len < 0) {
+		syslog(LOG_ERR, "publishFormatted: could not format the message for topic '%s'\n", topic->name);
+		return 1;
+	}
+
+	char *payload = publishBuffer + topic->respLen + RESP_HEADER_RESERVE;
+	sendFormatted(topic, publishBuffer + start, (payload + len + 2) - (publishBuffer + start), payload, len);
+
+	publishedPayload = formattedJson;
+	publishedPayloadLen = formattedJsonLen;
+
+	if (topic == eventBatch.topic && eventBatch.batchTopic) {
+		if (eventBatch.payloads.len > 0) {
+			bufferAppendChar(&eventBatch.payloads, ',');
+		}
+		bufferAppend(&eventBatch.payloads, formattedJson, formattedJsonLen);
+	}
 
 	return 0;
 }
 
+/**
+ * \brief Starts collecting the messages published to the topic (the events of one poll cycle).
+ * \details If batchTopic is not NULL the collected messages are also published as one JSON
+ * array to it by eventBatchEnd(). The commands of a spooled topic are written to the spool
+ * together at the end.
+ */
+void eventBatchBegin(struct m_topic *topic, struct m_topic *batchTopic) {
+	eventBatch.topic = topic;
+	eventBatch.batchTopic = batchTopic;
+}
+
+/**
+ * \brief Publishes the array of the collected payloads to the batch topic and stops collecting.
+ */
+void eventBatchEnd() {
+	if (eventBatch.payloads.failed) {
+		syslog(LOG_ERR, "eventBatchEnd: out of memory, batch for topic '%s' dropped\n", eventBatch.batchTopic->name);
+	} else if (eventBatch.payloads.len > 0) {
+		// formatPublish() encodes the array if the batch topic uses MessagePack
+		replyWith(eventBatch.batchTopic, "[%s]", eventBatch.payloads.data);
+	}
+	bufferReset(&eventBatch.payloads);
+
+	if (eventBatch.topic && eventBatch.topic->spooled) {
+		// written to disk together
+		spoolPump();
+	}
+
+	eventBatch.topic = NULL;
+	eventBatch.batchTopic = NULL;
+}
+
+/**
+ * \brief Helper function to publish a message to the "payout-event" topic.
+ */
+int publishPayoutEvent(char *format, ...) {
+	va_list varags;
+	va_start(varags, format);
+
+	int rc = publishFormatted(&payoutEventTopic, format, varags);
+
+	va_end(varags);
+
+	return rc;
+}
+
+/**
+ * \brief Helper function to publish a message to the "hopper-event" topic.
+ */
+int publishHopperEvent(char *format, ...) {
+	va_list varags;
+	va_start(varags, format);
+
+	int rc = publishFormatted(&hopperEventTopic, format, varags);
+
+	va_end(varags);
+
+	return rc;
+}
+
+/**
+ * \brief Helper function to publish a message to the "validator-event" topic.
+ */
+int publishValidatorEvent(char *format, ...) {
+	va_list varags;
+	va_start(varags, format);
+
+	int rc = publishFormatted(&validatorEventTopic, format, varags);
+
+	va_end(varags);
+
+	return rc;
+}
+
 /**
  * \brief Helper function to publish a message to the given topic.
  * \details Details only to get graph.
  * \callergraph
  */
-int replyWith(char *topic, char *format, ...) {
+int replyWith(struct m_topic *topic, char *format, ...) {
 	va_list varags;
 	va_start(varags, format);
 
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
+	int rc = publishFormatted(topic, format, varags);
 
 	va_end(varags);
 
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", topic, reply);
+	return rc;
+}
 
-	free(reply);
+/**
+ * \brief Formats the reply to one request: the ids selected by ids followed by the body.
+ */
+static void replyFormat(struct buffer *reply, enum m_reply_ids ids, const char *msgId,
+		const char *correlId, const char *body) {
+	bufferAppendChar(reply, '{');
+	if (ids == REPLY_MSGID_CORRELID) {
+		bufferAppendFormat(reply, "\"msgId\":\"%s\",", msgId[0] ? msgId : "unknown");
+	}
+	bufferAppendFormat(reply, "\"correlId\":\"%s\",%s", correlId ? correlId : "unknown", body);
+}
 
-	return 0;
+/**
+ * \brief Helper function to publish the reply to a command to its response topic.
+ * \details The format describes the body of the reply (everything after the ids, including
+ * the closing brace), the msgId and the correlId of the command are put in front of it.
+ *
+ * If the command is a step of a batch the reply is captured instead. The reply to a command
+ * tracked by the idempotency cache is also stored there. Every joined request gets a reply
+ * of its own with its msgId and correlId, the body is only formatted once.
+ * \callergraph
+ */
+int replyToCommand(struct m_command *cmd, enum m_reply_ids ids, char *format, ...) {
+	char bodyStorage[REPLY_BUFFER_SIZE];
+	struct buffer body;
+	bufferInit(&body, bodyStorage, sizeof(bodyStorage));
+
+	va_list varags;
+	va_start(varags, format);
+	bufferAppendFormatV(&body, format, varags);
+	va_end(varags);
+
+	char replyStorage[REPLY_BUFFER_SIZE];
+	struct buffer reply;
+	bufferInit(&reply, replyStorage, sizeof(replyStorage));
+	replyFormat(&reply, ids, cmd->msgId, cmd->correlId, body.data);
+
+	int rc = 0;
+	if (cmd->capture) {
+		free(*cmd->capture);
+		*cmd->capture = strdup(reply.data);
+	} else {
+		rc = replyWith(cmd->responseTopic, "%s", reply.data);
+
+		if (rc == 0 && cmd->idempotencyKey[0]) {
+			idempotencyComplete(&cmd->metacash->idempotency, cmd->idempotencyKey,
+					publishedPayload, publishedPayloadLen, currentTimeMillis());
+		}
+
+		for (struct m_command *joined = cmd->joined; joined; joined = joined->next) {
+			bufferReset(&reply);
+			replyFormat(&reply, ids, joined->msgId, joined->correlId, body.data);
+			replyWith(joined->responseTopic, "%s", reply.data);
+		}
+	}
+
+	bufferFree(&reply);
+	bufferFree(&body);
+
+	return rc;
 }
 
 /**
@@ -385,21 +1621,42 @@ int replyWith(char *topic, char *format, ...) {
  * \callergraph
  */
 int replyWithPropertyError(struct m_command *cmd, char *name) {
-	char *msgId = "unknown";
-	if(cmd->msgId) {
-		msgId = cmd->msgId;
-	}
+	cmd->failed = 1;
+	return replyToCommand(cmd, REPLY_MSGID_CORRELID,
+			"\"error\":\"Property '%s' missing or of wrong type\"}",
+			name);
+}
 
-	char *correlId = "unknown";
-	if(cmd->correlId) {
-		correlId = cmd->correlId;
+/**
+ * \brief Returns a human readable version of the SSP response.
+ */
+char *sspResponseToString(SSP_RESPONSE_ENUM response) {
+	switch(response) {
+		case SSP_RESPONSE_OK:
+			return "ok";
+		case SSP_RESPONSE_UNKNOWN_COMMAND:
+			return "unknown command";
+		case SSP_RESPONSE_INCORRECT_PARAMETERS:
+			return "incorrect parameters";
+		case SSP_RESPONSE_INVALID_PARAMETER:
+			return "invalid parameter";
+		case SSP_RESPONSE_COMMAND_NOT_PROCESSED:
+			return "command not processed";
+		case SSP_RESPONSE_SOFTWARE_ERROR:
+			return "software error";
+		case SSP_RESPONSE_CHECKSUM_ERROR:
+			return "checksum error";
+		case SSP_RESPONSE_FAILURE:
+			return "failure";
+		case SSP_RESPONSE_HEADER_FAILURE:
+			return "header failure";
+		case SSP_RESPONSE_KEY_NOT_SET:
+			return "key not set";
+		case SSP_RESPONSE_TIMEOUT:
+			return "timeout";
+		default:
+			return "unknown";
 	}
-
-	return replyWith(cmd->responseTopic,
-			"{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"Property '%s' missing or of wrong type\"}",
-			msgId,
-			correlId,
-			name);
 }
 
 /**
@@ -410,51 +1667,11 @@ int replyWithPropertyError(struct m_command *cmd, char *name) {
  */
 int replyWithSspResponse(struct m_command *cmd, SSP_RESPONSE_ENUM response) {
 	if(response == SSP_RESPONSE_OK) {
-		return replyWith(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"result\":\"ok\"}",
-				cmd->msgId,
-				cmd->correlId);
+		return replyToCommand(cmd, REPLY_MSGID_CORRELID, "\"result\":\"ok\"}");
 	} else {
-		char *errorMsg;
-
-		switch(response) {
-			case SSP_RESPONSE_UNKNOWN_COMMAND:
-				errorMsg = "unknown command";
-				break;
-			case SSP_RESPONSE_INCORRECT_PARAMETERS:
-				errorMsg = "incorrect parameters";
-				break;
-			case SSP_RESPONSE_INVALID_PARAMETER:
-				errorMsg = "invalid parameter";
-				break;
-			case SSP_RESPONSE_COMMAND_NOT_PROCESSED:
-				errorMsg = "command not processed";
-				break;
-			case SSP_RESPONSE_SOFTWARE_ERROR:
-				errorMsg = "software error";
-				break;
-			case SSP_RESPONSE_CHECKSUM_ERROR:
-				errorMsg = "checksum error";
-				break;
-			case SSP_RESPONSE_FAILURE:
-				errorMsg = "failure";
-				break;
-			case SSP_RESPONSE_HEADER_FAILURE:
-				errorMsg = "header failure";
-				break;
-			case SSP_RESPONSE_KEY_NOT_SET:
-				errorMsg = "key not set";
-				break;
-			case SSP_RESPONSE_TIMEOUT:
-				errorMsg = "timeout";
-				break;
-			default:
-				errorMsg = "unknown";
-		}
-
-		return replyWith(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"sspError\":\"%s\"}",
-				cmd->msgId,
-				cmd->correlId,
-				errorMsg);
+		cmd->failed = 1;
+		return replyToCommand(cmd, REPLY_MSGID_CORRELID, "\"sspError\":\"%s\"}",
+				sspResponseToString(response));
 	}
 }
 
@@ -484,21 +1701,10 @@ void handleSmartEmpty(struct m_command *cmd) {
  * \brief Handles the JSON "do-payout" and "test-payout" commands.
  */
 void handlePayout(struct m_command *cmd) {
-	int payoutOption = 0;
-
-	if (isCommand(cmd, "do-payout")) {
-		payoutOption = SSP6_OPTION_BYTE_DO;
-	} else {
-		payoutOption = SSP6_OPTION_BYTE_TEST;
-	}
-
-	json_t *jAmount = json_object_get(cmd->jsonMessage, "amount");
-	if(! json_is_integer(jAmount)) {
-		replyWithPropertyError(cmd, "amount");
-		return;
-	}
+	// SSP6_OPTION_BYTE_DO or SSP6_OPTION_BYTE_TEST
+	int payoutOption = cmd->def->option;
 
-	int amount = json_integer_value(jAmount);
+	int amount = cmd->request.amount;
 
 	SSP_RESPONSE_ENUM resp = ssp6_payout(&cmd->device->sspC, amount, CURRENCY,
 			payoutOption);
@@ -523,7 +1729,8 @@ void handlePayout(struct m_command *cmd) {
 			break;
 		}
 
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"%s\"}", cmd->correlId, error);
+		cmd->failed = 1;
+		replyToCommand(cmd, REPLY_CORRELID, "\"error\":\"%s\"}", error);
 	} else {
 		replyWithSspResponse(cmd, resp);
 	}
@@ -534,21 +1741,9 @@ void handlePayout(struct m_command *cmd) {
  */
 void handleFloat(struct m_command *cmd) {
 	// basically a copy of do/test-payout ...
-	int payoutOption = 0;
-
-	if (isCommand(cmd, "do-float")) {
-		payoutOption = SSP6_OPTION_BYTE_DO;
-	} else {
-		payoutOption = SSP6_OPTION_BYTE_TEST;
-	}
-
-	json_t *jAmount = json_object_get(cmd->jsonMessage, "amount");
-	if(! json_is_integer(jAmount)) {
-		replyWithPropertyError(cmd, "amount");
-		return;
-	}
+	int payoutOption = cmd->def->option;
 
-	int amount = json_integer_value(jAmount);
+	int amount = cmd->request.amount;
 
 	SSP_RESPONSE_ENUM resp = mc_ssp_float(&cmd->device->sspC, amount, CURRENCY,
 			payoutOption);
@@ -572,8 +1767,8 @@ void handleFloat(struct m_command *cmd) {
 			error = "unknown";
 			break;
 		}
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"%s\"}",
-				cmd->correlId, error);
+		cmd->failed = 1;
+		replyToCommand(cmd, REPLY_CORRELID, "\"error\":\"%s\"}", error);
 	} else {
 		replyWithSspResponse(cmd, resp);
 	}
@@ -598,13 +1793,7 @@ void dbgDisplayInhibits(unsigned char inhibits) {
  * \brief Handles the JSON "enable-channels" command.
  */
 void handleEnableChannels(struct m_command *cmd) {
-	json_t *jChannels = json_object_get(cmd->jsonMessage, "channels");
-	if(! json_is_string(jChannels)) {
-		replyWithPropertyError(cmd, "channels");
-		return;
-	}
-
-	char *channels = (char *) json_string_value(jChannels);
+	char *channels = cmd->request.channels;
 
 	// this will be updated and written back to the device state
 	// if the update succeeds
@@ -656,13 +1845,7 @@ void handleEnableChannels(struct m_command *cmd) {
  * \brief Handles the JSON "disable-channels" command.
  */
 void handleDisableChannels(struct m_command *cmd) {
-	json_t *jChannels = json_object_get(cmd->jsonMessage, "channels");
-	if(! json_is_string(jChannels)) {
-		replyWithPropertyError(cmd, "channels");
-		return;
-	}
-
-	char *channels = (char *) json_string_value(jChannels);
+	char *channels = cmd->request.channels;
 
 	// this will be updated and written back to the device state
 	// if the update succeeds
@@ -714,13 +1897,7 @@ void handleDisableChannels(struct m_command *cmd) {
  * \brief Handles the JSON "inhibit-channels" command.
  */
 void handleInhibitChannels(struct m_command *cmd) {
-	json_t *jChannels = json_object_get(cmd->jsonMessage, "channels");
-	if(! json_is_string(jChannels)) {
-		replyWithPropertyError(cmd, "channels");
-		return;
-	}
-
-	char *channels = (char *) json_string_value(jChannels);
+	char *channels = cmd->request.channels;
 
 	unsigned char lowChannels = 0xFF;
 	unsigned char highChannels = 0xFF;
@@ -772,20 +1949,8 @@ void handleDisable(struct m_command *cmd) {
  * \brief Handles the JSON "set-denomination-levels" command.
  */
 void handleSetDenominationLevels(struct m_command *cmd) {
-	json_t *jLevel = json_object_get(cmd->jsonMessage, "level");
-	if(! json_is_integer(jLevel)) {
-		replyWithPropertyError(cmd, "level");
-		return;
-	}
-
-	json_t *jAmount = json_object_get(cmd->jsonMessage, "amount");
-	if(! json_is_integer(jAmount)) {
-		replyWithPropertyError(cmd, "amount");
-		return;
-	}
-
-	int level = json_integer_value(jLevel);
-	int amount = json_integer_value(jAmount);
+	int level = cmd->request.level;
+	int amount = cmd->request.amount;
 
 	if(level > 0) {
 		/* Quote from the spec -.-
@@ -804,41 +1969,59 @@ void handleSetDenominationLevels(struct m_command *cmd) {
 		mc_ssp_set_denomination_level(&cmd->device->sspC, amount, 0, CURRENCY);
 	}
 
-	replyWithSspResponse(cmd, mc_ssp_set_denomination_level(&cmd->device->sspC, amount, level, CURRENCY));
+	SSP_RESPONSE_ENUM resp = mc_ssp_set_denomination_level(&cmd->device->sspC, amount, level, CURRENCY);
+	if(resp == SSP_RESPONSE_OK) {
+		levelsSet(&cmd->device->levels, amount, CURRENCY, level);
+	} else {
+		cmd->device->levels.valid = 0;
+	}
+
+	replyWithSspResponse(cmd, resp);
 }
 
 /**
  * \brief Handles the JSON "get-all-levels" command.
  */
 void handleGetAllLevels(struct m_command *cmd) {
-	char *json = NULL;
+	char *source = "cache";
 
-	SSP_RESPONSE_ENUM resp = mc_ssp_get_all_levels(&cmd->device->sspC, &json);
-
-	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"levels\":[%s]}", cmd->correlId, json);
-	} else {
-		replyWithSspResponse(cmd, resp);
+	if(! isLevelsCached(cmd)) {
+		SSP_RESPONSE_ENUM resp = levelsRefresh(cmd->device);
+		if(resp != SSP_RESPONSE_OK) {
+			replyWithSspResponse(cmd, resp);
+			return;
+		}
+		source = "device";
 	}
 
-	free(json);
+	char storage[REPLY_BUFFER_SIZE];
+	struct buffer json;
+	bufferInit(&json, storage, sizeof(storage));
+
+	levelsToJson(&cmd->device->levels, &json);
+
+	replyToCommand(cmd, REPLY_CORRELID, "\"levels\":[%s],\"source\":\"%s\"}", json.data, source);
+
+	bufferFree(&json);
 }
 
 /**
  * \brief Handles the JSON "cashbox-payout-operation-data" command.
  */
 void handleCashboxPayoutOperationData(struct m_command *cmd) {
-	char *json = NULL;
+	char storage[REPLY_BUFFER_SIZE];
+	struct buffer json;
+	bufferInit(&json, storage, sizeof(storage));
 
 	SSP_RESPONSE_ENUM resp = mc_ssp_cashbox_payout_operation_data(&cmd->device->sspC, &json);
 
 	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"levels\":[%s]}", cmd->correlId, json);
+		replyToCommand(cmd, REPLY_CORRELID, "\"levels\":[%s]}", json.data);
 	} else {
 		replyWithSspResponse(cmd, resp);
 	}
 
-	free(json);
+	bufferFree(&json);
 }
 
 
@@ -846,12 +2029,10 @@ void handleCashboxPayoutOperationData(struct m_command *cmd) {
  * \brief Handles the JSON "get-firmware-version" command.
  */
 void handleGetFirmwareVersion(struct m_command *cmd) {
-	char firmwareVersion[100] = { 0 };
-
-	SSP_RESPONSE_ENUM resp = mc_ssp_get_firmware_version(&cmd->device->sspC, &firmwareVersion[0]);
+	SSP_RESPONSE_ENUM resp = deviceInfoEnsure(cmd->device);
 
 	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"version\":\"%s\"}", cmd->correlId, firmwareVersion);
+		replyToCommand(cmd, REPLY_CORRELID, "\"version\":\"%s\"}", cmd->device->info.firmwareVersion);
 	} else {
 		replyWithSspResponse(cmd, resp);
 	}
@@ -861,18 +2042,54 @@ void handleGetFirmwareVersion(struct m_command *cmd) {
  * \brief Handles the JSON "get-dataset-version" command.
  */
 void handleGetDatasetVersion(struct m_command *cmd) {
-	char datasetVersion[100] = { 0 };
-
-	SSP_RESPONSE_ENUM resp = mc_ssp_get_dataset_version(&cmd->device->sspC, &datasetVersion[0]);
+	SSP_RESPONSE_ENUM resp = deviceInfoEnsure(cmd->device);
 
 	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"version\":\"%s\"}",
-				cmd->correlId, datasetVersion);
+		replyToCommand(cmd, REPLY_CORRELID, "\"version\":\"%s\"}", cmd->device->info.datasetVersion);
 	} else {
 		replyWithSspResponse(cmd, resp);
 	}
 }
 
+/**
+ * \brief Handles the JSON "get-device-info" command.
+ * \details Answered from the m_device_info (and m_device.sspSetupReq), the hardware is only
+ * asked if the cache has been invalidated.
+ */
+void handleGetDeviceInfo(struct m_command *cmd) {
+	SSP_RESPONSE_ENUM resp = deviceInfoEnsure(cmd->device);
+	if(resp != SSP_RESPONSE_OK) {
+		replyWithSspResponse(cmd, resp);
+		return;
+	}
+
+	struct m_device_info *info = &cmd->device->info;
+	SSP6_SETUP_REQUEST_DATA *setup = &cmd->device->sspSetupReq;
+
+	char storage[REPLY_BUFFER_SIZE];
+	struct buffer channels;
+	bufferInit(&channels, storage, sizeof(storage));
+
+	for(unsigned int i = 0; i < setup->NumberOfChannels; i++) {
+		bufferAppendString(&channels, i > 0 ? ",{\"channel\":" : "{\"channel\":");
+		bufferAppendUnsigned(&channels, i + 1);
+		bufferAppendString(&channels, ",\"value\":");
+		bufferAppendUnsigned(&channels, setup->ChannelData[i].value);
+		bufferAppendString(&channels, ",\"cc\":");
+		bufferAppendJsonString(&channels, setup->ChannelData[i].cc);
+		bufferAppendChar(&channels, '}');
+	}
+
+	replyToCommand(cmd, REPLY_MSGID_CORRELID, "\"device\":\"%s\",\"unitType\":%u,"
+			"\"firmwareVersion\":\"%s\",\"datasetVersion\":\"%s\",\"protocolVersion\":%u,"
+			"\"serialNumber\":%lu,\"valueMultiplier\":%lu,\"channels\":[%s]}",
+			cmd->device->name, setup->UnitType,
+			info->firmwareVersion, info->datasetVersion, setup->ProtocolVersion,
+			info->serialNumber, setup->RealValueMultiplier, channels.data);
+
+	bufferFree(&channels);
+}
+
 /**
  * \brief Handles the JSON "last-reject-note" command.
  */
@@ -977,68 +2194,1248 @@ void handleLastRejectNote(struct m_command *cmd) {
 			break;
 		}
 
-		replyWith(cmd->responseTopic,
-				"{\"correlId\":\"%s\",\"reason\":\"%s\",\"code\":%ld}",
-				cmd->correlId, reason, reasonCode);
+		replyToCommand(cmd, REPLY_CORRELID,
+				"\"reason\":\"%s\",\"code\":%ld}", reason, reasonCode);
 	} else {
 		replyWithSspResponse(cmd, resp);
 	}
 }
 
 /**
- * \brief Handles the JSON "channel-security" command.
+ * \brief Handles the JSON "channel-security" command.
+ */
+void handleChannelSecurityData(struct m_command *cmd) {
+	mc_ssp_channel_security_data(&cmd->device->sspC);
+}
+
+/**
+ * \brief Handles the JSON "test" command
+ */
+void handleTest(struct m_command *cmd) {
+	replyWithSspResponse(cmd, SSP_RESPONSE_OK);
+}
+
+/**
+ * \brief Handles the JSON "get-stats" command.
+ * \details Replies with the SSP round-trip time percentiles (in microseconds) per SSP command
+ * and the error counters of the device.
+ */
+void handleGetStats(struct m_command *cmd) {
+	struct m_ssp_stats *stats = &cmd->device->stats;
+
+	char storage[REPLY_BUFFER_SIZE];
+	struct buffer result;
+	bufferInit(&result, storage, sizeof(storage));
+
+	// response code counters, only those actually received
+	bufferAppendString(&result, "\"responses\":{");
+	int first = 1;
+	for (int i = 0; i < 16; i++) {
+		if (stats->responses[i] == 0) {
+			continue;
+		}
+
+		if(! first) {
+			bufferAppendChar(&result, ',');
+		}
+		char *name = sspResponseToString((SSP_RESPONSE_ENUM) (0xF0 | i));
+		if (strcmp(name, "unknown") == 0) {
+			bufferAppendFormat(&result, "\"0x%02X\"", 0xF0 | i);
+		} else {
+			bufferAppendJsonString(&result, name);
+		}
+		bufferAppendChar(&result, ':');
+		bufferAppendUnsigned(&result, stats->responses[i]);
+		first = 0;
+	}
+	bufferAppendString(&result, "},\"commands\":[");
+
+	// latency percentiles per ssp command
+	for (unsigned int i = 0; i < stats->usedSlots; i++) {
+		struct histogram *h = &stats->latency[i];
+
+		bufferAppendFormat(&result, "%s{\"cmd\":\"0x%02X\",\"count\":", i > 0 ? "," : "", stats->commandOfSlot[i]);
+		bufferAppendUnsigned(&result, h->count);
+		bufferAppendString(&result, ",\"p50\":");
+		bufferAppendUnsigned(&result, histogramPercentile(h, 50.0));
+		bufferAppendString(&result, ",\"p90\":");
+		bufferAppendUnsigned(&result, histogramPercentile(h, 90.0));
+		bufferAppendString(&result, ",\"p99\":");
+		bufferAppendUnsigned(&result, histogramPercentile(h, 99.0));
+		bufferAppendString(&result, ",\"max\":");
+		bufferAppendUnsigned(&result, h->max);
+		bufferAppendChar(&result, '}');
+	}
+	bufferAppendString(&result, "],\"dispatched\":{");
+	appendDispatchCounters(&result, cmd->device);
+	bufferAppendChar(&result, '}');
+
+	replyToCommand(cmd, REPLY_MSGID_CORRELID,
+			"\"device\":\"%s\",\"timeouts\":%llu,\"retries\":%llu,"
+			"\"packetErrors\":%llu,\"portErrors\":%llu,\"otherResponses\":%llu,\"untracked\":%llu,"
+			"\"levelDrifts\":%llu,\"redis\":{\"reconnects\":%llu,\"buffered\":%llu,\"dropped\":%llu,\"spooled\":%llu},\"requests\":{\"expired\":%llu,\"rejected\":%llu,\"duplicates\":%llu,\"coalesced\":%llu,\"queued\":%u},%s}",
+			cmd->device->name,
+			stats->timeouts, stats->retries, stats->packetErrors, stats->portErrors,
+			stats->otherResponses, stats->untracked, cmd->device->levels.drifts,
+			publishLink.reconnects + subscribeLink.reconnects + streamLink.reconnects,
+			outbound.buffered, outbound.dropped, eventSpool.lastSeq - eventSpool.acked,
+			cmd->device->requestsExpired, cmd->device->requestsRejected, cmd->device->requestsDuplicated,
+			cmd->device->requestsCoalesced, cmd->metacash->queue.length,
+			result.data);
+
+	bufferFree(&result);
+}
+
+/**
+ * \brief Handles the JSON "configure-bezel" command.
+ */
+void handleConfigureBezel(struct m_command *cmd) {
+	unsigned char r = cmd->request.r;
+	unsigned char g = cmd->request.g;
+	unsigned char b = cmd->request.b;
+	unsigned char type = cmd->request.type;
+
+	replyWithSspResponse(cmd,
+			mc_ssp_configure_bezel(&cmd->device->sspC, r, g, b, SSP_OPTION_NON_VOLATILE, type));
+}
+
+/**
+ * \brief Test if executing the command will talk to the hardware (and so has to respect the wait time).
+ */
+int usesHardware(struct m_command *cmd) {
+	if (cmd->def->needsHardware == NEEDS_HARDWARE_UNLESS_CACHED) {
+		return ! cmd->def->isCachedFn(cmd);
+	}
+	return cmd->def->needsHardware;
+}
+
+/**
+ * \brief Test if the m_device_info of the device can be used.
+ */
+int isDeviceInfoCached(struct m_command *cmd) {
+	return cmd->device->info.valid;
+}
+
+/**
+ * \brief Test if get-all-levels can be answered from the m_levels of the device.
+ */
+int isLevelsCached(struct m_command *cmd) {
+	int fromDevice = (cmd->request.valid & REQUEST_SOURCE) && strcmp(cmd->request.source, "device") == 0;
+	return cmd->device->levels.valid && ! fromDevice;
+}
+
+/**
+ * \brief Checks a step of a batch before anything is executed. Returns NULL if the step is
+ * valid, otherwise the reason why it isn't.
+ */
+static char *checkBatchStep(struct m_command *cmd, json_t *jStep, const struct m_command_def **def,
+		struct request *request) {
+	if(! json_is_object(jStep)) {
+		return "not an object";
+	}
+
+	requestFromJson(jStep, request);
+	if(! (request->valid & REQUEST_CMD)) {
+		return "property 'cmd' missing or of wrong type";
+	}
+
+	*def = findCommand(request->cmd);
+	if(*def == NULL) {
+		return "unknown command";
+	}
+	if((*def)->handlerFn == handleBatch) {
+		return "nested batch";
+	}
+	if(! ((*def)->devices & cmd->device->type)) {
+		return "unsupported command";
+	}
+	if(findPropertyError(*def, request)) {
+		return "property missing or of wrong type";
+	}
+	if((*def)->needsHardware && ! cmd->metacash->deviceAvailable) {
+		return "hardware unavailable";
+	}
+	return NULL;
+}
+
+/**
+ * \brief Handles the JSON "batch" command.
+ * \details Executes the commands in 'steps' back to back with only the minimum gap
+ * between the SSP frames and replies with the replies of all executed steps. All steps are
+ * checked before the first one is executed. With 'onError' "stop" (default) the batch ends
+ * with the first failed step, with "continue" all steps are executed. A step which would use
+ * the hardware after the deadline of the batch has passed ends the batch with an "expired" step.
+ */
+void handleBatch(struct m_command *cmd) {
+	// "steps" is not one of the known properties, so the message has been parsed by jansson
+	json_t *jSteps = json_object_get(cmd->jsonMessage, "steps");
+	if(! json_is_array(jSteps)) {
+		replyWithPropertyError(cmd, "steps");
+		return;
+	}
+	size_t count = json_array_size(jSteps);
+
+	int stopOnError = 1;
+	json_t *jOnError = json_object_get(cmd->jsonMessage, "onError");
+	if(jOnError) {
+		if(json_is_string(jOnError) && strcmp(json_string_value(jOnError), "continue") == 0) {
+			stopOnError = 0;
+		} else if(! json_is_string(jOnError) || strcmp(json_string_value(jOnError), "stop") != 0) {
+			replyWithPropertyError(cmd, "onError");
+			return;
+		}
+	}
+
+	if(count == 0 || count > BATCH_MAX_STEPS) {
+		replyToCommand(cmd, REPLY_MSGID_CORRELID, "\"error\":\"invalid number of steps\",\"max\":%d}",
+				BATCH_MAX_STEPS);
+		return;
+	}
+
+	const struct m_command_def *defs[BATCH_MAX_STEPS];
+	struct request requests[BATCH_MAX_STEPS];
+	for(size_t i = 0; i < count; i++) {
+		char *reason = checkBatchStep(cmd, json_array_get(jSteps, i), &defs[i], &requests[i]);
+		if(reason) {
+			replyToCommand(cmd, REPLY_MSGID_CORRELID, "\"error\":\"invalid step\",\"step\":%zu,\"reason\":\"%s\"}",
+					i, reason);
+			return;
+		}
+	}
+
+	char storage[REPLY_BUFFER_SIZE];
+	struct buffer results;
+	bufferInit(&results, storage, sizeof(storage));
+
+	int failed = 0;
+	int hardwareUsed = 0;
+	size_t executed = 0;
+
+	for(size_t i = 0; i < count; i++) {
+		char *captured = NULL;
+
+		struct m_command step = *cmd;
+		step.jsonMessage = json_array_get(jSteps, i); // borrowed, released with the batch
+		step.request = requests[i];
+		step.command = step.request.cmd;
+		step.def = defs[i];
+		step.capture = &captured;
+		step.failed = 0;
+		step.next = NULL;
+
+		if(i > 0) {
+			bufferAppendChar(&results, ',');
+		}
+
+		if(usesHardware(&step)) {
+			// the usual wait time before the first SSP command, only the frame gap afterwards
+			if(hardwareUsed) {
+				hardwareFrameGap();
+			} else {
+				hardwareWaitTime();
+			}
+			hardwareUsed = 1;
+
+			if(isExpired(cmd)) {
+				syslog(LOG_WARNING, "batch from msgId='%s' stopped at step %zu, deadline has passed\n", cmd->correlId, i);
+				bufferAppendFormat(&results, "{\"cmd\":\"%s\",\"error\":\"expired\"}", step.command);
+				failed = 1;
+				break;
+			}
+		}
+
+		dispatchCommand(cmd->metacash, &step);
+		executed++;
+
+		if(captured) {
+			bufferAppendString(&results, captured);
+		} else {
+			// the command did not reply (e.g. channel-security)
+			bufferAppendString(&results, "null");
+		}
+		free(captured);
+
+		if(step.failed) {
+			failed = 1;
+		}
+
+		if(failed && stopOnError) {
+			break;
+		}
+	}
+
+	replyToCommand(cmd, REPLY_MSGID_CORRELID, "\"result\":\"%s\",\"executed\":%zu,\"steps\":[%s]}",
+			failed ? "failed" : "ok", executed, results.data);
+
+	bufferFree(&results);
+}
+
+/**
+ * \brief All commands supported by payoutd, sorted by name (checked by checkCommandRegistry()).
+ * \details Looked up with findCommand(). The mandatory properties are validated before the
+ * command is queued, so the handler functions can rely on them. Fields which are left out of an
+ * entry are 0 (no properties, no option, not cached, not coalescible).
+ */
+static const struct m_command_def COMMAND_REGISTRY[] = {
+	{ .name = "batch", .handlerFn = handleBatch,
+			.needsHardware = 0, .devices = DEVICE_ANY, .priority = PRIORITY_OPERATION },
+	{ .name = "cashbox-payout-operation-data", .handlerFn = handleCashboxPayoutOperationData,
+			.needsHardware = 1, .devices = DEVICE_ANY, .priority = PRIORITY_QUERY, .coalescible = 1 },
+	// the name used in the documentation and in sh/channel-security.sh
+	{ .name = "channel-security", .handlerFn = handleChannelSecurityData,
+			.needsHardware = 1, .devices = DEVICE_VALIDATOR, .priority = PRIORITY_QUERY, .coalescible = 1 },
+	{ .name = "channel-security-data", .handlerFn = handleChannelSecurityData,
+			.needsHardware = 1, .devices = DEVICE_VALIDATOR, .priority = PRIORITY_QUERY, .coalescible = 1 },
+	{ .name = "configure-bezel", .handlerFn = handleConfigureBezel,
+			.properties = REQUEST_R | REQUEST_G | REQUEST_B | REQUEST_TYPE,
+			.needsHardware = 1, .devices = DEVICE_VALIDATOR, .priority = PRIORITY_OPERATION },
+	{ .name = "disable", .handlerFn = handleDisable,
+			.needsHardware = 1, .devices = DEVICE_ANY, .priority = PRIORITY_OPERATION },
+	{ .name = "disable-channels", .handlerFn = handleDisableChannels,
+			.properties = REQUEST_CHANNELS,
+			.needsHardware = 1, .devices = DEVICE_VALIDATOR, .priority = PRIORITY_OPERATION },
+	{ .name = "do-float", .handlerFn = handleFloat,
+			.properties = REQUEST_AMOUNT,
+			.needsHardware = 1, .devices = DEVICE_ANY, .priority = PRIORITY_OPERATION, .option = SSP6_OPTION_BYTE_DO },
+	{ .name = "do-payout", .handlerFn = handlePayout,
+			.properties = REQUEST_AMOUNT,
+			.needsHardware = 1, .devices = DEVICE_ANY, .priority = PRIORITY_OPERATION, .option = SSP6_OPTION_BYTE_DO },
+	{ .name = "empty", .handlerFn = handleEmpty,
+			.needsHardware = 1, .devices = DEVICE_ANY, .priority = PRIORITY_OPERATION },
+	{ .name = "enable", .handlerFn = handleEnable,
+			.needsHardware = 1, .devices = DEVICE_ANY, .priority = PRIORITY_OPERATION },
+	{ .name = "enable-channels", .handlerFn = handleEnableChannels,
+			.properties = REQUEST_CHANNELS,
+			.needsHardware = 1, .devices = DEVICE_VALIDATOR, .priority = PRIORITY_OPERATION },
+	{ .name = "get-all-levels", .handlerFn = handleGetAllLevels,
+			.optional = REQUEST_SOURCE,
+			.needsHardware = NEEDS_HARDWARE_UNLESS_CACHED, .devices = DEVICE_ANY, .priority = PRIORITY_QUERY,
+			.isCachedFn = isLevelsCached, .coalescible = 1 },
+	{ .name = "get-dataset-version", .handlerFn = handleGetDatasetVersion,
+			.needsHardware = NEEDS_HARDWARE_UNLESS_CACHED, .devices = DEVICE_ANY, .priority = PRIORITY_QUERY,
+			.isCachedFn = isDeviceInfoCached, .coalescible = 1 },
+	{ .name = "get-device-info", .handlerFn = handleGetDeviceInfo,
+			.needsHardware = NEEDS_HARDWARE_UNLESS_CACHED, .devices = DEVICE_ANY, .priority = PRIORITY_QUERY,
+			.isCachedFn = isDeviceInfoCached, .coalescible = 1 },
+	{ .name = "get-firmware-version", .handlerFn = handleGetFirmwareVersion,
+			.needsHardware = NEEDS_HARDWARE_UNLESS_CACHED, .devices = DEVICE_ANY, .priority = PRIORITY_QUERY,
+			.isCachedFn = isDeviceInfoCached, .coalescible = 1 },
+	{ .name = "get-stats", .handlerFn = handleGetStats,
+			.needsHardware = 0, .devices = DEVICE_ANY, .priority = PRIORITY_CONTROL },
+	{ .name = "inhibit-channels", .handlerFn = handleInhibitChannels,
+			.properties = REQUEST_CHANNELS,
+			.needsHardware = 1, .devices = DEVICE_VALIDATOR, .priority = PRIORITY_OPERATION },
+	{ .name = "last-reject-note", .handlerFn = handleLastRejectNote,
+			.needsHardware = 1, .devices = DEVICE_VALIDATOR, .priority = PRIORITY_QUERY, .coalescible = 1 },
+	{ .name = "quit", .handlerFn = handleQuit,
+			.needsHardware = 0, .devices = DEVICE_ANY, .priority = PRIORITY_CONTROL },
+	{ .name = "set-denomination-level", .handlerFn = handleSetDenominationLevels,
+			.properties = REQUEST_LEVEL | REQUEST_AMOUNT,
+			.needsHardware = 1, .devices = DEVICE_ANY, .priority = PRIORITY_OPERATION },
+	{ .name = "smart-empty", .handlerFn = handleSmartEmpty,
+			.needsHardware = 1, .devices = DEVICE_ANY, .priority = PRIORITY_OPERATION },
+	{ .name = "test", .handlerFn = handleTest,
+			.needsHardware = 0, .devices = DEVICE_ANY, .priority = PRIORITY_CONTROL },
+	{ .name = "test-float", .handlerFn = handleFloat,
+			.properties = REQUEST_AMOUNT,
+			.needsHardware = 1, .devices = DEVICE_ANY, .priority = PRIORITY_OPERATION, .option = SSP6_OPTION_BYTE_TEST },
+	{ .name = "test-payout", .handlerFn = handlePayout,
+			.properties = REQUEST_AMOUNT,
+			.needsHardware = 1, .devices = DEVICE_ANY, .priority = PRIORITY_OPERATION, .option = SSP6_OPTION_BYTE_TEST },
+};
+
+/** \brief Number of entries in the COMMAND_REGISTRY */
+#define COMMAND_REGISTRY_SIZE (sizeof(COMMAND_REGISTRY) / sizeof(COMMAND_REGISTRY[0]))
+
+_Static_assert(sizeof(COMMAND_REGISTRY) / sizeof(COMMAND_REGISTRY[0]) <= COMMAND_REGISTRY_MAX,
+		"COMMAND_REGISTRY_MAX is too small");
+
+/**
+ * \brief Compares a command name (key) with an entry of the COMMAND_REGISTRY, used by bsearch().
+ */
+static int compareCommandName(const void *key, const void *entry) {
+	return strcmp(key, ((const struct m_command_def *) entry)->name);
+}
+
+/**
+ * \brief Looks up the command in the COMMAND_REGISTRY. Returns NULL for an unknown command.
+ */
+const struct m_command_def *findCommand(const char *name) {
+	return bsearch(name, COMMAND_REGISTRY, COMMAND_REGISTRY_SIZE, sizeof(COMMAND_REGISTRY[0]),
+			compareCommandName);
+}
+
+/**
+ * \brief Appends the dispatch counters of the device as "name":count pairs (only the commands
+ * which have actually been dispatched).
+ */
+void appendDispatchCounters(struct buffer *b, struct m_device *device) {
+	int first = 1;
+
+	for (unsigned int i = 0; i < COMMAND_REGISTRY_SIZE; i++) {
+		if (device->dispatched[i] == 0) {
+			continue;
+		}
+
+		if (! first) {
+			bufferAppendChar(b, ',');
+		}
+		bufferAppendJsonString(b, COMMAND_REGISTRY[i].name);
+		bufferAppendChar(b, ':');
+		bufferAppendUnsigned(b, device->dispatched[i]);
+		first = 0;
+	}
+}
+
+/**
+ * \brief Checks the mandatory properties and the optional ones which are present. Returns NULL
+ * if all of them are of the right type (and value), otherwise the name of the first invalid one.
+ */
+char *findPropertyError(const struct m_command_def *def, struct request *request) {
+	unsigned int invalid = (def->properties & ~request->valid)
+			| (def->optional & request->present & ~request->valid);
+
+	// 'source' is either "cache" or "device"
+	if ((def->optional & request->valid & REQUEST_SOURCE)
+			&& strcmp(request->source, "cache") != 0 && strcmp(request->source, "device") != 0) {
+		invalid |= REQUEST_SOURCE;
+	}
+
+	if (invalid == 0) {
+		return NULL;
+	}
+
+	// lowest invalid bit
+	return (char *) requestFieldName(invalid & -invalid);
+}
+
+/**
+ * \brief Verifies that the COMMAND_REGISTRY is sorted, otherwise findCommand() would miss entries.
+ * Returns 0 if it is.
+ */
+int checkCommandRegistry() {
+	for (unsigned int i = 1; i < COMMAND_REGISTRY_SIZE; i++) {
+		if (strcmp(COMMAND_REGISTRY[i - 1].name, COMMAND_REGISTRY[i].name) >= 0) {
+			syslog(LOG_ERR, "command registry is not sorted at cmd='%s'\n", COMMAND_REGISTRY[i].name);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * \brief Writes a new msgId to msgId (MSGID_SIZE bytes).
+ */
+void generateMsgId(struct m_metacash *m, char *msgId) {
+	if (m->useLibuuid) {
+		uuid_t uuid;
+		uuid_generate_time_safe(uuid);
+		uuid_unparse_lower(uuid, msgId); // ex. "1b4e28ba-2fa1-11d2-883f-0016d3cca427" + "\0"
+	} else {
+		msgIdGenerate(&m->msgIds, msgId); // ex. "0190b7e2-51a4-7000-8123-456789abcdef" + "\0"
+	}
+}
+
+/**
+ * \brief Returns the current wall clock time in milliseconds since the epoch.
+ */
+long long currentTimeMillis() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief Prepares the request queue (all commands in the free list, nothing queued).
+ */
+void requestQueueInit(struct m_request_queue *queue) {
+	queue->free = NULL;
+	for (int i = REQUEST_QUEUE_SIZE - 1; i >= 0; i--) {
+		arenaInit(&queue->arenas[i], REQUEST_ARENA_SIZE);
+		queue->pool[i].arena = &queue->arenas[i];
+		queue->pool[i].next = queue->free;
+		queue->free = &queue->pool[i];
+	}
+	for (int i = 0; i < PRIORITY_CLASSES; i++) {
+		queue->head[i] = NULL;
+		queue->tail[i] = NULL;
+	}
+	queue->length = 0;
+	queue->available = REQUEST_QUEUE_SIZE;
+}
+
+/**
+ * \brief Copies the command into an unused command of the pool. Returns NULL if the pool is exhausted.
+ */
+struct m_command *requestQueueTake(struct m_request_queue *queue, struct m_command *cmd) {
+	struct m_command *queued = queue->free;
+	if (queued == NULL) {
+		return NULL;
+	}
+	queue->free = queued->next;
+	queue->available--;
+
+	// the arena belongs to the slot, cmd was parsed into it (see processRequest())
+	struct arena *arena = queued->arena;
+	*queued = *cmd;
+	queued->arena = arena;
+	queued->next = NULL;
+	queued->joined = NULL;
+	// point into the copy
+	queued->correlId = queued->request.msgId;
+	queued->command = queued->request.cmd;
+
+	return queued;
+}
+
+/**
+ * \brief Copies the command to the end of the queue of its priority class. Returns 0 if the queue is full.
+ */
+int requestQueuePush(struct m_request_queue *queue, struct m_command *cmd) {
+	struct m_command *queued = requestQueueTake(queue, cmd);
+	if (queued == NULL) {
+		return 0;
+	}
+
+	enum m_priority priority = cmd->def->priority;
+	if (queue->tail[priority]) {
+		queue->tail[priority]->next = queued;
+	} else {
+		queue->head[priority] = queued;
+	}
+	queue->tail[priority] = queued;
+	queue->length++;
+
+	return 1;
+}
+
+/**
+ * \brief Test if two requests would result in the same response (apart from msgId and correlId).
+ */
+int isSameRequest(struct m_command *a, struct m_command *b) {
+	const unsigned int ignored = REQUEST_MSGID | REQUEST_CMD | REQUEST_DEADLINE | REQUEST_TTL;
+	const struct request *ra = &a->request;
+	const struct request *rb = &b->request;
+
+	// aliases (e.g. channel-security) share the handler
+	if (a->device != b->device || a->def->handlerFn != b->def->handlerFn || a->def->option != b->def->option) {
+		return 0;
+	}
+	if ((ra->present & ~ignored) != (rb->present & ~ignored) || (ra->valid & ~ignored) != (rb->valid & ~ignored)) {
+		return 0;
+	}
+
+	// only the valid properties have a value (the same ones for both here)
+	unsigned int valid = ra->valid & ~ignored;
+	return (! (valid & REQUEST_AMOUNT) || ra->amount == rb->amount)
+			&& (! (valid & REQUEST_LEVEL) || ra->level == rb->level)
+			&& (! (valid & REQUEST_R) || ra->r == rb->r)
+			&& (! (valid & REQUEST_G) || ra->g == rb->g)
+			&& (! (valid & REQUEST_B) || ra->b == rb->b)
+			&& (! (valid & REQUEST_TYPE) || ra->type == rb->type)
+			&& (! (valid & REQUEST_CHANNELS) || strcmp(ra->channels, rb->channels) == 0)
+			&& (! (valid & REQUEST_SOURCE) || strcmp(ra->source, rb->source) == 0);
+}
+
+/**
+ * \brief Lets a coalescible command join an identical queued one, which then replies to both.
+ * Returns 1 if the command has been joined.
+ * \details A command only joins one which doesn't expire earlier, so the joined commands
+ * never outlive the command which answers them.
+ */
+int requestQueueJoin(struct m_request_queue *queue, struct m_command *cmd) {
+	if (! cmd->def->coalescible) {
+		return 0;
+	}
+
+	for (struct m_command *queued = queue->head[cmd->def->priority]; queued; queued = queued->next) {
+		if (! isSameRequest(queued, cmd)) {
+			continue;
+		}
+		if (queued->deadline != 0 && (cmd->deadline == 0 || cmd->deadline > queued->deadline)) {
+			continue;
+		}
+
+		struct m_command *joined = requestQueueTake(queue, cmd);
+		if (joined == NULL) {
+			return 0;
+		}
+		joined->next = queued->joined;
+		queued->joined = joined;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Removes the oldest command of the most important non empty priority class from the queue.
+ * The caller has to give it back with requestQueueRelease() after it has been executed.
+ */
+struct m_command *requestQueuePop(struct m_request_queue *queue) {
+	for (int i = 0; i < PRIORITY_CLASSES; i++) {
+		struct m_command *cmd = queue->head[i];
+		if (cmd) {
+			queue->head[i] = cmd->next;
+			if (queue->head[i] == NULL) {
+				queue->tail[i] = NULL;
+			}
+			queue->length--;
+			return cmd;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * \brief Returns a command obtained by requestQueuePop() (and the commands joined to it) to the free list.
+ */
+void requestQueueRelease(struct m_request_queue *queue, struct m_command *cmd) {
+	struct m_command *joined = cmd->joined;
+	while (joined) {
+		struct m_command *next = joined->next;
+		json_decref(joined->jsonMessage);
+		joined->jsonMessage = NULL;
+		arenaReset(joined->arena);
+		joined->next = queue->free;
+		queue->free = joined;
+		queue->available++;
+		joined = next;
+	}
+	cmd->joined = NULL;
+
+	json_decref(cmd->jsonMessage);
+	cmd->jsonMessage = NULL;
+	arenaReset(cmd->arena);
+	cmd->next = queue->free;
+	queue->free = cmd;
+	queue->available++;
+}
+
+/**
+ * \brief Lets libevent run the dispatcher as soon as possible.
+ */
+void scheduleDispatch(struct m_metacash *metacash) {
+	struct timeval immediately = { 0, 0 };
+	evtimer_add(&metacash->evDispatch, &immediately);
+}
+
+/**
+ * \brief Test if the deadline of the command has passed.
+ */
+int isExpired(struct m_command *cmd) {
+	return cmd->deadline != 0 && currentTimeMillis() > cmd->deadline;
+}
+
+/**
+ * \brief Removes a command which has not been executed from the idempotency cache.
+ */
+void idempotencyRelease(struct m_command *cmd) {
+	if (cmd->idempotencyKey[0]) {
+		idempotencyForget(&cmd->metacash->idempotency, cmd->idempotencyKey);
+		cmd->idempotencyKey[0] = 0;
+	}
+}
+
+/**
+ * \brief Publishes the "expired" response for a command which has not been executed in time.
+ */
+void replyWithExpired(struct m_command *cmd) {
+	cmd->device->requestsExpired++;
+	for (struct m_command *joined = cmd->joined; joined; joined = joined->next) {
+		cmd->device->requestsExpired++;
+	}
+
+	// not executed, so a republished request may be executed after all
+	idempotencyRelease(cmd);
+
+	syslog(LOG_WARNING, "dropping cmd='%s' from msgId='%s', deadline has passed\n", cmd->command, cmd->correlId);
+	replyToCommand(cmd, REPLY_MSGID_CORRELID, "\"error\":\"expired\"}");
+}
+
+/**
+ * \brief Answers a command which won't be executed anymore with a "shutting down" response.
+ * \details A command read from a request stream is neither answered nor acknowledged, the
+ * entry stays pending and is claimed again after the restart.
+ */
+void discardCommand(struct m_command *cmd) {
+	syslog(LOG_WARNING, "discarding queued cmd='%s' from msgId='%s'\n", cmd->command, cmd->correlId);
+	if (cmd->streamId[0]) {
+		return;
+	}
+	replyWith(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"shutting down\"}",
+			cmd->msgId, cmd->correlId);
+}
+
+/**
+ * \brief Discards all queued commands (see discardCommand()), they won't be executed anymore.
+ */
+void discardQueuedCommands(struct m_metacash *m) {
+	struct m_command *cmd;
+	while ((cmd = requestQueuePop(&m->queue)) != NULL) {
+		// not executed, so a republished request may be executed after the restart
+		idempotencyRelease(cmd);
+
+		discardCommand(cmd);
+		for (struct m_command *joined = cmd->joined; joined; joined = joined->next) {
+			discardCommand(joined);
+		}
+
+		requestQueueRelease(&m->queue, cmd);
+	}
+}
+
+/**
+ * \brief Dispatches the command to the command handler function from the COMMAND_REGISTRY.
+ * \details Details only to get graph.
+ * \callgraph
+ */
+void dispatchCommand(struct m_metacash *m, struct m_command *cmd) {
+	syslog(LOG_INFO, "processing cmd='%s' from msgId='%s' for device='%s'\n",
+			cmd->command, cmd->correlId, cmd->device->name);
+
+	cmd->device->dispatched[cmd->def - COMMAND_REGISTRY]++;
+	cmd->def->handlerFn(cmd);
+}
+
+/**
+ * \brief Callback function for the libEvent triggered "Dispatch" event, executes the
+ * oldest queued command of the most important priority class.
+ * \details Only one command is executed per call, so that libevent gets the chance to
+ * read further requests from redis (and to poll the hardware) in between. Commands whose
+ * deadline has passed are answered with an "expired" response without touching the hardware.
+ * \callgraph
+ */
+void cbOnDispatchEvent(int fd, short event, void *privdata) {
+	struct m_metacash *m = privdata;
+
+	struct m_command *cmd = requestQueuePop(&m->queue);
+	if (cmd == NULL) {
+		return;
+	}
+
+	if (isExpired(cmd)) {
+		replyWithExpired(cmd);
+	} else {
+		if (usesHardware(cmd)) {
+			hardwareWaitTime();
+		}
+
+		// check again right before the command goes out to the hardware
+		if (isExpired(cmd)) {
+			replyWithExpired(cmd);
+		} else {
+			struct timespec start;
+			struct timespec end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			// jansson allocations of the handler are taken from the arena of the command
+			jsonArena = cmd->arena;
+			dispatchCommand(m, cmd);
+			jsonArena = NULL;
+
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			histogramRecord(&m->requestHandling,
+					(end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000);
+		}
+	}
+
+	streamAcknowledge(cmd->device, cmd->streamId);
+	for (struct m_command *joined = cmd->joined; joined; joined = joined->next) {
+		streamAcknowledge(joined->device, joined->streamId);
+	}
+
+	requestQueueRelease(&m->queue, cmd);
+
+	if (m->queue.length > 0) {
+		scheduleDispatch(m);
+	}
+
+	streamResume();
+}
+
+/**
+ * \brief Validates a request message and queues its command (see processRequest()), a DOM
+ * built by jansson is allocated from the arena.
+ * \callgraph
+ */
+int queueRequest(struct m_metacash *m, struct m_device *device, struct m_topic *responseTopic,
+		const char *message, size_t len, const char *streamId, struct arena *arena) {
+	struct m_command cmd;
+
+	cmd.msgId[0] = 0;
+	cmd.correlId = NULL;
+	cmd.command = NULL;
+	cmd.metacash = m;
+	cmd.device = device;
+	cmd.responseTopic = responseTopic;
+	cmd.def = NULL;
+	cmd.capture = NULL;
+	cmd.failed = 0;
+	cmd.deadline = 0;
+	cmd.idempotencyKey[0] = 0;
+	snprintf(cmd.streamId, sizeof(cmd.streamId), "%s", streamId ? streamId : "");
+	cmd.arena = arena;
+	cmd.joined = NULL;
+	cmd.next = NULL;
+
+	// generate a new 'msgId' for the response itself
+	generateMsgId(m, cmd.msgId);
+
+	// requests in MessagePack start with a map, JSON ones with a (printable) character
+	if(msgpackIsMap(message, len)) {
+		int jsonLen = msgpackToJson(message, len, &transcodeBuffer, &transcodeBufferSize);
+		if(jsonLen < 0) {
+			syslog(LOG_WARNING, "unable to process message: could not decode msgpack");
+			replyWith(cmd.responseTopic, "{\"error\":\"could not decode msgpack\"}");
+			return 0;
+		}
+		message = transcodeBuffer;
+		len = jsonLen;
+	}
+
+	// parse the message, the common ones without jansson (and without any allocation)
+	cmd.jsonMessage = NULL;
+	if(requestParse(message, len, &cmd.request) != 0) {
+		json_error_t error;
+		cmd.jsonMessage = json_loads(message, 0, &error);
+
+		if(! cmd.jsonMessage) {
+			syslog(LOG_WARNING, "unable to process message: could not parse json. reason: %s, line: %d",
+					error.text, error.line);
+			replyWith(cmd.responseTopic,
+					"{\"error\":\"could not parse json\",\"reason\":\"%s\",\"line\":%d}",
+					error.text, error.line);
+			// no need to json_decref(cmd.jsonMessage) here
+			return 0;
+		}
+
+		requestFromJson(cmd.jsonMessage, &cmd.request);
+	}
+
+	// extract the 'msgId' property (used as the 'correlId' in a response)
+	// this will be the 'correlId' used in replies.
+	if(! (cmd.request.valid & REQUEST_MSGID)) {
+		syslog(LOG_WARNING, "unable to process message: property 'msgId' missing or invalid");
+		replyWithPropertyError(&cmd, "msgId");
+		json_decref(cmd.jsonMessage);
+		return 0;
+	} else {
+		cmd.correlId = cmd.request.msgId;
+	}
+
+	// extract the 'cmd' property
+	if(! (cmd.request.valid & REQUEST_CMD)) {
+		syslog(LOG_WARNING, "unable to process message: property 'cmd' missing or invalid");
+		replyWithPropertyError(&cmd, "cmd");
+		json_decref(cmd.jsonMessage);
+		return 0;
+	} else {
+		cmd.command = cmd.request.cmd;
+	}
+
+	cmd.def = findCommand(cmd.command);
+	if(cmd.def == NULL) {
+		syslog(LOG_WARNING, "unable to process message: no handler for cmd='%s' found", cmd.command);
+		replyWith(cmd.responseTopic, "{\"correlId\":\"%s\",\"error\":\"unknown command\",\"cmd\":\"%s\"}",
+				cmd.correlId, cmd.command);
+		json_decref(cmd.jsonMessage);
+		return 0;
+	}
+
+	if(! (cmd.def->devices & cmd.device->type)) {
+		syslog(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', not supported by device='%s'\n",
+				cmd.command, cmd.correlId, cmd.device->name);
+		replyWith(cmd.responseTopic, "{\"correlId\":\"%s\",\"error\":\"unsupported command\",\"cmd\":\"%s\"}",
+				cmd.correlId, cmd.command);
+		json_decref(cmd.jsonMessage);
+		return 0;
+	}
+
+	// the mandatory properties of the command
+	char *invalidProperty = findPropertyError(cmd.def, &cmd.request);
+	if(invalidProperty) {
+		replyWithPropertyError(&cmd, invalidProperty);
+		json_decref(cmd.jsonMessage);
+		return 0;
+	}
+
+	if(m->quit) {
+		syslog(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', shutting down\n", cmd.command, cmd.correlId);
+		replyWith(cmd.responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"shutting down\"}",
+				cmd.msgId, cmd.correlId);
+		json_decref(cmd.jsonMessage);
+		return 0;
+	}
+
+	if(cmd.def->needsHardware && ! m->deviceAvailable) {
+		syslog(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', hardware unavailable!\n", cmd.command, cmd.correlId);
+		replyWith(cmd.responseTopic, "{\"correlId\":\"%s\",\"error\":\"hardware unavailable\"}", cmd.correlId);
+		json_decref(cmd.jsonMessage);
+		return 0;
+	}
+
+	// optional 'deadline' (absolute, ms since the epoch) and 'ttl' (ms after reception)
+	// properties, the earlier one wins.
+	if(cmd.request.present & REQUEST_DEADLINE) {
+		if(! (cmd.request.valid & REQUEST_DEADLINE)) {
+			replyWithPropertyError(&cmd, "deadline");
+			json_decref(cmd.jsonMessage);
+			return 0;
+		}
+		cmd.deadline = cmd.request.deadline;
+	}
+
+	if(cmd.request.present & REQUEST_TTL) {
+		if(! (cmd.request.valid & REQUEST_TTL)) {
+			replyWithPropertyError(&cmd, "ttl");
+			json_decref(cmd.jsonMessage);
+			return 0;
+		}
+		long long deadline = currentTimeMillis() + cmd.request.ttl;
+		if(cmd.deadline == 0 || deadline < cmd.deadline) {
+			cmd.deadline = deadline;
+		}
+	}
+
+	// operations must not be executed twice: a duplicate of an answered one gets the
+	// cached response, a duplicate of a pending one is answered by the pending one (same correlId)
+	// and one which was pending before a restart (see -j) is answered with an error
+	if(cmd.def->priority == PRIORITY_OPERATION) {
+		long long now = currentTimeMillis();
+		int keyLen = snprintf(cmd.idempotencyKey, sizeof(cmd.idempotencyKey), "%s:%s", cmd.device->name, cmd.correlId);
+		if(keyLen < 0 || (size_t) keyLen >= sizeof(cmd.idempotencyKey)) {
+			// a truncated key could match the one of a different request
+			syslog(LOG_ERR, "rejecting cmd='%s' from msgId='%s', idempotency key too long\n", cmd.command, cmd.correlId);
+			cmd.idempotencyKey[0] = 0;
+			replyWithPropertyError(&cmd, "msgId");
+			json_decref(cmd.jsonMessage);
+			return 0;
+		}
+
+		struct idempotency_entry *entry = idempotencyLookup(&m->idempotency, cmd.idempotencyKey, now);
+		if(entry) {
+			cmd.device->requestsDuplicated++;
+			if(entry->state == IDEMPOTENCY_DONE) {
+				syslog(LOG_NOTICE, "duplicate cmd='%s' from msgId='%s', replying with the cached response\n",
+						cmd.command, cmd.correlId);
+				replyWith(cmd.responseTopic, "%s", entry->response);
+			} else if(entry->state == IDEMPOTENCY_UNKNOWN) {
+				// e.g. a claimed stream entry whose execution was interrupted by a crash
+				syslog(LOG_ERR, "not executing cmd='%s' from msgId='%s', it was in flight before the restart\n",
+						cmd.command, cmd.correlId);
+				replyWith(cmd.responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"outcome unknown\"}",
+						cmd.msgId, cmd.correlId);
+			} else {
+				syslog(LOG_NOTICE, "duplicate cmd='%s' from msgId='%s', attached to the pending one\n",
+						cmd.command, cmd.correlId);
+			}
+			json_decref(cmd.jsonMessage);
+			return 0;
+		}
+
+		idempotencyBegin(&m->idempotency, cmd.idempotencyKey, now);
+	}
+
+	// proper json structure, the command and its properties have been verified here.
+	// also we know which device is used and where we should send our response to.
+	// queue the command, it will be dispatched to the appropriate command handler
+	// function by cbOnDispatchEvent().
+
+	if(requestQueueJoin(&m->queue, &cmd)) {
+		cmd.device->requestsCoalesced++;
+		syslog(LOG_INFO, "cmd='%s' from msgId='%s' joined an identical queued request\n", cmd.command, cmd.correlId);
+		return 1;
+	}
+
+	if(! requestQueuePush(&m->queue, &cmd)) {
+		idempotencyRelease(&cmd);
+		cmd.device->requestsRejected++;
+		syslog(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', request queue is full\n", cmd.command, cmd.correlId);
+		replyWith(cmd.responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"request queue full\"}",
+				cmd.msgId, cmd.correlId);
+		json_decref(cmd.jsonMessage);
+		return 0;
+	}
+
+	scheduleDispatch(m);
+	return 1;
+}
+
+/**
+ * \brief Validates a request message and queues its command, the execution is done by cbOnDispatchEvent().
+ * \details Returns 1 if the command has been queued (or joined a queued one), 0 if the request
+ * has already been answered (errors, duplicates). If streamId is not NULL the request has been read
+ * from the request stream of the device, it is acknowledged once the command has been executed.
+ *
+ * The message is parsed into the arena of the command which will be taken from the pool next.
+ * It is reset right away if the command isn't queued, otherwise when the command is released.
+ * \callgraph
+ */
+int processRequest(struct m_metacash *m, struct m_device *device, struct m_topic *responseTopic,
+		const char *message, size_t len, const char *streamId) {
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct arena *arena = m->queue.free ? m->queue.free->arena : NULL;
+
+	jsonArena = arena;
+	int queued = queueRequest(m, device, responseTopic, message, len, streamId, arena);
+	jsonArena = NULL;
+
+	if (! queued && arena) {
+		arenaReset(arena);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	histogramRecord(&m->requestIntake,
+			(end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000);
+
+	return queued;
+}
+
+/**
+ * \brief Acknowledges an answered request from the request stream of the device (nothing
+ * to do for an empty streamId).
+ * \details Sent via the publish context (the stream context is blocked by XREADGROUP), so it is
+ * buffered like the messages while that connection is down.
+ */
+void streamAcknowledge(struct m_device *device, const char *streamId) {
+	if (streamId[0] == 0) {
+		return;
+	}
+
+	const char *stream = device->type == DEVICE_HOPPER ? requestNames.hopperStream : requestNames.validatorStream;
+
+	char *command;
+	int len = redisFormatCommand(&command, "XACK %s %s %s", stream, STREAM_GROUP, streamId);
+	if (len > 0) {
+		redisSend(command, len);
+		free(command);
+	}
+}
+
+/**
+ * \brief Processes the entries (XREADGROUP / XAUTOCLAIM format) read from a request stream.
+ * \details The message is taken from the 'data' field of an entry. Requests which have been
+ * answered right away (errors, duplicates) and malformed entries are acknowledged immediately.
+ */
+void streamProcessEntries(struct m_metacash *m, const char *stream, redisReply *entries) {
+	struct m_device *device;
+	struct m_topic *responseTopic;
+	if (strcmp(stream, requestNames.hopperStream) == 0) {
+		device = &m->hopper;
+		responseTopic = &hopperResponseTopic;
+	} else if (strcmp(stream, requestNames.validatorStream) == 0) {
+		device = &m->validator;
+		responseTopic = &validatorResponseTopic;
+	} else {
+		syslog(LOG_ERR, "streamProcessEntries: unknown stream '%s'\n", stream);
+		return;
+	}
+
+	if (entries->type != REDIS_REPLY_ARRAY) {
+		return;
+	}
+
+	for (size_t i = 0; i < entries->elements; i++) {
+		if (m->quit) {
+			// left pending, claimed again after the restart
+			break;
+		}
+
+		redisReply *entry = entries->element[i];
+		if (entry->type != REDIS_REPLY_ARRAY || entry->elements != 2 || entry->element[0]->type != REDIS_REPLY_STRING) {
+			continue;
+		}
+
+		const char *id = entry->element[0]->str;
+		redisReply *fields = entry->element[1];
+
+		redisReply *data = NULL;
+		if (fields->type == REDIS_REPLY_ARRAY) {
+			for (size_t f = 0; f + 1 < fields->elements; f += 2) {
+				if (fields->element[f]->type == REDIS_REPLY_STRING && strcmp(fields->element[f]->str, "data") == 0) {
+					data = fields->element[f + 1];
+					break;
+				}
+			}
+		}
+
+		if (data == NULL || data->type != REDIS_REPLY_STRING || strlen(id) >= STREAM_ID_SIZE) {
+			// deleted meanwhile or not a request, nobody to answer
+			syslog(LOG_WARNING, "dropping entry '%s' of stream '%s' without 'data' field\n", id, stream);
+			streamAcknowledge(device, id);
+			continue;
+		}
+
+		if (! processRequest(m, device, responseTopic, data->str, data->len, id)) {
+			streamAcknowledge(device, id);
+		}
+	}
+}
+
+/**
+ * \brief Reads the next entries from the request streams (non blocking for us, the reply
+ * arrives in cbOnStreamClaim() / cbOnStreamRead()).
+ * \details First the entries which were read but not acknowledged before (e.g. before a restart)
+ * are claimed page by page with XAUTOCLAIM, one stream after the other, then new entries are read
+ * with XREADGROUP. Nothing is read while the request queue has no room for the entries (they would
+ * be answered with "request queue full" and acknowledged), streamResume() continues.
  */
-void handleChannelSecurityData(struct m_command *cmd) {
-	mc_ssp_channel_security_data(&cmd->device->sspC);
+void streamRead(redisAsyncContext *c) {
+	struct m_metacash *m = c->data;
+
+	if (m->quit) {
+		return;
+	}
+
+	if (m->queue.available < STREAM_READ_ROOM) {
+		streamReader.waiting = 1;
+		return;
+	}
+	streamReader.waiting = 0;
+
+	if (streamReader.claiming < 2) {
+		char *stream = streamReader.claiming == 0 ? requestNames.hopperStream : requestNames.validatorStream;
+		redisAsyncCommand(c, cbOnStreamClaim, stream, "XAUTOCLAIM %s %s %s 0 %s COUNT %d",
+				stream, STREAM_GROUP, STREAM_GROUP, streamReader.cursor, STREAM_READ_COUNT);
+		return;
+	}
+
+	redisAsyncCommand(c, cbOnStreamRead, NULL,
+			"XREADGROUP GROUP %s %s COUNT %d BLOCK 0 STREAMS %s %s > >",
+			STREAM_GROUP, STREAM_GROUP, STREAM_READ_COUNT, requestNames.hopperStream, requestNames.validatorStream);
 }
 
 /**
- * \brief Handles the JSON "test" command
+ * \brief Continues reading the request streams if it waits for room in the request queue,
+ * called whenever a command has been executed.
  */
-void handleTest(struct m_command *cmd) {
-	replyWithSspResponse(cmd, SSP_RESPONSE_OK);
+void streamResume() {
+	if (streamReader.waiting && streamLink.connected) {
+		streamRead(redisStreamCtx);
+	}
 }
 
 /**
- * \brief Handles the JSON "configure-bezel" command.
+ * \brief Callback function for the XREADGROUP of the request streams, processes the entries
+ * and reads the next ones.
  */
-void handleConfigureBezel(struct m_command *cmd) {
-	json_t *jR = json_object_get(cmd->jsonMessage, "r");
-	if(! json_is_integer(jR)) {
-		replyWithPropertyError(cmd, "r");
+void cbOnStreamRead(redisAsyncContext *c, void *r, void *privdata) {
+	if (r == NULL) {
+		// disconnected
 		return;
 	}
-	unsigned char r = json_integer_value(jR);
 
-	json_t *jG = json_object_get(cmd->jsonMessage, "g");
-	if(! json_is_integer(jG)) {
-		replyWithPropertyError(cmd, "g");
-		return;
+	struct m_metacash *m = c->data;
+	redisReply *reply = r;
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		syslog(LOG_ERR, "cbOnStreamRead: redis error: %s\n", reply->str);
+	} else if (reply->type == REDIS_REPLY_ARRAY) {
+		// [[stream, [entries]], ...]
+		for (size_t i = 0; i < reply->elements; i++) {
+			redisReply *stream = reply->element[i];
+			if (stream->type == REDIS_REPLY_ARRAY && stream->elements == 2) {
+				streamProcessEntries(m, stream->element[0]->str, stream->element[1]);
+			}
+		}
 	}
-	unsigned char g = json_integer_value(jG);
 
-	json_t *jB = json_object_get(cmd->jsonMessage, "b");
-	if(! json_is_integer(jB)) {
-		replyWithPropertyError(cmd, "b");
+	streamRead(c);
+}
+
+/**
+ * \brief Callback function for the XAUTOCLAIM of a request stream (privdata is the name of the
+ * stream), processes the entries which were read but not acknowledged before and claims the
+ * next page until the stream is done.
+ */
+void cbOnStreamClaim(redisAsyncContext *c, void *r, void *privdata) {
+	redisReply *reply = r;
+	if (reply == NULL) {
+		// disconnected, the page is claimed again after the reconnect
 		return;
 	}
-	unsigned char b = json_integer_value(jB);
 
-	json_t *jType = json_object_get(cmd->jsonMessage, "type");
-	if(! json_is_integer(jType)) {
-		replyWithPropertyError(cmd, "type");
+	// the stream is done once the next start id is 0-0 (or something went wrong)
+	const char *next = "0-0";
+	if (reply->type == REDIS_REPLY_ERROR) {
+		syslog(LOG_ERR, "cbOnStreamClaim: redis error: %s\n", reply->str);
+	} else if (reply->type == REDIS_REPLY_ARRAY && reply->elements >= 2) {
+		// [next start id, [entries], (deleted ids)]
+		if (reply->element[1]->type == REDIS_REPLY_ARRAY && reply->element[1]->elements > 0) {
+			syslog(LOG_NOTICE, "claimed %zu pending entries of stream '%s'\n", reply->element[1]->elements, (char *) privdata);
+		}
+		streamProcessEntries(c->data, privdata, reply->element[1]);
+
+		if (reply->element[0]->type == REDIS_REPLY_STRING && reply->element[0]->len < STREAM_ID_SIZE) {
+			next = reply->element[0]->str;
+		}
+	}
+
+	if (strcmp(next, "0-0") == 0) {
+		streamReader.claiming++;
+	}
+	snprintf(streamReader.cursor, sizeof(streamReader.cursor), "%s", next);
+
+	streamRead(c);
+}
+
+/**
+ * \brief Callback function for commands whose reply is only checked for errors.
+ */
+void cbOnStreamSetup(redisAsyncContext *c, void *r, void *privdata) {
+	redisReply *reply = r;
+	// the group exists already after the first start
+	if (reply && reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "BUSYGROUP", 9) != 0) {
+		syslog(LOG_ERR, "cbOnStreamSetup: redis error: %s\n", reply->str);
+	}
+}
+
+/**
+ * \brief Callback function triggered by the redis client on connecting with
+ * the "stream" context.
+ * \details Creates the consumer group, claims the entries which have not been acknowledged
+ * (e.g. read before a restart) and starts reading. Also called after a reconnect.
+ */
+void cbOnConnectStreamContext(const redisAsyncContext *c, int status) {
+	if (redisLinkConnected(&streamLink, status)) {
+		syslog(LOG_ERR, "cbOnConnectStreamContext: redis error: %s\n", c->errstr);
 		return;
 	}
-	unsigned char type = json_integer_value(jType);
+	syslog(LOG_INFO, "cbOnConnectStreamContext: connected to redis\n");
 
-	replyWithSspResponse(cmd,
-			mc_ssp_configure_bezel(&cmd->device->sspC, r, g, b, SSP_OPTION_NON_VOLATILE, type));
+	redisAsyncContext *cNotConst = (redisAsyncContext*) c; // get rids of discarding qualifier \"const\" warning
+
+	char *streams[] = { requestNames.hopperStream, requestNames.validatorStream };
+	for (unsigned int i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+		redisAsyncCommand(cNotConst, cbOnStreamSetup, NULL, "XGROUP CREATE %s %s $ MKSTREAM", streams[i], STREAM_GROUP);
+	}
+
+	// after a reconnect the entries claimed before are still queued or have been acknowledged
+	// meanwhile, so the claiming continues where it stopped (see streamRead())
+	streamRead(cNotConst);
+}
+
+/**
+ * \brief Callback function triggered by the redis client on disconnecting with
+ * the "stream" context.
+ */
+void cbOnDisconnectStreamContext(const redisAsyncContext *c, int status) {
+	redisLinkDisconnected(&streamLink, status);
+	if (status != REDIS_OK) {
+		syslog(LOG_ERR, "cbOnDisconnectStreamContext: redis error: %s\n", c->errstr);
+		return;
+	}
+	syslog(LOG_INFO, "cbOnDisconnectStreamContext: disconnected from redis\n");
 }
 
 /**
  * \brief Callback function triggered by an incoming message in either
  * the "hopper-request" or "validator-request" topic.
- * \details Details only to get graph.
+ * \details The message is validated and queued by processRequest().
  * \callgraph
  */
 void cbOnRequestMessage(redisAsyncContext *c, void *r, void *privdata) {
@@ -1046,8 +3443,6 @@ void cbOnRequestMessage(redisAsyncContext *c, void *r, void *privdata) {
 		return;
 	}
 
-	hardwareWaitTime();
-
 	struct m_metacash *m = c->data;
 	redisReply *reply = r;
 
@@ -1055,135 +3450,17 @@ void cbOnRequestMessage(redisAsyncContext *c, void *r, void *privdata) {
 	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3) {
 		if (strcmp(reply->element[0]->str, "subscribe") != 0) {
 			char *topic = reply->element[1]->str;
-			struct m_command cmd;
-
-			cmd.msgId = NULL;
-			cmd.correlId = NULL;
-			cmd.command = NULL;
 
 			// decide to which topic the response should be sent to
-			if (strcmp(topic, "validator-request") == 0) {
-				cmd.device = &m->validator;
-				cmd.responseTopic = "validator-response";
-			} else if (strcmp(topic, "hopper-request") == 0) {
-				cmd.device = &m->hopper;
-				cmd.responseTopic = "hopper-response";
+			if (strcmp(topic, requestNames.validatorTopic) == 0) {
+				processRequest(m, &m->validator, &validatorResponseTopic,
+						reply->element[2]->str, reply->element[2]->len, NULL);
+			} else if (strcmp(topic, requestNames.hopperTopic) == 0) {
+				processRequest(m, &m->hopper, &hopperResponseTopic,
+						reply->element[2]->str, reply->element[2]->len, NULL);
 			} else {
 				syslog(LOG_ERR, "cbOnRequestMessage subscribed for a topic we don't have a response topic\n");
-				return;
-			}
-
-			// generate a new 'msgId' for the response itself
-			uuid_t uuid;
-			uuid_generate_time_safe(uuid);
-			char msgId[37] = { 0 }; // ex. "1b4e28ba-2fa1-11d2-883f-0016d3cca427" + "\0"
-			uuid_unparse_lower(uuid, msgId);
-			cmd.msgId = (char *) &msgId; // points to a local variable. only valid until this block is exited!
-
-			char *message = reply->element[2]->str;
-
-			// try to parse the message as json
-			json_error_t error;
-			cmd.jsonMessage = json_loads(message, 0, &error);
-
-			if(! cmd.jsonMessage) {
-				syslog(LOG_WARNING, "unable to process message: could not parse json. reason: %s, line: %d",
-						error.text, error.line);
-				replyWith(cmd.responseTopic,
-						"{\"error\":\"could not parse json\",\"reason\":\"%s\",\"line\":%d}",
-						error.text, error.line);
-				// no need to json_decref(cmd.jsonMessage) here
-				return;
-			}
-
-			// extract the 'msgId' property (used as the 'correlId' in a response)
-			// this will be the 'correlId' used in replies.
-			json_t *jMsgId = json_object_get(cmd.jsonMessage, "msgId");
-			if(! json_is_string(jMsgId)) {
-				syslog(LOG_WARNING, "unable to process message: property 'msgId' missing or invalid");
-				replyWithPropertyError(&cmd, "msgId");
-				json_decref(cmd.jsonMessage);
-				return;
-			} else {
-				cmd.correlId = (char *) json_string_value(jMsgId); // cast for now
-			}
-
-			// extract the 'cmd' property
-			json_t *jCmd = json_object_get(cmd.jsonMessage, "cmd");
-			if(! json_is_string(jCmd)) {
-				syslog(LOG_WARNING, "unable to process message: property 'cmd' missing or invalid");
-				replyWithPropertyError(&cmd, "cmd");
-				json_decref(cmd.jsonMessage);
-				return;
-			} else {
-				cmd.command = (char *) json_string_value(jCmd); // cast for now
-			}
-
-			// proper json structure, properties cmd and msgId have been verified here.
-			// also we know which device is used and where we should send our response to.
-			// finally try to dispatch the message to the appropriate command handler
-			// function if any. in case we don't know that command we respond with a
-			// generic error response.
-
-			syslog(LOG_INFO, "processing cmd='%s' from msgId='%s' in topic='%s' for device='%s'\n",
-					cmd.command, cmd.correlId, topic, cmd.device->name);
-
-			if(isCommand(&cmd, "quit")) {
-				handleQuit(&cmd);
-			} else if(isCommand(&cmd, "test")) {
-				handleTest(&cmd);
-			} else {
-				// commands in here need the actual hardware
-
-				if(! m->deviceAvailable) {
-					// TODO: an unknown command without the actual hardware will also receive this response :-/
-					syslog(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', hardware unavailable!\n", cmd.command, cmd.correlId);
-					replyWith(cmd.responseTopic, "{\"correlId\":\"%s\",\"error\":\"hardware unavailable\"}", cmd.correlId);
-				} else {
-					if(isCommand(&cmd, "configure-bezel")) {
-						handleConfigureBezel(&cmd);
-					} else if(isCommand(&cmd, "empty")) {
-						handleEmpty(&cmd);
-					} else if (isCommand(&cmd, "smart-empty")) {
-						handleSmartEmpty(&cmd);
-					} else if (isCommand(&cmd, "cashbox-payout-operation-data")) {
-						handleCashboxPayoutOperationData(&cmd);
-					} else if (isCommand(&cmd, "enable")) {
-						handleEnable(&cmd);
-					} else if (isCommand(&cmd, "disable")) {
-						handleDisable(&cmd);
-					} else if(isCommand(&cmd, "enable-channels")) {
-						handleEnableChannels(&cmd);
-					} else if(isCommand(&cmd, "disable-channels")) {
-						handleDisableChannels(&cmd);
-					} else if(isCommand(&cmd, "inhibit-channels")) {
-						handleInhibitChannels(&cmd);
-					} else if (isCommand(&cmd, "test-float") || isCommand(&cmd, "do-float")) {
-						handleFloat(&cmd);
-					} else if (isCommand(&cmd, "test-payout") || isCommand(&cmd, "do-payout")) {
-						handlePayout(&cmd);
-					} else if (isCommand(&cmd, "get-firmware-version")) {
-						handleGetFirmwareVersion(&cmd);
-					} else if (isCommand(&cmd, "get-dataset-version")) {
-						handleGetDatasetVersion(&cmd);
-					} else if (isCommand(&cmd, "channel-security-data")) {
-						handleChannelSecurityData(&cmd);
-					} else if (isCommand(&cmd, "get-all-levels")) {
-						handleGetAllLevels(&cmd);
-					} else if (isCommand(&cmd, "set-denomination-level")) {
-						handleSetDenominationLevels(&cmd);
-					} else if (isCommand(&cmd, "last-reject-note")) {
-						handleLastRejectNote(&cmd);
-					} else {
-						syslog(LOG_WARNING, "unable to process message: no handler for cmd='%s' found", cmd.command);
-						replyWith(cmd.responseTopic, "{\"correlId\":\"%s\",\"error\":\"unknown command\",\"cmd\":\"%s\"}",
-								cmd.correlId, cmd.command);
-					}
-				}
 			}
-
-			// this will also free the other json objects associated with it
-			json_decref(cmd.jsonMessage);
 		}
 	}
 }
@@ -1193,11 +3470,19 @@ void cbOnRequestMessage(redisAsyncContext *c, void *r, void *privdata) {
  * the "publish" context.
  */
 void cbOnConnectPublishContext(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
+	if (redisLinkConnected(&publishLink, status)) {
 		syslog(LOG_ERR, "cbOnConnectPublishContext: redis error: %s\n", c->errstr);
 		return;
 	}
 	syslog(LOG_INFO, "cbOnConnectPublishContext: connected to redis\n");
+
+	// everything published meanwhile
+	outboundQueueFlush();
+	if (eventSpool.dir) {
+		// everything not acknowledged before the connection was lost (or before a restart)
+		eventSpoolRewind(&eventSpool);
+		spoolPump();
+	}
 }
 
 /**
@@ -1205,6 +3490,7 @@ void cbOnConnectPublishContext(const redisAsyncContext *c, int status) {
  * the "publish" context.
  */
 void cbOnDisconnectPublishContext(const redisAsyncContext *c, int status) {
+	redisLinkDisconnected(&publishLink, status);
 	if (status != REDIS_OK) {
 		syslog(LOG_ERR, "cbOnDisconnectPublishContext: redis error: %s\n", c->errstr);
 		return;
@@ -1215,9 +3501,10 @@ void cbOnDisconnectPublishContext(const redisAsyncContext *c, int status) {
 /**
  * \brief Callback function triggered by the redis client on connecting with
  * the "subscribe" context.
+ * \details Also called after a reconnect, so the topics are subscribed again.
  */
 void cbOnConnectSubscribeContext(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
+	if (redisLinkConnected(&subscribeLink, status)) {
 		syslog(LOG_ERR, "cbOnConnectSubscribeContext - redis error: %s\n", c->errstr);
 		return;
 	}
@@ -1226,11 +3513,11 @@ void cbOnConnectSubscribeContext(const redisAsyncContext *c, int status) {
 	redisAsyncContext *cNotConst = (redisAsyncContext*) c; // get rids of discarding qualifier \"const\" warning
 
 	// subscribe the topics in redis from which we want to receive messages
-	redisAsyncCommand(cNotConst, cbOnMetacashMessage, NULL, "SUBSCRIBE metacash");
+	redisAsyncCommand(cNotConst, cbOnMetacashMessage, NULL, "SUBSCRIBE %s", requestNames.metacashTopic);
 
 	// n.b: the same callback function handles both topics
-	redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE validator-request");
-	redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE hopper-request");
+	redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE %s", requestNames.validatorTopic);
+	redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE %s", requestNames.hopperTopic);
 }
 
 /**
@@ -1238,6 +3525,7 @@ void cbOnConnectSubscribeContext(const redisAsyncContext *c, int status) {
  * the "subscribe" context.
  */
 void cbOnDisconnectSubscribeContext(const redisAsyncContext *c, int status) {
+	redisLinkDisconnected(&subscribeLink, status);
 	if (status != REDIS_OK) {
 		syslog(LOG_INFO, "cbOnDisconnectSubscribeContext - redis error: %s\n", c->errstr);
 		return;
@@ -1256,8 +3544,8 @@ void die(char *reason, int rc) {
 }
 
 /**
- * \brief Supports arguments -h (redis hostname), -p (redis port), -d (serial device name) and -?.
- * \details Warning: both "calls" to hopperEventHandler() and validatorEventHandler() in the callgraph are false positives!
+ * \brief Entry point of payoutd, the arguments are parsed by parseCmdLine() (see the list at the top of this file).
+ * \details Warning: the "call" to pollEventHandler() in the callgraph is a false positive!
  * \callgraph
  */
 int main(int argc, char *argv[]) {
@@ -1271,24 +3559,46 @@ int main(int argc, char *argv[]) {
 	signal(SIGINT, signalHandler);
 
 	struct m_metacash metacash;
+	memset(&metacash, 0, sizeof(metacash));
 	metacash.deviceAvailable = 0;
 	metacash.quit = 0;
 	metacash.logSyslogStderr = 0; // default, override using -e
 	metacash.acceptCoins = 0; // default, override using -c
+	metacash.useLibuuid = 0; // default, override using -u
+	metacash.publishEventBatch = 0; // default, override using -b
+	metacash.outputMode = OUTPUT_PUBLISH; // default, override using -m
+	metacash.streamMaxlen = STREAM_DEFAULT_MAXLEN; // default, override using -l
+	metacash.streamIntake = 0; // default, override using -x
+	metacash.dropPolicy = DROP_OLDEST; // default, override using -o
+	metacash.idempotencyCapacity = IDEMPOTENCY_DEFAULT_CAPACITY; // default, override using -i
+	metacash.idempotencyTtl = IDEMPOTENCY_DEFAULT_TTL; // default, override using -t
+	metacash.idempotencyJournal = NULL; // default, enable using -j
+	metacash.eventRingName = NULL; // default, enable using -r
+	metacash.spoolDir = NULL; // default, enable using -w
+	metacash.topicNamespace = NULL; // default, enable using -n
+	metacash.metricsInterval = 0; // default, enable using -g
 
 	metacash.serialDevice = "/dev/ttyACM0";	// default, override with -d argument
 	metacash.redisHost = "127.0.0.1";	// default, override with -h argument
 	metacash.redisPort = 6379;			// default, override with -p argument
+	metacash.redisSocket = NULL;		// default, override with -s argument
 
 	metacash.hopper.id = 0x10; // 0X10 -> Smart Hopper ("Münzer")
+	metacash.hopper.type = DEVICE_HOPPER;
 	metacash.hopper.name = "Mr. Coin";
 	metacash.hopper.key = DEFAULT_KEY;
-	metacash.hopper.eventHandlerFn = hopperEventHandler;
+	metacash.hopper.eventHandlerFn = pollEventHandler;
 
 	metacash.validator.id = 0x00; // 0x00 -> Smart Payout NV200 ("Scheiner")
+	metacash.validator.type = DEVICE_VALIDATOR;
 	metacash.validator.name = "Ms. Note";
 	metacash.validator.key = DEFAULT_KEY;
-	metacash.validator.eventHandlerFn = validatorEventHandler;
+	metacash.validator.eventHandlerFn = pollEventHandler;
+
+	if (checkCommandRegistry()) {
+		die("invalid command registry", 1);
+		// never reached, already exited
+	}
 
 	// parse the command line arguments
 	if (parseCmdLine(argc, argv, &metacash)) {
@@ -1303,8 +3613,31 @@ int main(int argc, char *argv[]) {
 		openlog("payoutd", LOG_PERROR | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
 	}
 
-	syslog(LOG_NOTICE, "using redis at %s:%d and hardware device %s",
-			metacash.redisHost, metacash.redisPort, metacash.serialDevice);
+	if (metacash.redisSocket) {
+		syslog(LOG_NOTICE, "using redis at %s and hardware device %s",
+				metacash.redisSocket, metacash.serialDevice);
+	} else {
+		syslog(LOG_NOTICE, "using redis at %s:%d and hardware device %s",
+				metacash.redisHost, metacash.redisPort, metacash.serialDevice);
+	}
+
+	if (idempotencyInit(&metacash.idempotency, metacash.idempotencyCapacity,
+			(long long) metacash.idempotencyTtl * 1000, metacash.idempotencyJournal, currentTimeMillis())) {
+		die("could not setup the idempotency cache", 1);
+		// never reached, already exited
+	}
+
+	bufferInit(&eventBatch.payloads, NULL, 0);
+
+	if (metacash.eventRingName && eventRingCreate(&metacash.eventRing, metacash.eventRingName, EVENT_RING_DEFAULT_SIZE)) {
+		die("could not setup the event ring", 1);
+		// never reached, already exited
+	}
+
+	if (metacash.spoolDir && eventSpoolInit(&eventSpool, metacash.spoolDir, SPOOL_SEGMENT_SIZE)) {
+		die("could not setup the event spool", 1);
+		// never reached, already exited
+	}
 
 	// open the serial device
 	if (mcSspOpenSerialDevice(&metacash) == 0) {
@@ -1332,9 +3665,28 @@ int main(int argc, char *argv[]) {
 
 	// cleanup stuff before exiting.
 
+	// commands which have not been executed anymore (answered in cbOnCheckQuitEvent(), the
+	// queue is only filled here if the loop has been left otherwise)
+	discardQueuedCommands(&metacash);
+
+	idempotencyFree(&metacash.idempotency);
+	eventRingClose(&metacash.eventRing);
+	bufferFree(&eventBatch.payloads);
+
 	// redis
-	redisAsyncFree(redisPublishCtx);
-	redisAsyncFree(redisSubscribeCtx);
+	// a connection which is down has no context, the pending reconnects die with the event base
+	if (redisPublishCtx) {
+		redisAsyncFree(redisPublishCtx);
+	}
+	if (redisSubscribeCtx) {
+		redisAsyncFree(redisSubscribeCtx);
+	}
+	if (redisStreamCtx) {
+		redisAsyncFree(redisStreamCtx);
+	}
+	if (eventSpool.dir) {
+		eventSpoolFree(&eventSpool);
+	}
 
 	// libevent
 	event_base_free(metacash.eventBase);
@@ -1353,7 +3705,7 @@ int parseCmdLine(int argc, char *argv[], struct m_metacash *metacash) {
 	opterr = 0;
 
 	int c;
-	while ((c = getopt(argc, argv, "ech:p:d:")) != -1) {
+	while ((c = getopt(argc, argv, "ecubxh:p:s:d:i:t:j:m:l:o:f:r:w:n:g:")) != -1) {
 		switch (c) {
 		case 'h':
 			metacash->redisHost = optarg;
@@ -1361,6 +3713,9 @@ int parseCmdLine(int argc, char *argv[], struct m_metacash *metacash) {
 		case 'p':
 			metacash->redisPort = atoi(optarg);
 			break;
+		case 's':
+			metacash->redisSocket = optarg;
+			break;
 		case 'd':
 			metacash->serialDevice = optarg;
 			break;
@@ -1370,8 +3725,77 @@ int parseCmdLine(int argc, char *argv[], struct m_metacash *metacash) {
 		case 'e':
 			metacash->logSyslogStderr = 1;
 			break;
+		case 'u':
+			metacash->useLibuuid = 1;
+			break;
+		case 'b':
+			metacash->publishEventBatch = 1;
+			break;
+		case 'x':
+			metacash->streamIntake = 1;
+			break;
+		case 'i':
+			metacash->idempotencyCapacity = atoi(optarg);
+			break;
+		case 't':
+			metacash->idempotencyTtl = atoi(optarg);
+			break;
+		case 'j':
+			metacash->idempotencyJournal = optarg;
+			break;
+		case 'm':
+			if (strcmp(optarg, "publish") == 0) {
+				metacash->outputMode = OUTPUT_PUBLISH;
+			} else if (strcmp(optarg, "stream") == 0) {
+				metacash->outputMode = OUTPUT_STREAM;
+			} else if (strcmp(optarg, "both") == 0) {
+				metacash->outputMode = OUTPUT_BOTH;
+			} else {
+				fprintf(stderr, "Unknown output mode '%s'.\n", optarg);
+				syslog(LOG_ERR, "Unknown output mode '%s'.\n", optarg);
+				return 1;
+			}
+			break;
+		case 'l':
+			metacash->streamMaxlen = strtoul(optarg, NULL, 10);
+			break;
+		case 'f': {
+			struct m_topic *topic = findTopic(optarg);
+			if (topic == NULL) {
+				fprintf(stderr, "Unknown topic '%s'.\n", optarg);
+				syslog(LOG_ERR, "Unknown topic '%s'.\n", optarg);
+				return 1;
+			}
+			topic->msgpack = 1;
+			break;
+		}
+		case 'r':
+			metacash->eventRingName = optarg;
+			break;
+		case 'w':
+			metacash->spoolDir = optarg;
+			break;
+		case 'n':
+			metacash->topicNamespace = optarg;
+			break;
+		case 'g':
+			metacash->metricsInterval = atoi(optarg);
+			break;
+		case 'o':
+			if (strcmp(optarg, "oldest") == 0) {
+				metacash->dropPolicy = DROP_OLDEST;
+			} else if (strcmp(optarg, "newest") == 0) {
+				metacash->dropPolicy = DROP_NEWEST;
+			} else {
+				fprintf(stderr, "Unknown drop policy '%s'.\n", optarg);
+				syslog(LOG_ERR, "Unknown drop policy '%s'.\n", optarg);
+				return 1;
+			}
+			break;
 		case '?':
-			if (optopt == 'h' || optopt == 'p' || optopt == 'd') {
+			if (optopt == 'h' || optopt == 'p' || optopt == 's' || optopt == 'd' || optopt == 'i' || optopt == 't' || optopt == 'j'
+					|| optopt == 'm' || optopt == 'l' || optopt == 'o' || optopt == 'f' || optopt == 'r'
+					|| optopt == 'w' || optopt == 'n' || optopt == 'g') {
 				fprintf(stderr, "Option -%c requires an argument.\n", optopt);
 				syslog(LOG_ERR, "Option -%c requires an argument.\n", optopt);
 			} else if (isprint(optopt)) {
@@ -1389,290 +3813,230 @@ int parseCmdLine(int argc, char *argv[], struct m_metacash *metacash) {
 		}
 	}
 
+	// pending stream entries are executed again after a restart, only the journal
+	// tells which of them have already been executed
+	if (metacash->streamIntake && metacash->idempotencyJournal == NULL) {
+		fprintf(stderr, "Option -x requires -j.\n");
+		syslog(LOG_ERR, "Option -x requires -j.\n");
+		return 1;
+	}
+
 	return 0;
 }
 
+/** \brief Poll event field: the amount (data1) */
+#define EVENT_AMOUNT 0x01
+/** \brief Poll event field: the amount of the note in the channel data1 (ChannelData[].value * 100) */
+#define EVENT_SCALED_AMOUNT 0x02
+/** \brief Poll event field: the channel (data1) */
+#define EVENT_CHANNEL 0x04
+/** \brief Poll event field: the dispensed amount (data1) */
+#define EVENT_DISPENSED 0x08
+/** \brief Poll event field: the requested amount (data2) */
+#define EVENT_REQUESTED 0x10
+/** \brief Poll event field: the country code */
+#define EVENT_CC 0x20
+/** \brief Poll event field: the calibration error (data1, see CALIBRATION_ERRORS) */
+#define EVENT_ERROR 0x40
+/** \brief The event is known to the device (otherwise it is published as "unknown") */
+#define EVENT_KNOWN 0x80
+
+/** \brief Literal start of the JSON message of an event and its length (for m_poll_event_def) */
+#define EVENT_PREFIX(name) "{\"event\":\"" name "\"", sizeof("{\"event\":\"" name "\"") - 1
+
 /**
- * \brief Callback function used for inspecting and publishing events reported by the Hopper hardware.
+ * \brief Structure which describes how an SSP poll event is published, see POLL_EVENT_DEFS.
  */
-void hopperEventHandler(struct m_device *device,
-		struct m_metacash *metacash, SSP_POLL_DATA6 *poll) {
-	for (unsigned char i = 0; i < poll->event_count; ++i) {
-		switch (poll->events[i].event) {
-		case SSP_POLL_RESET:
-			publishHopperEvent("{\"event\":\"unit reset\"}");
-			// Make sure we are using ssp version 6
-			if (ssp6_host_protocol(&device->sspC, 0x06) != SSP_RESPONSE_OK) {
-				die("hopperEventHandler: SSP Host Protocol Failed", 3);
-				// never reached, already exited
-			}
-			break;
-		case SSP_POLL_READ:
-			// the \"read\" event contains 1 data value, which if >0 means a note has been validated and is in escrow
-			if (poll->events[i].data1 > 0) {
-				publishHopperEvent("{\"event\":\"read\",\"channel\":%ld}", poll->events[i].data1);
-			} else {
-				// this is reported more than once for a single note
-				publishHopperEvent("{\"event\":\"reading\"}");
-			}
-			break;
-		case SSP_POLL_TIMEOUT:
-			publishHopperEvent("{\"event\":\"timeout\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_DISPENSING:
-			publishHopperEvent("{\"event\":\"dispensing\",\"amount\":%ld}", poll->events[i].data1);
-			break;
-		case SSP_POLL_DISPENSED:
-			publishHopperEvent("{\"event\":\"dispensed\",\"amount\":%ld}", poll->events[i].data1);
-			break;
-		case SSP_POLL_FLOATING:
-			publishHopperEvent("{\"event\":\"floating\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_FLOATED:
-			publishHopperEvent("{\"event\":\"floated\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_CASHBOX_PAID:
-			publishHopperEvent("{\"event\":\"cashbox paid\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_JAMMED:
-			publishHopperEvent("{\"event\":\"jammed\"}");
-			break;
-		case SSP_POLL_FRAUD_ATTEMPT:
-			publishHopperEvent("{\"event\":\"fraud attempt\"}");
-			break;
-		case SSP_POLL_COIN_CREDIT:
-			publishHopperEvent("{\"event\":\"coin credit\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_EMPTY:
-			publishHopperEvent("{\"event\":\"empty\"}");
-			break;
-		case SSP_POLL_EMPTYING:
-			publishHopperEvent("{\"event\":\"emptying\"}");
-			break;
-		case SSP_POLL_SMART_EMPTYING:
-			publishHopperEvent("{\"event\":\"smart emptying\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_SMART_EMPTIED:
-			publishHopperEvent("{\"event\":\"smart emptied\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_CREDIT:
-			// The note which was in escrow has been accepted
-			publishHopperEvent("{\"event\":\"credit\",\"channel\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_INCOMPLETE_PAYOUT:
-			// the validator shutdown during a payout, this event is reporting that some value remains to payout
-			publishHopperEvent(
-					"{\"event\":\"incomplete payout\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
-			break;
-		case SSP_POLL_INCOMPLETE_FLOAT:
-			// the validator shutdown during a float, this event is reporting that some value remains to float
-			publishHopperEvent(
-					"{\"event\":\"incomplete float\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
-			break;
-		case SSP_POLL_DISABLED:
-			// The unit has been disabled
-			publishHopperEvent("{\"event\":\"disabled\"}");
-			break;
-		case SSP_POLL_CALIBRATION_FAIL:
-			// the hopper calibration has failed. An extra byte is available with an error code.
-			switch (poll->events[i].data1) {
-			case NO_FAILUE:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"no error\"}");
-				break;
-			case SENSOR_FLAP:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor flap\"}");
-				break;
-			case SENSOR_EXIT:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor exit\"}");
-				break;
-			case SENSOR_COIL1:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 1\"}");
-				break;
-			case SENSOR_COIL2:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 2\"}");
-				break;
-			case NOT_INITIALISED:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"not initialized\"}");
-				break;
-			case CHECKSUM_ERROR:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"checksum error\"}");
-				break;
-			case COMMAND_RECAL:
-				publishHopperEvent("{\"event\":\"recalibrating\"}");
-				ssp6_run_calibration(&device->sspC);
-				break;
-			}
-			break;
-		default:
-			// fallback only. in case we got a message which is not handled above.
-			// if you can see this have a look in the SSP reference manual what
-			// the message is about.
-			publishHopperEvent("{\"event\":\"unknown\",\"id\":\"0x%02X\"}", poll->events[i].event);
-			break;
+struct m_poll_event_def {
+	/** \brief Start of the JSON message: {"event":"<name>" */
+	const char *prefix;
+	/** \brief Length of prefix */
+	unsigned char prefixLen;
+	/** \brief Fields published for the hopper (EVENT_* bits, 0: unknown to the hopper) */
+	unsigned char hopper;
+	/** \brief Fields published for the validator (EVENT_* bits, 0: unknown to the validator) */
+	unsigned char validator;
+};
+
+/**
+ * \brief How the SSP poll events are published, indexed by the event code. The fields follow
+ * the name in a fixed order: amount, channel, dispensed, requested, cc, error.
+ */
+static const struct m_poll_event_def POLL_EVENT_DEFS[256] = {
+	[SSP_POLL_RESET] = { EVENT_PREFIX("unit reset"), EVENT_KNOWN, EVENT_KNOWN },
+	// data1 > 0: a note has been validated and is in escrow (reported as "reading" otherwise)
+	[SSP_POLL_READ] = { EVENT_PREFIX("read"),
+			EVENT_KNOWN | EVENT_CHANNEL, EVENT_KNOWN | EVENT_SCALED_AMOUNT | EVENT_CHANNEL },
+	// the note which was in escrow has been accepted
+	[SSP_POLL_CREDIT] = { EVENT_PREFIX("credit"),
+			EVENT_KNOWN | EVENT_CHANNEL | EVENT_CC, EVENT_KNOWN | EVENT_SCALED_AMOUNT | EVENT_CHANNEL },
+	[SSP_POLL_TIMEOUT] = { EVENT_PREFIX("timeout"),
+			EVENT_KNOWN | EVENT_AMOUNT | EVENT_CC, EVENT_KNOWN | EVENT_AMOUNT | EVENT_CC },
+	[SSP_POLL_DISPENSING] = { EVENT_PREFIX("dispensing"), EVENT_KNOWN | EVENT_AMOUNT, 0 },
+	[SSP_POLL_DISPENSED] = { EVENT_PREFIX("dispensed"), EVENT_KNOWN | EVENT_AMOUNT, 0 },
+	[SSP_POLL_FLOATING] = { EVENT_PREFIX("floating"), EVENT_KNOWN | EVENT_AMOUNT | EVENT_CC, 0 },
+	[SSP_POLL_FLOATED] = { EVENT_PREFIX("floated"), EVENT_KNOWN | EVENT_AMOUNT | EVENT_CC, 0 },
+	[SSP_POLL_CASHBOX_PAID] = { EVENT_PREFIX("cashbox paid"), EVENT_KNOWN | EVENT_AMOUNT | EVENT_CC, 0 },
+	[SSP_POLL_JAMMED] = { EVENT_PREFIX("jammed"), EVENT_KNOWN, 0 },
+	[SSP_POLL_FRAUD_ATTEMPT] = { EVENT_PREFIX("fraud attempt"), EVENT_KNOWN, EVENT_KNOWN | EVENT_DISPENSED },
+	[SSP_POLL_COIN_CREDIT] = { EVENT_PREFIX("coin credit"), EVENT_KNOWN | EVENT_AMOUNT | EVENT_CC, 0 },
+	[SSP_POLL_EMPTY] = { EVENT_PREFIX("empty"), EVENT_KNOWN, EVENT_KNOWN },
+	[SSP_POLL_EMPTYING] = { EVENT_PREFIX("emptying"), EVENT_KNOWN, EVENT_KNOWN },
+	[SSP_POLL_SMART_EMPTYING] = { EVENT_PREFIX("smart emptying"), EVENT_KNOWN | EVENT_AMOUNT | EVENT_CC, EVENT_KNOWN },
+	[SSP_POLL_SMART_EMPTIED] = { EVENT_PREFIX("smart emptied"), EVENT_KNOWN | EVENT_AMOUNT | EVENT_CC, 0 },
+	// the device shut down during a payout or float, some value remains to be paid out
+	[SSP_POLL_INCOMPLETE_PAYOUT] = { EVENT_PREFIX("incomplete payout"),
+			EVENT_KNOWN | EVENT_DISPENSED | EVENT_REQUESTED | EVENT_CC,
+			EVENT_KNOWN | EVENT_DISPENSED | EVENT_REQUESTED | EVENT_CC },
+	[SSP_POLL_INCOMPLETE_FLOAT] = { EVENT_PREFIX("incomplete float"),
+			EVENT_KNOWN | EVENT_DISPENSED | EVENT_REQUESTED | EVENT_CC,
+			EVENT_KNOWN | EVENT_DISPENSED | EVENT_REQUESTED | EVENT_CC },
+	[SSP_POLL_DISABLED] = { EVENT_PREFIX("disabled"), EVENT_KNOWN, EVENT_KNOWN },
+	[SSP_POLL_CALIBRATION_FAIL] = { EVENT_PREFIX("calibration fail"),
+			EVENT_KNOWN | EVENT_ERROR, EVENT_KNOWN | EVENT_ERROR },
+	[SSP_POLL_REJECTING] = { EVENT_PREFIX("rejecting"), 0, EVENT_KNOWN },
+	[SSP_POLL_REJECTED] = { EVENT_PREFIX("rejected"), 0, EVENT_KNOWN },
+	[SSP_POLL_STACKING] = { EVENT_PREFIX("stacking"), 0, EVENT_KNOWN },
+	// the note has been stored in the payout unit
+	[SSP_POLL_STORED] = { EVENT_PREFIX("stored"), 0, EVENT_KNOWN },
+	// the note has been stacked in the cashbox
+	[SSP_POLL_STACKED] = { EVENT_PREFIX("stacked"), 0, EVENT_KNOWN },
+	[SSP_POLL_SAFE_JAM] = { EVENT_PREFIX("safe jam"), 0, EVENT_KNOWN },
+	[SSP_POLL_UNSAFE_JAM] = { EVENT_PREFIX("unsafe jam"), 0, EVENT_KNOWN },
+	[SSP_POLL_STACKER_FULL] = { EVENT_PREFIX("stacker full"), 0, EVENT_KNOWN },
+	[SSP_POLL_CASH_BOX_REMOVED] = { EVENT_PREFIX("cashbox removed"), 0, EVENT_KNOWN },
+	[SSP_POLL_CASH_BOX_REPLACED] = { EVENT_PREFIX("cashbox replaced"), 0, EVENT_KNOWN },
+	// a note was in the notepath at startup and has been cleared
+	[SSP_POLL_CLEARED_FROM_FRONT] = { EVENT_PREFIX("cleared from front"), 0, EVENT_KNOWN },
+	[SSP_POLL_CLEARED_INTO_CASHBOX] = { EVENT_PREFIX("cleared into cashbox"), 0, EVENT_KNOWN },
+};
+
+/**
+ * \brief The errors reported by SSP_POLL_CALIBRATION_FAIL, indexed by enum calibration_failures
+ * (COMMAND_RECAL is published as "recalibrating").
+ */
+static const char *CALIBRATION_ERRORS[] = {
+	[NO_FAILUE] = "no error",
+	[SENSOR_FLAP] = "sensor flap",
+	[SENSOR_EXIT] = "sensor exit",
+	[SENSOR_COIL1] = "sensor coil 1",
+	[SENSOR_COIL2] = "sensor coil 2",
+	[NOT_INITIALISED] = "not initialized",
+	[CHECKSUM_ERROR] = "checksum error",
+};
+
+/**
+ * \brief Appends ,"<name>":<value> to the JSON message.
+ */
+static void appendEventField(struct buffer *json, const char *name, unsigned long long value) {
+	bufferAppendString(json, name);
+	bufferAppendUnsigned(json, value);
+}
+
+/**
+ * \brief Publishes a poll event of the device to its event topic as described by POLL_EVENT_DEFS.
+ */
+void publishPollEvent(struct m_device *device, SSP_POLL_EVENT6 *event) {
+	const struct m_poll_event_def *def = &POLL_EVENT_DEFS[event->event];
+	unsigned char fields = device->type == DEVICE_HOPPER ? def->hopper : def->validator;
+	struct m_topic *topic = device->type == DEVICE_HOPPER ? &hopperEventTopic : &validatorEventTopic;
+
+	if (! (fields & EVENT_KNOWN)) {
+		// fallback only. in case we got a message which is not in POLL_EVENT_DEFS.
+		// if you can see this have a look in the SSP reference manual what
+		// the message is about.
+		replyWith(topic, "{\"event\":\"unknown\",\"id\":\"0x%02X\"}", event->event);
+		return;
+	}
+	if (event->event == SSP_POLL_READ && event->data1 == 0) {
+		// this is reported more than once for a single note
+		replyWith(topic, "{\"event\":\"reading\"}");
+		return;
+	}
+	if (fields & EVENT_ERROR) {
+		if (event->data1 == COMMAND_RECAL) {
+			replyWith(topic, "{\"event\":\"recalibrating\"}");
+			return;
+		}
+		if (event->data1 >= sizeof(CALIBRATION_ERRORS) / sizeof(CALIBRATION_ERRORS[0])) {
+			return;
+		}
+	}
+
+	char storage[128];
+	struct buffer json;
+	bufferInit(&json, storage, sizeof(storage));
+
+	bufferAppend(&json, def->prefix, def->prefixLen);
+	if (fields & EVENT_AMOUNT) {
+		appendEventField(&json, ",\"amount\":", event->data1);
+	}
+	if (fields & EVENT_SCALED_AMOUNT) {
+		unsigned long amount = 0;
+		if (event->data1 > 0 && event->data1 <= device->sspSetupReq.NumberOfChannels) {
+			amount = device->sspSetupReq.ChannelData[event->data1 - 1].value * 100;
 		}
+		appendEventField(&json, ",\"amount\":", amount);
+	}
+	if (fields & EVENT_CHANNEL) {
+		appendEventField(&json, ",\"channel\":", event->data1);
+	}
+	if (fields & EVENT_DISPENSED) {
+		appendEventField(&json, ",\"dispensed\":", event->data1);
+	}
+	if (fields & EVENT_REQUESTED) {
+		appendEventField(&json, ",\"requested\":", event->data2);
+	}
+	if (fields & EVENT_CC) {
+		bufferAppendString(&json, ",\"cc\":");
+		bufferAppendJsonString(&json, event->cc);
 	}
+	if (fields & EVENT_ERROR) {
+		bufferAppendString(&json, ",\"error\":");
+		bufferAppendJsonString(&json, CALIBRATION_ERRORS[event->data1]);
+	}
+	bufferAppendChar(&json, '}');
+
+	replyWith(topic, "%s", json.data);
+
+	bufferFree(&json);
 }
 
 /**
- * \brief Callback function used for inspecting and publishing events reported by the Validator hardware.
+ * \brief Callback function used for inspecting and publishing the events reported by the
+ * hardware (hopper and validator).
  */
-void validatorEventHandler(struct m_device *device,
-		struct m_metacash *metacash, SSP_POLL_DATA6 *poll) {
-	for (unsigned char i = 0; i < poll->event_count; ++i) {
-		switch (poll->events[i].event) {
-		case SSP_POLL_RESET:
-			publishValidatorEvent("{\"event\":\"unit reset\"}");
-			// Make sure we are using ssp version 6
-			if (ssp6_host_protocol(&device->sspC, 0x06) != SSP_RESPONSE_OK) {
-				die("validatorEventHandler: SSP Host Protocol Failed", 3);
-				// never reached, already exited
-			}
-			break;
-		case SSP_POLL_READ:
-			// the \"read\" event contains 1 data value, which if >0 means a note has been validated and is in escrow
-			if (poll->events[i].data1 > 0) {
-				// The note which was in escrow has been accepted
-				unsigned long amount =
-						device->sspSetupReq.ChannelData[poll->events[i].data1 - 1].value
-								* 100;
-				publishValidatorEvent("{\"event\":\"read\",\"amount\":%ld,\"channel\":%ld}",
-						amount, poll->events[i].data1);
-			} else {
-				publishValidatorEvent("{\"event\":\"reading\"}");
-			}
-			break;
-		case SSP_POLL_EMPTY:
-			publishValidatorEvent("{\"event\":\"empty\"}");
-			break;
-		case SSP_POLL_EMPTYING:
-			publishValidatorEvent("{\"event\":\"emptying\"}");
-			break;
-		case SSP_POLL_SMART_EMPTYING:
-			publishValidatorEvent("{\"event\":\"smart emptying\"}");
-			break;
-		case SSP_POLL_TIMEOUT:
-			publishValidatorEvent("{\"event\":\"timeout\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_CREDIT:
-			// The note which was in escrow has been accepted
-		{
-			unsigned long amount =
-					device->sspSetupReq.ChannelData[poll->events[i].data1 - 1].value
-							* 100;
-			publishValidatorEvent("{\"event\":\"credit\",\"amount\":%ld,\"channel\":%ld}",
-					amount, poll->events[i].data1);
+void pollEventHandler(struct m_device *device,
+		struct m_metacash *metacash, struct m_poll_iterator *events) {
+	SSP_POLL_EVENT6 event;
+	int reset = 0;
+	int recalibrate = 0;
+
+	while (pollIteratorNext(events, &event)) {
+		device->events[event.event]++;
+		levelsApplyEvent(device, &event);
+		publishPollEvent(device, &event);
+
+		if (event.event == SSP_POLL_RESET) {
+			// versions and setup data may have changed (e.g. after a firmware download)
+			deviceInfoInvalidate(device);
+			reset = 1;
+		} else if (event.event == SSP_POLL_CALIBRATION_FAIL && event.data1 == COMMAND_RECAL) {
+			recalibrate = 1;
 		}
-			break;
-		case SSP_POLL_INCOMPLETE_PAYOUT:
-			// the validator shutdown during a payout, this event is reporting that some value remains to payout
-			publishValidatorEvent(
-					"{\"event\":\"incomplete payout\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
-			break;
-		case SSP_POLL_INCOMPLETE_FLOAT:
-			// the validator shutdown during a float, this event is reporting that some value remains to float
-			publishValidatorEvent(
-					"{\"event\":\"incomplete float\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
-			break;
-		case SSP_POLL_REJECTING:
-			publishValidatorEvent("{\"event\":\"rejecting\"}");
-			break;
-		case SSP_POLL_REJECTED:
-			// The note was rejected
-			publishValidatorEvent("{\"event\":\"rejected\"}");
-			break;
-		case SSP_POLL_STACKING:
-			publishValidatorEvent("{\"event\":\"stacking\"}");
-			break;
-		case SSP_POLL_STORED:
-			// The note has been stored in the payout unit
-			publishValidatorEvent("{\"event\":\"stored\"}");
-			break;
-		case SSP_POLL_STACKED:
-			// The note has been stacked in the cashbox
-			publishValidatorEvent("{\"event\":\"stacked\"}");
-			break;
-		case SSP_POLL_SAFE_JAM:
-			publishValidatorEvent("{\"event\":\"safe jam\"}");
-			break;
-		case SSP_POLL_UNSAFE_JAM:
-			publishValidatorEvent("{\"event\":\"unsafe jam\"}");
-			break;
-		case SSP_POLL_DISABLED:
-			// The validator has been disabled
-			publishValidatorEvent("{\"event\":\"disabled\"}");
-			break;
-		case SSP_POLL_FRAUD_ATTEMPT:
-			// The validator has detected a fraud attempt
-			publishValidatorEvent(
-					"{\"event\":\"fraud attempt\",\"dispensed\":%ld}",
-					poll->events[i].data1);
-			break;
-		case SSP_POLL_STACKER_FULL:
-			// The cashbox is full
-			publishValidatorEvent("{\"event\":\"stacker full\"}");
-			break;
-		case SSP_POLL_CASH_BOX_REMOVED:
-			// The cashbox has been removed
-			publishValidatorEvent("{\"event\":\"cashbox removed\"}");
-			break;
-		case SSP_POLL_CASH_BOX_REPLACED:
-			// The cashbox has been replaced
-			publishValidatorEvent("{\"event\":\"cashbox replaced\"}");
-			break;
-		case SSP_POLL_CLEARED_FROM_FRONT:
-			// A note was in the notepath at startup and has been cleared from the front of the validator
-			publishValidatorEvent("{\"event\":\"cleared from front\"}");
-			break;
-		case SSP_POLL_CLEARED_INTO_CASHBOX:
-			// A note was in the notepath at startup and has been cleared into the cashbox
-			publishValidatorEvent("{\"event\":\"cleared into cashbox\"}");
-			break;
-		case SSP_POLL_CALIBRATION_FAIL:
-			// the hopper calibration has failed. An extra byte is available with an error code.
-			switch (poll->events[i].data1) {
-			case NO_FAILUE:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"no error\"}");
-				break;
-			case SENSOR_FLAP:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor flap\"}");
-				break;
-			case SENSOR_EXIT:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor exit\"}");
-				break;
-			case SENSOR_COIL1:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 1\"}");
-				break;
-			case SENSOR_COIL2:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 2\"}");
-				break;
-			case NOT_INITIALISED:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"not initialized\"}");
-				break;
-			case CHECKSUM_ERROR:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"checksum error\"}");
-				break;
-			case COMMAND_RECAL:
-				publishValidatorEvent("{\"event\":\"recalibrating\"}");
-				ssp6_run_calibration(&device->sspC);
-				break;
-			}
-			break;
-		default:
-			// fallback only. in case we got a message which is not handled above.
-			// if you can see this have a look in the SSP reference manual what
-			// the message is about.
-			publishValidatorEvent("{\"event\":\"unknown\",\"id\":\"0x%02X\"}", poll->events[i].event);
-			break;
+	}
+
+	// the SSP commands are sent only now, they overwrite the response the events are decoded from
+	if (reset) {
+		// Make sure we are using ssp version 6
+		if (ssp6_host_protocol(&device->sspC, 0x06) != SSP_RESPONSE_OK) {
+			die("pollEventHandler: SSP Host Protocol Failed", 3);
+			// never reached, already exited
 		}
 	}
+	if (recalibrate) {
+		ssp6_run_calibration(&device->sspC);
+	}
 }
 
 /**
@@ -1682,24 +4046,55 @@ void setup(struct m_metacash *metacash) {
 	// initialize libEvent
 	metacash->eventBase = event_base_new();
 
-	// connect to redis
-	redisPublishCtx = connectRedis(metacash); // establish connection for publishing
-	redisSubscribeCtx = connectRedis(metacash); // establich connection for subscribing
-
-	// setup redis
-	if (redisPublishCtx && redisSubscribeCtx) {
-		redisLibeventAttach(redisPublishCtx, metacash->eventBase);
-		redisAsyncSetConnectCallback(redisPublishCtx, cbOnConnectPublishContext);
-		redisAsyncSetDisconnectCallback(redisPublishCtx, cbOnDisconnectPublishContext);
-
-		redisLibeventAttach(redisSubscribeCtx, metacash->eventBase);
-		redisAsyncSetConnectCallback(redisSubscribeCtx, cbOnConnectSubscribeContext);
-		redisAsyncSetDisconnectCallback(redisSubscribeCtx, cbOnDisconnectSubscribeContext);
-	} else {
+	// connect to redis
+	srandom(time(NULL) ^ getpid()); // jitter of the reconnects
+	redisLinkInit(&publishLink, "publish", &redisPublishCtx,
+			cbOnConnectPublishContext, cbOnDisconnectPublishContext, metacash);
+	redisLinkInit(&subscribeLink, "subscribe", &redisSubscribeCtx,
+			cbOnConnectSubscribeContext, cbOnDisconnectSubscribeContext, metacash);
+	redisLinkInit(&streamLink, "stream", &redisStreamCtx,
+			cbOnConnectStreamContext, cbOnDisconnectStreamContext, metacash);
+
+	// prepare the topics we publish to
+	namespaceInit(metacash->topicNamespace);
+	topicInit(&payoutEventTopic);
+	topicInit(&hopperEventTopic);
+	topicInit(&hopperResponseTopic);
+	topicInit(&validatorEventTopic);
+	topicInit(&validatorResponseTopic);
+	topicInit(&hopperEventBatchTopic);
+	topicInit(&validatorEventBatchTopic);
+	topicInit(&payoutMetricsTopic);
+	topicInitStream(&hopperEventTopic, metacash->outputMode, metacash->streamMaxlen);
+	topicInitStream(&validatorEventTopic, metacash->outputMode, metacash->streamMaxlen);
+	if (metacash->eventRing.shared) {
+		hopperEventTopic.ring = &metacash->eventRing;
+		validatorEventTopic.ring = &metacash->eventRing;
+	}
+	if (eventSpool.dir) {
+		payoutEventTopic.spooled = 1;
+		hopperEventTopic.spooled = 1;
+		validatorEventTopic.spooled = 1;
+		evtimer_set(&evSpoolReplay, cbOnSpoolReplayEvent, NULL);
+		event_base_set(metacash->eventBase, &evSpoolReplay);
+	}
+	outbound.policy = metacash->dropPolicy;
+
+	msgIdInit(&metacash->msgIds);
+
+	// setup redis (messages published until the publish connection is established are buffered)
+	if (redisLinkConnect(&publishLink) || redisLinkConnect(&subscribeLink)
+			|| (metacash->streamIntake && redisLinkConnect(&streamLink))) {
 		die("could not establish connection to redis", 1);
 		// never reached, already exited
 	}
 
+	// setup libevent triggered execution of the queued commands (scheduled on demand)
+	requestQueueInit(&metacash->queue);
+	json_set_alloc_funcs(jsonAlloc, jsonFree);
+	evtimer_set(&metacash->evDispatch, cbOnDispatchEvent, metacash); // provide metacash in privdata
+	event_base_set(metacash->eventBase, &metacash->evDispatch);
+
 	// setup libevent triggered check if we should quit (every 500ms more or less)
 	{
 		struct timeval interval;
@@ -1713,6 +4108,9 @@ void setup(struct m_metacash *metacash) {
 
 	// try to initialize the hardware only if we successfully have opened the device
 	if (metacash->deviceAvailable) {
+		// collect the round-trip times and errors of every ssp command (see get-stats)
+		set_ssp_command_observer(cbOnSspCommand, metacash);
+
 		// prepare the device structures
 		mcSspSetupCommand(&metacash->validator.sspC, metacash->validator.id);
 		mcSspSetupCommand(&metacash->hopper.sspC, metacash->hopper.id);
@@ -1793,6 +4191,31 @@ void setup(struct m_metacash *metacash) {
 		syslog(LOG_INFO, "setup finished successfully\n");
 	}
 
+	// seed the cached levels and compare them with the hardware from time to time
+	if (metacash->deviceAvailable) {
+		levelsRefresh(&metacash->hopper);
+		levelsRefresh(&metacash->validator);
+
+		struct timeval interval;
+		interval.tv_sec = LEVELS_RECONCILE_INTERVAL;
+		interval.tv_usec = 0;
+
+		event_set(&metacash->evReconcile, 0, EV_PERSIST, cbOnReconcileEvent, metacash); // provide metacash in privdata
+		event_base_set(metacash->eventBase, &metacash->evReconcile);
+		evtimer_add(&metacash->evReconcile, &interval);
+	}
+
+	// setup libevent triggered metrics snapshots
+	if (metacash->metricsInterval > 0) {
+		struct timeval interval;
+		interval.tv_sec = metacash->metricsInterval;
+		interval.tv_usec = 0;
+
+		event_set(&metacash->evMetrics, 0, EV_PERSIST, cbOnMetricsEvent, metacash); // provide metacash in privdata
+		event_base_set(metacash->eventBase, &metacash->evMetrics);
+		evtimer_add(&metacash->evMetrics, &interval);
+	}
+
 	// setup libevent triggered polling of the hardware (every second more or less)
 	{
 		struct timeval interval;
@@ -1848,17 +4271,136 @@ void mcSspCloseSerialDevice(struct m_metacash *metacash) {
 	close_ssp_port();
 }
 
+/**
+ * \brief Data bytes following an SSP poll event code, see POLL_EVENT_LAYOUT.
+ */
+struct m_poll_event_layout {
+	/** \brief Number of data bytes (per country for multi country events) */
+	unsigned char size;
+	/** \brief If !=0 the data starts with a country count, the event is reported once per country */
+	unsigned char multiCountry;
+	/** \brief Number of 4 byte little endian values (data1, data2), if 0 a single data byte is data1 */
+	unsigned char values;
+	/** \brief If !=0 the values are followed by a 3 byte country code */
+	unsigned char hasCc;
+};
+
+/**
+ * \brief Layout of the data of the SSP poll events, indexed by the event code (every other
+ * event has no data).
+ */
+static const struct m_poll_event_layout POLL_EVENT_LAYOUT[256] = {
+	[SSP_POLL_READ] = { 1, 0, 0, 0 },
+	[SSP_POLL_CREDIT] = { 1, 0, 0, 0 },
+	[SSP_POLL_CLEARED_FROM_FRONT] = { 1, 0, 0, 0 },
+	[SSP_POLL_CLEARED_INTO_CASHBOX] = { 1, 0, 0, 0 },
+	[SSP_POLL_CALIBRATION_FAIL] = { 1, 0, 0, 0 },
+	[SSP_POLL_COIN_CREDIT] = { 7, 0, 1, 1 },
+	[SSP_POLL_DISPENSING] = { 7, 1, 1, 1 },
+	[SSP_POLL_DISPENSED] = { 7, 1, 1, 1 },
+	[SSP_POLL_JAMMED] = { 7, 1, 1, 1 },
+	[SSP_POLL_HALTED] = { 7, 1, 1, 1 },
+	[SSP_POLL_FLOATING] = { 7, 1, 1, 1 },
+	[SSP_POLL_FLOATED] = { 7, 1, 1, 1 },
+	[SSP_POLL_TIMEOUT] = { 7, 1, 1, 1 },
+	[SSP_POLL_CASHBOX_PAID] = { 7, 1, 1, 1 },
+	[SSP_POLL_SMART_EMPTYING] = { 7, 1, 1, 1 },
+	[SSP_POLL_SMART_EMPTIED] = { 7, 1, 1, 1 },
+	[SSP_POLL_FRAUD_ATTEMPT] = { 7, 1, 1, 1 },
+	[SSP_POLL_INCOMPLETE_PAYOUT] = { 11, 1, 2, 1 },
+	[SSP_POLL_INCOMPLETE_FLOAT] = { 11, 1, 2, 1 },
+};
+
+/**
+ * \brief Prepares the iterator for the events in the response to the last SSP command (a poll).
+ */
+void pollIteratorInit(struct m_poll_iterator *it, const SSP_COMMAND *sspC) {
+	it->data = sspC->ResponseData;
+	it->len = sspC->ResponseDataLength;
+	it->pos = 1; // skip the response code
+	it->event = 0;
+	it->countries = 0;
+	it->truncated = 0;
+}
+
+static unsigned long readLittleEndian32(const unsigned char *p) {
+	return (unsigned long) p[0] | ((unsigned long) p[1] << 8) | ((unsigned long) p[2] << 16)
+			| ((unsigned long) p[3] << 24);
+}
+
+/**
+ * \brief Decodes the next event (an event reported for several countries is returned once
+ * per country). Returns 1 if there was one, 0 at the end of the response.
+ * \details Every event is checked against the length of the response, if the response ends
+ * in the middle of an event the rest is dropped and truncated is set.
+ */
+int pollIteratorNext(struct m_poll_iterator *it, SSP_POLL_EVENT6 *event) {
+	event->data1 = 0;
+	event->data2 = 0;
+	memset(event->cc, 0, sizeof(event->cc));
+
+	if (it->countries == 0) {
+		if (it->pos >= it->len) {
+			return 0;
+		}
+		it->event = it->data[it->pos++];
+
+		if (POLL_EVENT_LAYOUT[it->event].multiCountry) {
+			if (it->pos >= it->len) {
+				it->truncated = 1;
+				return 0;
+			}
+			it->countries = it->data[it->pos++];
+			if (it->countries == 0) {
+				// reported without any country
+				event->event = it->event;
+				return 1;
+			}
+		}
+	}
+
+	const struct m_poll_event_layout *layout = &POLL_EVENT_LAYOUT[it->event];
+	if (layout->size > it->len - it->pos) {
+		it->truncated = 1;
+		it->pos = it->len;
+		it->countries = 0;
+		return 0;
+	}
+
+	const unsigned char *p = it->data + it->pos;
+	it->pos += layout->size;
+	if (layout->multiCountry) {
+		it->countries--;
+	}
+
+	event->event = it->event;
+	if (layout->values == 0) {
+		if (layout->size > 0) {
+			event->data1 = p[0];
+		}
+	} else {
+		event->data1 = readLittleEndian32(p);
+		if (layout->values > 1) {
+			event->data2 = readLittleEndian32(p + 4);
+		}
+	}
+	if (layout->hasCc) {
+		memcpy(event->cc, p + 4 * layout->values, 3);
+	}
+
+	return 1;
+}
+
 /**
  * \brief Issues a poll command to the hardware and dispatches the response to the event handler function of the device.
+ * \details The handler decodes the events with a m_poll_iterator straight from the response.
  */
 void mcSspPollDevice(struct m_device *device, struct m_metacash *metacash) {
-	SSP_POLL_DATA6 poll;
-
 	hardwareWaitTime();
 
 	// poll the unit
 	SSP_RESPONSE_ENUM resp;
-	if ((resp = ssp6_poll(&device->sspC, &poll)) != SSP_RESPONSE_OK) {
+	if ((resp = mc_ssp_poll(&device->sspC)) != SSP_RESPONSE_OK) {
 		if (resp == SSP_RESPONSE_TIMEOUT) {
 			// If the poll timed out, then give up
 			syslog(LOG_WARNING, "SSP Poll Timeout\n");
@@ -1877,16 +4419,429 @@ void mcSspPollDevice(struct m_device *device, struct m_metacash *metacash) {
 			}
 		}
 	} else {
-		if (poll.event_count > 0) {
-			syslog(LOG_INFO, "parsing poll response from \"%s\" now (%d events)\n",
-					device->name, poll.event_count);
-			device->eventHandlerFn(device, metacash, &poll);
+		// anything after the response code is an event
+		if (device->sspC.ResponseDataLength > 1) {
+			syslog(LOG_INFO, "parsing poll response from \"%s\" now (%u bytes)\n",
+					device->name, device->sspC.ResponseDataLength - 1);
+			// the events of this poll cycle are collected for the batch topic
+			if (device->type == DEVICE_HOPPER) {
+				eventBatchBegin(&hopperEventTopic, metacash->publishEventBatch ? &hopperEventBatchTopic : NULL);
+			} else {
+				eventBatchBegin(&validatorEventTopic, metacash->publishEventBatch ? &validatorEventBatchTopic : NULL);
+			}
+			struct m_poll_iterator events;
+			pollIteratorInit(&events, &device->sspC);
+			device->eventHandlerFn(device, metacash, &events);
+			eventBatchEnd();
+
+			if (events.truncated) {
+				syslog(LOG_WARNING, "poll response from \"%s\" ends within an event, the rest has been dropped\n",
+						device->name);
+			}
 		} else {
 			//printf("polling \"%s\" returned no events\n", device->name);
 		}
 	}
 }
 
+/**
+ * \brief Fills the m_device_info of the device, expects m_device.sspSetupReq to be current.
+ */
+SSP_RESPONSE_ENUM deviceInfoLoad(struct m_device *device) {
+	struct m_device_info *info = &device->info;
+	SSP_RESPONSE_ENUM resp;
+
+	info->valid = 0;
+
+	if ((resp = mc_ssp_get_firmware_version(&device->sspC, info->firmwareVersion)) != SSP_RESPONSE_OK) {
+		syslog(LOG_WARNING, "could not get the firmware version of device '%s'\n", device->name);
+		return resp;
+	}
+	if ((resp = mc_ssp_get_dataset_version(&device->sspC, info->datasetVersion)) != SSP_RESPONSE_OK) {
+		syslog(LOG_WARNING, "could not get the dataset version of device '%s'\n", device->name);
+		return resp;
+	}
+	if ((resp = mc_ssp_get_serial_number(&device->sspC, &info->serialNumber)) != SSP_RESPONSE_OK) {
+		syslog(LOG_WARNING, "could not get the serial number of device '%s'\n", device->name);
+		return resp;
+	}
+
+	info->valid = 1;
+	return SSP_RESPONSE_OK;
+}
+
+/**
+ * \brief Makes sure the m_device_info of the device is current, only talks to the
+ * hardware if it has been invalidated (or could not be loaded before).
+ */
+SSP_RESPONSE_ENUM deviceInfoEnsure(struct m_device *device) {
+	if (device->info.valid) {
+		return SSP_RESPONSE_OK;
+	}
+
+	SSP_RESPONSE_ENUM resp = ssp6_setup_request(&device->sspC, &device->sspSetupReq);
+	if (resp != SSP_RESPONSE_OK) {
+		syslog(LOG_WARNING, "could not refresh the setup data of device '%s'\n", device->name);
+		return resp;
+	}
+
+	return deviceInfoLoad(device);
+}
+
+/**
+ * \brief Marks the m_device_info of the device as outdated (e.g. after a reset).
+ */
+void deviceInfoInvalidate(struct m_device *device) {
+	device->info.valid = 0;
+}
+
+/**
+ * \brief Returns the entry of the denomination in the cached levels (NULL if unknown).
+ */
+struct m_level *levelsFind(struct m_levels *levels, unsigned int value, const char *cc) {
+	for (unsigned int i = 0; i < levels->count; i++) {
+		struct m_level *entry = &levels->entries[i];
+		if (entry->value == value && (cc == NULL || cc[0] == 0 || strcmp(entry->cc, cc) == 0)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * \brief Sets the cached level of a denomination. An unknown denomination invalidates the cache.
+ */
+void levelsSet(struct m_levels *levels, unsigned int value, const char *cc, int level) {
+	struct m_level *entry = levelsFind(levels, value, cc);
+	if (entry) {
+		entry->level = level;
+	} else {
+		levels->valid = 0;
+	}
+}
+
+/**
+ * \brief Changes the cached level of a denomination by delta. An unknown denomination invalidates the cache.
+ */
+void levelsAdd(struct m_levels *levels, unsigned int value, const char *cc, int delta) {
+	struct m_level *entry = levelsFind(levels, value, cc);
+	if (entry) {
+		entry->level += delta;
+	} else {
+		levels->valid = 0;
+	}
+}
+
+/**
+ * \brief Replaces the cached levels with the ones reported by the hardware.
+ * \details Differences to a valid cache are logged as drift.
+ */
+SSP_RESPONSE_ENUM levelsRefresh(struct m_device *device) {
+	struct m_levels current;
+	memset(&current, 0, sizeof(current));
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_get_all_levels(&device->sspC, &current);
+	if (resp != SSP_RESPONSE_OK) {
+		syslog(LOG_WARNING, "could not get the levels of device '%s'\n", device->name);
+		return resp;
+	}
+
+	struct m_levels *levels = &device->levels;
+
+	if (levels->valid) {
+		for (unsigned int i = 0; i < current.count; i++) {
+			struct m_level *entry = &current.entries[i];
+			struct m_level *cached = levelsFind(levels, entry->value, entry->cc);
+			int cachedLevel = cached ? cached->level : 0;
+			if (cachedLevel != entry->level) {
+				levels->drifts++;
+				syslog(LOG_WARNING, "level drift on device '%s': value=%u cc=%s cached=%d device=%d\n",
+						device->name, entry->value, entry->cc, cachedLevel, entry->level);
+			}
+		}
+	}
+
+	levels->count = current.count;
+	memcpy(levels->entries, current.entries, sizeof(current.entries));
+	levels->valid = 1;
+
+	return SSP_RESPONSE_OK;
+}
+
+/**
+ * \brief Appends a level as a JSON object.
+ */
+static void levelToJson(struct buffer *json, unsigned int value, int level, const char *cc) {
+	bufferAppendString(json, "{\"value\":");
+	bufferAppendUnsigned(json, value);
+	bufferAppendString(json, ",\"level\":");
+	bufferAppendSigned(json, level);
+	bufferAppendString(json, ",\"cc\":");
+	bufferAppendJsonString(json, cc);
+	bufferAppendChar(json, '}');
+}
+
+/**
+ * \brief Appends the cached levels as the elements of a JSON array.
+ */
+void levelsToJson(struct m_levels *levels, struct buffer *json) {
+	for (unsigned int i = 0; i < levels->count; i++) {
+		struct m_level *entry = &levels->entries[i];
+
+		if(i > 0) {
+			bufferAppendChar(json, ','); // json array seperator
+		}
+		levelToJson(json, entry->value, entry->level, entry->cc);
+	}
+}
+
+/**
+ * \brief Updates the cached levels of the device according to a poll event.
+ * \details Coins credited to the hopper and notes stored in the payout increment the level of
+ * their denomination. Events which only report a total amount (dispensed, floated, cashbox paid,
+ * emptied, ...) invalidate the cache, the next get-all-levels (or reconcile) reloads it.
+ */
+void levelsApplyEvent(struct m_device *device, SSP_POLL_EVENT6 *event) {
+	struct m_levels *levels = &device->levels;
+
+	switch (event->event) {
+	case SSP_POLL_COIN_CREDIT:
+		levelsAdd(levels, event->data1, event->cc, 1);
+		break;
+	case SSP_POLL_READ:
+	case SSP_POLL_CREDIT:
+		if (device->type == DEVICE_VALIDATOR && event->data1 > 0
+				&& event->data1 <= device->sspSetupReq.NumberOfChannels) {
+			levels->pendingNoteValue = device->sspSetupReq.ChannelData[event->data1 - 1].value * 100;
+		}
+		break;
+	case SSP_POLL_STORED:
+		// the note went into the payout
+		if (levels->pendingNoteValue) {
+			levelsAdd(levels, levels->pendingNoteValue, NULL, 1);
+		} else {
+			levels->valid = 0;
+		}
+		levels->pendingNoteValue = 0;
+		break;
+	case SSP_POLL_STACKED:
+		// the note went into the cashbox, no change
+		levels->pendingNoteValue = 0;
+		break;
+	case SSP_POLL_RESET:
+	case SSP_POLL_DISPENSED:
+	case SSP_POLL_FLOATED:
+	case SSP_POLL_CASHBOX_PAID:
+	case SSP_POLL_SMART_EMPTIED:
+	case SSP_POLL_EMPTY:
+	case SSP_POLL_INCOMPLETE_PAYOUT:
+	case SSP_POLL_INCOMPLETE_FLOAT:
+	case SSP_POLL_FRAUD_ATTEMPT:
+		levels->valid = 0;
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * \brief Callback function for the libEvent triggered "Reconcile" event, compares the cached levels
+ * with the hardware (see levelsRefresh()).
+ * \details Skipped while commands are waiting, so the comparison never delays a payout.
+ */
+void cbOnReconcileEvent(int fd, short event, void *privdata) {
+	struct m_metacash *metacash = privdata;
+
+	if (metacash->queue.length > 0) {
+		return;
+	}
+
+	hardwareWaitTime();
+	levelsRefresh(&metacash->hopper);
+
+	hardwareWaitTime();
+	levelsRefresh(&metacash->validator);
+}
+
+/** \brief Maximum number of values in a metrics snapshot */
+#define METRICS_MAX 160
+/** \brief Maximum length of the name of a metric (incl. the terminating zero) */
+#define METRIC_NAME_SIZE 40
+
+/**
+ * \brief A metrics snapshot.
+ * \details The values have flat names (e.g. "hopper.rttP99"), so the same snapshot is published
+ * as one JSON object and written to a redis hash (see publishMetrics()).
+ */
+struct m_metrics {
+	/** \brief Number of values */
+	unsigned int count;
+	/** \brief Names of the values */
+	char names[METRICS_MAX][METRIC_NAME_SIZE];
+	/** \brief The values */
+	unsigned long long values[METRICS_MAX];
+};
+
+void metricsAdd(struct m_metrics *metrics, unsigned long long value, const char *format, ...)
+		__attribute__ ((format (printf, 3, 4)));
+
+/**
+ * \brief Adds a value to the snapshot, the name is given as printf format.
+ */
+void metricsAdd(struct m_metrics *metrics, unsigned long long value, const char *format, ...) {
+	if (metrics->count == METRICS_MAX) {
+		return;
+	}
+
+	va_list varargs;
+	va_start(varargs, format);
+	vsnprintf(metrics->names[metrics->count], METRIC_NAME_SIZE, format, varargs);
+	va_end(varargs);
+
+	metrics->values[metrics->count++] = value;
+}
+
+/**
+ * \brief Adds the values of a device to the snapshot. The round-trip times are those since the
+ * last snapshot, the counters are totals.
+ */
+void metricsAddDevice(struct m_metrics *metrics, struct m_device *device, const char *prefix) {
+	struct m_ssp_stats *stats = &device->stats;
+
+	metricsAdd(metrics, stats->rtt.count, "%s.commands", prefix);
+	metricsAdd(metrics, histogramPercentile(&stats->rtt, 50.0), "%s.rttP50", prefix);
+	metricsAdd(metrics, histogramPercentile(&stats->rtt, 90.0), "%s.rttP90", prefix);
+	metricsAdd(metrics, histogramPercentile(&stats->rtt, 99.0), "%s.rttP99", prefix);
+	metricsAdd(metrics, stats->rtt.max, "%s.rttMax", prefix);
+	histogramReset(&stats->rtt);
+
+	metricsAdd(metrics, stats->timeouts, "%s.timeouts", prefix);
+	metricsAdd(metrics, stats->retries, "%s.retries", prefix);
+	metricsAdd(metrics, stats->packetErrors, "%s.packetErrors", prefix);
+	metricsAdd(metrics, stats->portErrors, "%s.portErrors", prefix);
+	metricsAdd(metrics, device->requestsExpired, "%s.expired", prefix);
+
+	for (unsigned int code = 0; code < 256; code++) {
+		if (device->events[code]) {
+			metricsAdd(metrics, device->events[code], "%s.events.0x%02X", prefix, code);
+		}
+	}
+}
+
+/**
+ * \brief Returns the resident set size of the process in kB (0 if unknown).
+ */
+unsigned long long residentSetSize() {
+	unsigned long long size = 0;
+	unsigned long long resident = 0;
+
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm == NULL) {
+		return 0;
+	}
+	if (fscanf(statm, "%llu %llu", &size, &resident) != 2) {
+		resident = 0;
+	}
+	fclose(statm);
+
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * \brief Publishes a metrics snapshot to the "payout-metrics" topic and writes it to the
+ * "payout-metrics" hash (one field per value).
+ * \details The counters are plain integers updated where the events happen, we are single
+ * threaded, so no locking or atomics are needed. The interval histograms are reset here.
+ */
+void publishMetrics(struct m_metacash *metacash) {
+	static struct m_metrics metrics;
+	static char values[METRICS_MAX][24];
+	static const char *argv[2 + 2 * METRICS_MAX];
+	static char *hash = NULL;
+
+	metrics.count = 0;
+
+	metricsAdd(&metrics, currentTimeMillis(), "ts");
+	metricsAdd(&metrics, metacash->pollCycle.count, "polls");
+	metricsAdd(&metrics, histogramPercentile(&metacash->pollCycle, 50.0), "pollP50");
+	metricsAdd(&metrics, histogramPercentile(&metacash->pollCycle, 99.0), "pollP99");
+	metricsAdd(&metrics, metacash->pollCycle.max, "pollMax");
+	histogramReset(&metacash->pollCycle);
+
+	metricsAdd(&metrics, metacash->requestIntake.count, "requests");
+	metricsAdd(&metrics, histogramPercentile(&metacash->requestIntake, 50.0), "requestP50");
+	metricsAdd(&metrics, histogramPercentile(&metacash->requestIntake, 99.0), "requestP99");
+	metricsAdd(&metrics, metacash->requestIntake.max, "requestMax");
+	histogramReset(&metacash->requestIntake);
+	metricsAdd(&metrics, metacash->requestHandling.count, "handled");
+	metricsAdd(&metrics, histogramPercentile(&metacash->requestHandling, 50.0), "handlingP50");
+	metricsAdd(&metrics, histogramPercentile(&metacash->requestHandling, 99.0), "handlingP99");
+	metricsAdd(&metrics, metacash->requestHandling.max, "handlingMax");
+	histogramReset(&metacash->requestHandling);
+	metricsAdd(&metrics, jsonAllocations, "jsonAllocs");
+	metricsAdd(&metrics, jsonHeapAllocations, "jsonHeapAllocs");
+
+	metricsAdd(&metrics, metacash->queue.length, "queueDepth");
+	metricsAdd(&metrics, outbound.used, "outboundBytes");
+	metricsAdd(&metrics, outbound.dropped, "outboundDropped");
+	metricsAdd(&metrics, eventSpool.lastSeq - eventSpool.acked, "spooled");
+	metricsAdd(&metrics, publishLink.reconnects + subscribeLink.reconnects + streamLink.reconnects, "reconnects");
+
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		metricsAdd(&metrics, usage.ru_utime.tv_sec * 1000ULL + usage.ru_utime.tv_usec / 1000, "cpuUserMs");
+		metricsAdd(&metrics, usage.ru_stime.tv_sec * 1000ULL + usage.ru_stime.tv_usec / 1000, "cpuSystemMs");
+	}
+	metricsAdd(&metrics, residentSetSize(), "rssKb");
+
+	metricsAddDevice(&metrics, &metacash->hopper, "hopper");
+	metricsAddDevice(&metrics, &metacash->validator, "validator");
+
+	// {"<name>":<value>,...}
+	char storage[REPLY_BUFFER_SIZE];
+	struct buffer json;
+	bufferInit(&json, storage, sizeof(storage));
+	bufferAppendChar(&json, '{');
+	for (unsigned int i = 0; i < metrics.count; i++) {
+		if (i > 0) {
+			bufferAppendChar(&json, ',');
+		}
+		bufferAppendJsonString(&json, metrics.names[i]);
+		bufferAppendChar(&json, ':');
+		bufferAppendUnsigned(&json, metrics.values[i]);
+	}
+	bufferAppendChar(&json, '}');
+
+	replyWith(&payoutMetricsTopic, "%s", json.data);
+	bufferFree(&json);
+
+	// HSET <hash> <name> <value> ...
+	if (hash == NULL) {
+		asprintf(&hash, "%spayout-metrics", namespacePrefix);
+	}
+	argv[0] = "HSET";
+	argv[1] = hash;
+	for (unsigned int i = 0; i < metrics.count; i++) {
+		snprintf(values[i], sizeof(values[i]), "%llu", metrics.values[i]);
+		argv[2 + 2 * i] = metrics.names[i];
+		argv[3 + 2 * i] = values[i];
+	}
+
+	char *command;
+	int len = redisFormatCommandArgv(&command, 2 + 2 * metrics.count, argv, NULL);
+	if (len > 0) {
+		redisSend(command, len);
+		free(command);
+	}
+}
+
+/**
+ * \brief Callback function for the libEvent triggered "Metrics" event.
+ */
+void cbOnMetricsEvent(int fd, short event, void *privdata) {
+	publishMetrics(privdata);
+}
+
 /**
  * \brief Initializes an ITL hardware device via SSP
  */
@@ -1928,12 +4883,11 @@ void mcSspInitializeDevice(SSP_COMMAND *sspC, unsigned long long key,
 				sspSetupReq->ChannelData[i].cc);
 	}
 
-	char version[100];
-	mc_ssp_get_firmware_version(sspC, &version[0]);
-	syslog(LOG_INFO, "full firmware version: %s\n", version);
-
-	mc_ssp_get_dataset_version(sspC, &version[0]);
-	syslog(LOG_INFO, "full dataset version : %s\n", version);
+	if (deviceInfoLoad(device) == SSP_RESPONSE_OK) {
+		syslog(LOG_INFO, "full firmware version: %s\n", device->info.firmwareVersion);
+		syslog(LOG_INFO, "full dataset version : %s\n", device->info.datasetVersion);
+		syslog(LOG_INFO, "serial number        : %lu\n", device->info.serialNumber);
+	}
 
 	//enable the device
 	if (ssp6_enable(sspC) != SSP_RESPONSE_OK) {
@@ -2047,6 +5001,27 @@ SSP_RESPONSE_ENUM mc_ssp_set_refill_mode(SSP_COMMAND *sspC) {
 	return resp;
 }
 
+/**
+ * \brief Implements the "POLL" command from the SSP Protocol, the events are decoded from the
+ * response by a m_poll_iterator.
+ */
+SSP_RESPONSE_ENUM mc_ssp_poll(SSP_COMMAND *sspC) {
+	sspC->CommandDataLength = 1;
+	sspC->CommandData[0] = SSP_CMD_POLL;
+
+	//CHECK FOR TIMEOUT
+	if (send_ssp_command(sspC) == 0) {
+		return SSP_RESPONSE_TIMEOUT;
+	}
+
+	// extract the device response code
+	SSP_RESPONSE_ENUM resp = (SSP_RESPONSE_ENUM) sspC->ResponseData[0];
+
+	// the events are decoded by pollIteratorNext()
+
+	return resp;
+}
+
 /**
  * \brief Implements the "EMPTY" command from the SSP Protocol.
  */
@@ -2088,7 +5063,7 @@ SSP_RESPONSE_ENUM mc_ssp_smart_empty(SSP_COMMAND *sspC) {
 }
 
 
-SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char **json) {
+SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, struct buffer *json) {
 	sspC->CommandDataLength = 1;
 	sspC->CommandData[0] = SSP_CMD_CASHBOX_PAYOUT_OPERATION_DATA;
 
@@ -2114,9 +5089,6 @@ SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char *
 	i++; // move onto numCounters
 	int numCounters = sspC->ResponseData[i];
 
-	/* Create StringBuffer 'object' (struct) */
-	SB *sb = getStringBuffer();
-
 	int j; // current counter
 	for (j = 0; j < numCounters; ++j) {
 		int k;
@@ -2143,17 +5115,10 @@ SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char *
 					sspC->ResponseData[i];
 		}
 
-		char *response = NULL;
-		asprintf(&response,
-				"{\"value\":%d,\"level\":%d,\"cc\":\"%s\"}", value, level, cc);
-
 		if(j > 0) {
-			char *sep = ",";
-			sb->append( sb, sep); // json array seperator
+			bufferAppendChar(json, ','); // json array seperator
 		}
-		sb->append( sb, response);
-
-		free(response);
+		levelToJson(json, value, level, cc);
 	}
 
 	/* quantity of unknown coins */
@@ -2165,24 +5130,12 @@ SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char *
 					(((unsigned long) sspC->ResponseData[i])
 							<< (8 * k));
 		}
-		char *response = NULL;
-		asprintf(&response,
-				",{\"value\":0,\"level\":%d}", qtyUnknown);
 		// json array seperator and value are constant here
-
-		sb->append( sb, response);
-
-		free(response);
+		bufferAppendString(json, ",{\"value\":0,\"level\":");
+		bufferAppendSigned(json, qtyUnknown);
+		bufferAppendChar(json, '}');
 	}
 
-	/* Call toString() function to get catenated list */
-	char *result = sb->toString( sb );
-
-	asprintf(json, "%s", result);
-
-	/* Dispose of StringBuffer's memory */
-	sb->dispose( &sb ); /* Note: Need to pass ADDRESS of struct pointer to dispose() */
-
 	return resp;
 }
 
@@ -2251,7 +5204,7 @@ SSP_RESPONSE_ENUM mc_ssp_set_denomination_level(SSP_COMMAND *sspC, int amount, i
 /**
  * \brief Implements the "GET ALL LEVELS" command from the SSP Protocol.
  */
-SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json) {
+SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, struct m_levels *levels) {
 	sspC->CommandDataLength = 1;
 	sspC->CommandData[0] = SSP_CMD_GET_ALL_LEVELS;
 
@@ -2262,6 +5215,9 @@ SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json) {
 
 	// extract the device response code
 	SSP_RESPONSE_ENUM resp = (SSP_RESPONSE_ENUM) sspC->ResponseData[0];
+	if (resp != SSP_RESPONSE_OK) {
+		return resp;
+	}
 
 	/* The first data byte in the response is the number of counters returned. Each counter consists of 9 bytes of
 	 * data made up as: 2 bytes giving the denomination level, 4 bytes giving the value and 3 bytes of ASCII country
@@ -2271,58 +5227,40 @@ SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json) {
 	int i = 0;
 
 	i++; // move onto numCounters
-	int numCounters = sspC->ResponseData[i];
+	unsigned int numCounters = sspC->ResponseData[i];
+	if (numCounters > MAX_DENOMINATIONS) {
+		numCounters = MAX_DENOMINATIONS;
+	}
 
-	/* Create StringBuffer 'object' (struct) */
-	SB *sb = getStringBuffer();
+	levels->count = numCounters;
 
-	int j; // current counter
-	for (j = 0; j < numCounters; ++j) {
+	for (unsigned int j = 0; j < numCounters; ++j) {
+		struct m_level *entry = &levels->entries[j];
 		int k;
 
-		int value = 0;
-		int level = 0;
-		char cc[4] = {0};
+		entry->value = 0;
+		entry->level = 0;
 
 		for (k = 0; k < 2; ++k) {
 			i++; //move through the 2 bytes of data
-			level +=
+			entry->level +=
 					(((unsigned long) sspC->ResponseData[i])
 							<< (8 * k));
 		}
 		for (k = 0; k < 4; ++k) {
 			i++; //move through the 4 bytes of data
-			value +=
+			entry->value +=
 					(((unsigned long) sspC->ResponseData[i])
 							<< (8 * k));
 		}
 		for (k = 0; k < 3; ++k) {
 			i++; //move through the 3 bytes of country code
-			cc[k] =
+			entry->cc[k] =
 					sspC->ResponseData[i];
 		}
-
-		char *response = NULL;
-		asprintf(&response,
-				"{\"value\":%d,\"level\":%d,\"cc\":\"%s\"}", value, level, cc);
-
-		if(j > 0) {
-			char *sep = ",";
-			sb->append( sb, sep); // json array seperator
-		}
-		sb->append( sb, response);
-
-		free(response);
+		entry->cc[3] = 0;
 	}
 
-	/* Call toString() function to get catenated list */
-	char *result = sb->toString( sb );
-
-	asprintf(json, "%s", result);
-
-	/* Dispose of StringBuffer's memory */
-	sb->dispose( &sb ); /* Note: Need to pass ADDRESS of struct pointer to dispose() */
-
 	return resp;
 }
 
@@ -2391,6 +5329,31 @@ SSP_RESPONSE_ENUM mc_ssp_get_firmware_version(SSP_COMMAND *sspC, char *firmwareV
 	return resp;
 }
 
+/**
+ * \brief Implements the "SERIAL NUMBER" command from the SSP Protocol.
+ */
+SSP_RESPONSE_ENUM mc_ssp_get_serial_number(SSP_COMMAND *sspC, unsigned long *serialNumber) {
+	sspC->CommandDataLength = 1;
+	sspC->CommandData[0] = SSP_CMD_SERIAL_NUMBER;
+
+	//CHECK FOR TIMEOUT
+	if (send_ssp_command(sspC) == 0) {
+		return SSP_RESPONSE_TIMEOUT;
+	}
+
+	// extract the device response code
+	SSP_RESPONSE_ENUM resp = (SSP_RESPONSE_ENUM) sspC->ResponseData[0];
+	if(resp == SSP_RESPONSE_OK) {
+		// 4 bytes, big endian
+		*serialNumber = 0;
+		for(int i = 0; i < 4; i++) {
+			*serialNumber = (*serialNumber << 8) | sspC->ResponseData[1 + i];
+		}
+	}
+
+	return resp;
+}
+
 /**
  * \brief Implements the "GET DATASET VERSION" command from the SSP Protocol.
  */
@@ -0,0 +1,6 @@
+#!/bin/bash
+
+UUID=`uuidgen`
+COMMAND="{ \"cmd\":\"get-device-info\", \"msgId\":\"${UUID}\" }"
+
+redis-cli publish hopper-request "${COMMAND}" 
@@ -0,0 +1,7 @@
+#!/bin/bash
+
+UUID=`uuidgen`
+CHANNELS=$1
+COMMAND="{ \"cmd\":\"batch\", \"msgId\":\"${UUID}\", \"steps\":[ { \"cmd\":\"disable\" }, { \"cmd\":\"enable-channels\", \"channels\":\"${CHANNELS}\" }, { \"cmd\":\"get-all-levels\" }, { \"cmd\":\"enable\" } ] }"
+
+redis-cli publish validator-request "${COMMAND}" 
@@ -0,0 +1,6 @@
+#!/bin/bash
+
+UUID=`uuidgen`
+COMMAND="{ \"cmd\":\"get-stats\", \"msgId\":\"${UUID}\" }"
+
+redis-cli publish validator-request "${COMMAND}" 